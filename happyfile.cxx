@@ -8,21 +8,42 @@
 #endif
 
 #include <cerrno>
+#include <chrono>
 #include <cstdio>
 #include <cstring>
+#include <thread>
+
+#include <sys/stat.h>
+#ifdef __linux__
+# include <poll.h>
+# include <sys/inotify.h>
+#endif
 
 #ifdef WIN32
 # include <fcntl.h>
 #endif
 
 #include "happyfile.hxx"
+#include "profiler.hxx"
+#include "tivo_probes.hxx"
 
 void HappyFile::init()
 {
-    std::setvbuf(fh, rawbuf, _IOFBF, RAWBUFSIZE);
+    if (fh)
+        std::setvbuf(fh, rawbuf, _IOFBF, RAWBUFSIZE);
     pos = 0;
     buffer_start = 0;
     buffer_fill = 0;
+    bytes_written = 0;
+    memory = false;
+    queue.clear();
+    queue_head = 0;
+    queue_eof = false;
+    sink = NULL;
+    sink_context = NULL;
+    follow_idle = 0;
+    follow_flush = NULL;
+    notify = -1;
 }
 
 int HappyFile::open(const char *filename, const char *mode)
@@ -53,21 +74,80 @@ int HappyFile::attach(FILE *handle)
     return 1;
 }
 
+/*
+ * A file with no file behind it: data pushed in with feed() or write()
+ * is read out in order, and finish() marks its end.  Seeks read forwards.
+ */
+int HappyFile::attachQueue()
+{
+    fh = NULL;
+    attached = true;
+    init();
+    memory = true;
+    return 1;
+}
+
+// An output with no file behind it: each write() is passed to pSink.
+int HappyFile::attachSink(HappyFileSink pSink, void *pContext)
+{
+    fh = NULL;
+    attached = true;
+    init();
+    sink = pSink;
+    sink_context = pContext;
+    return 1;
+}
+
+void HappyFile::feed(const void *ptr, size_t size)
+{
+    // drop what has been read once it is most of the queue
+    if (queue_head && (queue_head >= queue.size() / 2))
+    {
+        queue.erase(queue.begin(), queue.begin() + queue_head);
+        queue_head = 0;
+    }
+
+    queue.insert(queue.end(), (const char *)ptr, (const char *)ptr + size);
+}
+
+void HappyFile::finish()
+{
+    queue_eof = true;
+}
+
 int HappyFile::close()
 {
+#ifdef __linux__
+    if (notify >= 0)
+        ::close(notify);
+    notify = -1;
+#endif
+
     if (!attached)
         return std::fclose(fh);
     else
         return 0;
 }
 
-size_t HappyFile::read(void *ptr, size_t size)
+size_t HappyFile::read(void *ptr, size_t size, bool some)
 {
     size_t nbytes = 0;
 
     if (size == 0)
         return 0;
 
+    if (memory)
+    {
+        nbytes = queue.size() - queue_head;
+        if (nbytes > size)
+            nbytes = size;
+
+        std::memcpy(ptr, &queue[queue_head], nbytes);
+        queue_head += nbytes;
+        pos += (hoff_t)nbytes;
+        return nbytes;
+    }
+
     if ((pos + (hoff_t)size) - buffer_start <= buffer_fill)
     {
         std::memcpy(ptr, buffer + (pos - buffer_start), size);
@@ -81,13 +161,30 @@ size_t HappyFile::read(void *ptr, size_t size)
         nbytes += (size_t)(buffer_fill - (pos - buffer_start));
     }
 
+    // a sink has nothing to read back
+    if (!fh)
+        return nbytes;
+
+    PROFILE(PROF_READ);
+
     do
     {
         buffer_start += buffer_fill;
         buffer_fill = (hoff_t)std::fread(buffer, 1, BUFFERSIZE, fh);
 
         if (buffer_fill == 0)
+        {
+            if (some && nbytes)
+                break;
+
+            if ((follow_idle > 0) && waitGrowth())
+            {
+                std::clearerr(fh);
+                continue;
+            }
+
             break;
+        }
 
         std::memcpy((char *)ptr + nbytes, buffer,
                     (hoff_t)(size - nbytes) < buffer_fill ?
@@ -102,7 +199,20 @@ size_t HappyFile::read(void *ptr, size_t size)
 
 size_t HappyFile::write(void *ptr, size_t size)
 {
-    return std::fwrite(ptr, 1, size, fh);
+    PROFILE(PROF_WRITE);
+
+    size_t nbytes = size;
+
+    if (sink)
+        sink(sink_context, ptr, size);
+    else if (memory)
+        feed(ptr, size);
+    else
+        nbytes = std::fwrite(ptr, 1, size, fh);
+
+    TD_PROBE(write, nbytes, written());
+    bytes_written.fetch_add((hoff_t)nbytes, std::memory_order_relaxed);
+    return nbytes;
 }
 
 hoff_t HappyFile::tell()
@@ -110,9 +220,164 @@ hoff_t HappyFile::tell()
     return pos;
 }
 
+// Bytes written through write() since the file was opened, or truncate().
+hoff_t HappyFile::written()
+{
+    return bytes_written.load(std::memory_order_relaxed);
+}
+
+/*
+ * Read on at the end of a file that is still being written: flush pFlush,
+ * as the output so far is all there is for now, and wait for the file to
+ * grow, until its size has not changed for idleSeconds.
+ */
+void HappyFile::follow(double idleSeconds, HappyFile *pFlush)
+{
+    follow_idle  = idleSeconds;
+    follow_flush = pFlush;
+}
+
+/*
+ * At the end of a followed file, whether it has grown within the idle time.
+ * It is watched with inotify where there is one, and polled otherwise.
+ */
+bool HappyFile::waitGrowth()
+{
+    std::chrono::steady_clock::time_point idle =
+        std::chrono::steady_clock::now();
+    hoff_t have = buffer_start + buffer_fill;
+
+    if (follow_flush)
+        follow_flush->flush();
+
+#ifdef __linux__
+    if (notify < 0)
+    {
+        char path[32];
+        std::snprintf(path, sizeof(path), "/proc/self/fd/%d", fileno(fh));
+
+        notify = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+        if ((notify >= 0) &&
+            (inotify_add_watch(notify, path, IN_MODIFY | IN_CLOSE_WRITE) < 0))
+        {
+            ::close(notify);
+            notify = -1;
+        }
+    }
+#endif
+
+    while (1)
+    {
+        hoff_t now = size();
+
+        if (now > have)
+            return true;
+
+        // gone, or cut short
+        if (now < have)
+            return false;
+
+        if (std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                          idle).count() >= follow_idle)
+            return false;
+
+#ifdef __linux__
+        if (notify >= 0)
+        {
+            struct pollfd pfd;
+            char events[4096];
+
+            pfd.fd     = notify;
+            pfd.events = POLLIN;
+
+            if (poll(&pfd, 1, FOLLOW_POLL_MS) > 0)
+                while (::read(notify, events, sizeof(events)) > 0)
+                    ;
+            continue;
+        }
+#endif
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(FOLLOW_POLL_MS));
+    }
+}
+
+// Hand what was written on to the file.
+int HappyFile::flush()
+{
+    if (!fh)
+        return 0;
+
+    return std::fflush(fh);
+}
+
+// Flush what was written and commit it to disk.
+int HappyFile::sync()
+{
+    if (!fh || (std::fflush(fh) != 0))
+        return -1;
+
+#ifdef WIN32
+    return _commit(_fileno(fh));
+#else
+    return fsync(fileno(fh));
+#endif
+}
+
+/*
+ * Cut a file opened for update to length bytes and write on from there,
+ * counting them as written.
+ */
+int HappyFile::truncate(hoff_t length)
+{
+    if (!fh || (std::fflush(fh) != 0))
+        return -1;
+
+#ifdef WIN32
+    if (_chsize_s(_fileno(fh), length) != 0)
+        return -1;
+#else
+    if (ftruncate(fileno(fh), length) < 0)
+        return -1;
+#endif
+
+    if (seek(length) < 0)
+        return -1;
+
+    bytes_written = length;
+    return 0;
+}
+
+hoff_t HappyFile::size()
+{
+    struct stat st;
+
+    if (!fh)
+        return -1;
+
+    if (fstat(fileno(fh), &st) < 0 || !S_ISREG(st.st_mode))
+        return -1;
+
+    return (hoff_t)st.st_size;
+}
+
 int HappyFile::seek(hoff_t offset)
 {
-    static char junk_buf[4096];
+    char junk_buf[4096];
+
+#ifdef HAVE_FSEEKO
+    // named files can be positioned directly, in either direction;
+    // pipes have to be read through
+    if (!attached)
+    {
+        if (fseeko(fh, offset, SEEK_SET) < 0)
+            return -1;
+
+        pos          = offset;
+        buffer_start = offset;
+        buffer_fill  = 0;
+        return 0;
+    }
+#endif
 
     int t = (int)((offset - pos) & 0xfff);
     hoff_t u = (offset - pos) >> 12;
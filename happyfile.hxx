@@ -29,6 +29,9 @@
 
 #include <cstdio>
 
+#include <atomic>
+#include <vector>
+
 #ifndef RAWBUFSIZE
 #define RAWBUFSIZE 65536
 #endif
@@ -37,6 +40,12 @@
 #define BUFFERSIZE 4096
 #endif
 
+// follow(): how often a growing file is looked at without inotify
+#define FOLLOW_POLL_MS 250
+
+// --follow without seconds: how long a file may stop growing before it ends
+#define FOLLOW_IDLE_SECONDS 30
+
 #if SIZEOF_OFF_T == 8
 typedef off_t hoff_t;
 #elif defined (WIN32)
@@ -46,6 +55,9 @@ typedef __int64 hoff_t;
 typedef off_t hoff_t;
 #endif
 
+// where writes go for a file made with attachSink()
+typedef void (*HappyFileSink)(void *pContext, const void *ptr, size_t size);
+
 class HappyFile
 {
     private:
@@ -60,19 +72,56 @@ class HappyFile
         char rawbuf[RAWBUFSIZE];
         char buffer[BUFFERSIZE];
 
+        // may be read while another thread writes
+        std::atomic<hoff_t> bytes_written;
+
+        // attachQueue(): data fed or written in, read from queue_head
+        bool memory;
+        std::vector<char> queue;
+        size_t queue_head;
+        bool queue_eof;
+
+        // attachSink(): output handed to sink
+        HappyFileSink sink;
+        void *sink_context;
+
+        // follow(): waiting at the end for more
+        double follow_idle;
+        HappyFile *follow_flush;
+        int notify;
+
         void init();
+        bool waitGrowth();
 
     public:
         int open(const char *filename, const char *mode);
         int attach(FILE *fh);
+        int attachQueue();
+        int attachSink(HappyFileSink pSink, void *pContext);
+        void follow(double idleSeconds, HappyFile *pFlush);
 
         int close();
 
-        size_t read(void *ptr, size_t size);
+        void feed(const void *ptr, size_t size);
+        void finish();
+
+        // a queue holding less than need bytes, with more to come
+        inline bool starved(size_t need)
+            { return memory && !queue_eof &&
+                     (queue.size() - queue_head < need); }
+
+        // some: a followed file at its end gives back what it has, if
+        // anything, rather than waiting for the rest of size
+        size_t read(void *ptr, size_t size, bool some = false);
         size_t write(void *ptr, size_t size);
 
         hoff_t tell();
+        hoff_t size();
+        hoff_t written();
         int seek(hoff_t offset);
+        int flush();
+        int sync();
+        int truncate(hoff_t length);
 };
 
 #endif
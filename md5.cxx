@@ -238,10 +238,6 @@ void MD5::result(uint8_t *digest)
 #endif
 }
 
-#ifdef WORDS_BIGENDIAN
-static uint32_t X[16];
-#endif
-
 void MD5::calc(uint8_t *b64)
 {
     uint32_t A = md5_sta;
@@ -254,6 +250,7 @@ void MD5::calc(uint8_t *b64)
 #else
     /* 4 byte words */
     /* what a brute force but fast! */
+    uint32_t X[16];
     uint8_t *y = (uint8_t *)X;
 
     y[0] = b64[3];
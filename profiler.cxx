@@ -0,0 +1,367 @@
+/*
+ * tivodecode-ng
+ * Copyright 2006-2015, Jeremy Drake et al.
+ * See COPYING file for license terms
+ */
+#ifdef HAVE_CONFIG_H
+#include "tdconfig.h"
+#endif
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include <atomic>
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_TSC
+#endif
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define PROFILE_PERF
+#endif
+
+#include "profiler.hxx"
+
+#define PROF_DEPTH      16
+#define PROF_COUNTERS   2       // cycles, cache misses
+
+// ticks between reads of the counters, about a millisecond at 3GHz
+#define PROF_SAMPLE     (3ULL << 20)
+
+bool o_profile;
+
+static const char *stageNames[PROF_STAGES] = {
+    "parse", "read", "pes", "key", "keystream", "xor", "write"
+};
+
+static std::atomic<uint64_t> profTicks[PROF_STAGES];
+static std::atomic<uint64_t> profCalls[PROF_STAGES];
+static std::atomic<uint64_t> profCount[PROF_STAGES][PROF_COUNTERS];
+
+static bool              profCounters;
+static std::atomic<bool> profCountersFailed;
+static uint64_t          profTicks0;
+static uint64_t          profNanos0;
+
+/*
+ * The stages open on this thread, innermost last.  With counters, their
+ * group leader and member, and the ticks each stage (and no stage) has
+ * had since they were last read.  The counters are closed as the thread
+ * exits.
+ */
+struct ProfileThread
+{
+    ~ProfileThread();
+
+    int             depth;
+    ProfileStage    stack[PROF_DEPTH];
+    uint64_t        start;
+    int             perfFd;
+    int             perfMemberFd;
+    uint64_t        startCount[PROF_COUNTERS];
+    uint64_t        sampleStart;
+    uint64_t        sampleTicks[PROF_STAGES];
+    uint64_t        sampleIdle;
+};
+
+static thread_local ProfileThread profThread =
+    { 0, {}, 0, -1, -1, {}, 0, {}, 0 };
+
+static uint64_t nanos()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t ticks()
+{
+#ifdef PROFILE_TSC
+    return __rdtsc();
+#else
+    return nanos();
+#endif
+}
+
+#ifdef PROFILE_PERF
+static int perf_open(uint64_t config, int group)
+{
+    struct perf_event_attr attr;
+
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size           = sizeof(attr);
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.config         = config;
+    attr.read_format    = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+#endif
+
+/*
+ * Open this thread's cycle and cache miss counters as one group, so both
+ * come back from a single read.
+ */
+static void counters_open(ProfileThread *pThread)
+{
+#ifdef PROFILE_PERF
+    int leader = perf_open(PERF_COUNT_HW_CPU_CYCLES, -1);
+    int member = -1;
+
+    if ((leader >= 0) &&
+        ((member = perf_open(PERF_COUNT_HW_CACHE_MISSES, leader)) >= 0))
+    {
+        ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        pThread->perfFd       = leader;
+        pThread->perfMemberFd = member;
+        return;
+    }
+
+    if (leader >= 0)
+        close(leader);
+#endif
+
+    profCountersFailed = true;
+}
+
+static void counters_read(ProfileThread *pThread, uint64_t *pValues)
+{
+#ifdef PROFILE_PERF
+    uint64_t group[1 + PROF_COUNTERS];
+
+    if (read(pThread->perfFd, group, sizeof(group)) == sizeof(group))
+    {
+        std::memcpy(pValues, &group[1], sizeof(uint64_t) * PROF_COUNTERS);
+        return;
+    }
+#endif
+
+    std::memset(pValues, 0, sizeof(uint64_t) * PROF_COUNTERS);
+}
+
+/*
+ * Read the counters and share what they have counted since the last read
+ * among the stages by the ticks each had; the share of the time outside
+ * any stage is dropped.
+ */
+static void counters_sample(ProfileThread *pThread, uint64_t now)
+{
+    uint64_t values[PROF_COUNTERS];
+    uint64_t total = pThread->sampleIdle;
+
+    counters_read(pThread, values);
+
+    for (int s = 0; s < PROF_STAGES; s++)
+        total += pThread->sampleTicks[s];
+
+    for (int i = 0; (total > 0) && (i < PROF_COUNTERS); i++)
+    {
+        double perTick = (double)(values[i] - pThread->startCount[i]) / total;
+
+        for (int s = 0; s < PROF_STAGES; s++)
+        {
+            if (pThread->sampleTicks[s])
+                profCount[s][i].fetch_add(
+                    (uint64_t)(perTick * pThread->sampleTicks[s] + 0.5),
+                    std::memory_order_relaxed);
+        }
+    }
+
+    std::memcpy(pThread->startCount, values, sizeof(values));
+    std::memset(pThread->sampleTicks, 0, sizeof(pThread->sampleTicks));
+    pThread->sampleIdle  = 0;
+    pThread->sampleStart = now;
+}
+
+// What the counters have counted since the last read is not lost.
+ProfileThread::~ProfileThread()
+{
+    if (perfFd < 0)
+        return;
+
+    counters_sample(this, ticks());
+
+#ifdef PROFILE_PERF
+    close(perfMemberFd);
+    close(perfFd);
+#endif
+    perfMemberFd = -1;
+    perfFd       = -1;
+}
+
+// Charge the time since the last transition to the innermost stage.
+static void charge(ProfileThread *pThread, uint64_t now)
+{
+    int level = (pThread->depth < PROF_DEPTH) ? pThread->depth : PROF_DEPTH;
+    ProfileStage stage = pThread->stack[level - 1];
+
+    profTicks[stage].fetch_add(now - pThread->start,
+                               std::memory_order_relaxed);
+
+    if (pThread->perfFd >= 0)
+    {
+        pThread->sampleTicks[stage] += now - pThread->start;
+
+        if (now - pThread->sampleStart >= PROF_SAMPLE)
+            counters_sample(pThread, now);
+    }
+
+    pThread->start = now;
+}
+
+void profile_enter(ProfileStage stage)
+{
+    ProfileThread *pThread = &profThread;
+    uint64_t now = ticks();
+
+    if (pThread->depth == 0)
+    {
+        if (profCounters && (pThread->perfFd < 0) && !profCountersFailed)
+        {
+            counters_open(pThread);
+
+            // opening them is not charged to the stage
+            now = ticks();
+
+            if (pThread->perfFd >= 0)
+            {
+                counters_read(pThread, pThread->startCount);
+                pThread->sampleStart = now;
+                pThread->start       = now;
+            }
+        }
+
+        if (pThread->perfFd >= 0)
+            pThread->sampleIdle += now - pThread->start;
+    }
+    else
+    {
+        charge(pThread, now);
+    }
+
+    profCalls[stage].fetch_add(1, std::memory_order_relaxed);
+
+    // deeper scopes are charged to the innermost one kept
+    if (pThread->depth < PROF_DEPTH)
+        pThread->stack[pThread->depth] = stage;
+
+    pThread->depth++;
+    pThread->start = now;
+}
+
+void profile_leave()
+{
+    ProfileThread *pThread = &profThread;
+    uint64_t now = ticks();
+
+    charge(pThread, now);
+    pThread->depth--;
+
+    // the last of the decode, before the report
+    if ((pThread->depth == 0) && (pThread->perfFd >= 0) &&
+        (PROF_PARSE == pThread->stack[0]))
+        counters_sample(pThread, now);
+}
+
+/*
+ * Turn profiling on.  With counters, cycles and cache misses are also
+ * read through perf_event_open about every PROF_SAMPLE ticks, rather than
+ * at each stage change with a system call each time, and shared among
+ * the stages run in between by their time.
+ */
+void profile_start(bool counters)
+{
+    profTicks0   = ticks();
+    profNanos0   = nanos();
+    profCounters = counters;
+    o_profile    = true;
+}
+
+void profile_report(FILE *pTable, FILE *pJson)
+{
+    uint64_t wallTicks = ticks() - profTicks0;
+    uint64_t wallNanos = nanos() - profNanos0;
+    double   scale     = wallTicks ? (double)wallNanos / wallTicks : 0;
+    bool     counters  = profCounters && !profCountersFailed;
+    uint64_t staged    = 0;
+
+    for (int i = 0; i < PROF_STAGES; i++)
+        staged += profTicks[i].load();
+
+    if (pTable)
+    {
+        std::fprintf(pTable, "\n%-10s %12s %12s %7s", "stage", "calls",
+                     "time (ms)", "share");
+        if (counters)
+            std::fprintf(pTable, " %14s %12s", "cycles", "cache misses");
+        std::fprintf(pTable, "\n");
+
+        for (int i = 0; i < PROF_STAGES; i++)
+        {
+            uint64_t stageTicks = profTicks[i].load();
+
+            std::fprintf(pTable, "%-10s %12llu %12.3f %6.1f%%",
+                         stageNames[i],
+                         (unsigned long long)profCalls[i].load(),
+                         stageTicks * scale / 1e6,
+                         wallTicks ? 100.0 * stageTicks / wallTicks : 0.0);
+            if (counters)
+                std::fprintf(pTable, " %14llu %12llu",
+                             (unsigned long long)profCount[i][0].load(),
+                             (unsigned long long)profCount[i][1].load());
+            std::fprintf(pTable, "\n");
+        }
+
+        // headers, metadata and shutdown; negative with several threads
+        if (wallTicks > staged)
+            std::fprintf(pTable, "%-10s %12s %12.3f %6.1f%%\n", "other", "",
+                         (wallTicks - staged) * scale / 1e6,
+                         100.0 * (wallTicks - staged) / wallTicks);
+
+        std::fprintf(pTable, "%-10s %12s %12.3f\n", "wall", "",
+                     wallNanos / 1e6);
+        if (profCounters && profCountersFailed)
+            std::fprintf(pTable, "hardware counters not available\n");
+    }
+
+    if (pJson)
+    {
+        std::fprintf(pJson, "{\"clock\": \"%s\", \"wall_ns\": %llu, "
+                     "\"stages\": {",
+#ifdef PROFILE_TSC
+                     "tsc",
+#else
+                     "clock_gettime",
+#endif
+                     (unsigned long long)wallNanos);
+
+        for (int i = 0; i < PROF_STAGES; i++)
+        {
+            std::fprintf(pJson, "%s\"%s\": {\"calls\": %llu, \"ns\": %llu",
+                         i ? ", " : "", stageNames[i],
+                         (unsigned long long)profCalls[i].load(),
+                         (unsigned long long)(profTicks[i].load() * scale));
+            if (counters)
+                std::fprintf(pJson, ", \"cycles\": %llu, "
+                             "\"cache_misses\": %llu",
+                             (unsigned long long)profCount[i][0].load(),
+                             (unsigned long long)profCount[i][1].load());
+            std::fprintf(pJson, "}");
+        }
+
+        std::fprintf(pJson, "}}\n");
+    }
+}
+
+/* vi:set ai ts=4 sw=4 expandtab: */
@@ -0,0 +1,53 @@
+/*
+ * tivodecode-ng
+ * Copyright 2006-2015, Jeremy Drake et al.
+ * See COPYING file for license terms
+ */
+
+#ifndef PROFILER_HXX_
+#define PROFILER_HXX_
+
+#include <cstdio>
+
+typedef enum
+{
+    PROF_PARSE = 0,     // demux and header parsing, the decode loop itself
+    PROF_READ,
+    PROF_PES,
+    PROF_KEY,
+    PROF_KEYSTREAM,
+    PROF_XOR,
+    PROF_WRITE,
+    PROF_STAGES
+} ProfileStage;
+
+extern bool o_profile;
+
+void profile_start(bool counters);
+void profile_report(FILE *pTable, FILE *pJson);
+
+void profile_enter(ProfileStage stage);
+void profile_leave();
+
+/*
+ * Charges the time until the end of the enclosing scope to stage.  Scopes
+ * nest; time spent in an inner scope is charged to it alone.  With
+ * profiling off the cost is one predictable branch.
+ */
+class ProfileScope
+{
+    private:
+        bool active;
+
+    public:
+        inline ProfileScope(ProfileStage stage) : active(o_profile)
+            { if (__builtin_expect(active, 0)) profile_enter(stage); }
+        inline ~ProfileScope()
+            { if (__builtin_expect(active, 0)) profile_leave(); }
+};
+
+#define PROFILE(stage)  ProfileScope profileScope(stage)
+
+#endif /* PROFILER_HXX_ */
+
+/* vi:set ai ts=4 sw=4 expandtab: */
@@ -0,0 +1,630 @@
+/*
+ * tivodecode-ng
+ * Copyright 2006-2015, Jeremy Drake et al.
+ * See COPYING file for license terms
+ *
+ * Microbenchmarks for the decode kernels, and end to end decodes of
+ * real files.  Built and run by "make bench".
+ */
+#ifdef HAVE_CONFIG_H
+#include "tdconfig.h"
+#endif
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+# define HAVE_TSC 1
+#endif
+
+#include "getopt_long.h"
+
+#include "cli_common.hxx"
+#include "sha1.hxx"
+#include "Turing.hxx"
+#include "turing_stream.hxx"
+#include "tivo_parse.hxx"
+#include "tivo_decoder_ts.hxx"
+#include "tivo_decoder_mpeg_parser.hxx"
+#include "tivo_stream_decoder.hxx"
+
+#define BENCH_REPS      5
+#define MB              (1024.0 * 1024.0)
+#define SCRATCH_SIZE    (64 << 20)
+
+// read from disk at a time by the end to end decodes
+#define BENCH_CHUNK     (1 << 20)
+
+typedef struct
+{
+    std::string name;
+    double      bytes;      // per iteration
+    uint64_t    iterations; // per repetition
+    double      seconds;    // best repetition
+    double      cycles;     // TSC ticks for that repetition, 0 if none
+} BenchResult;
+
+// One repetition of a benchmark: runs the kernel n times.
+typedef void (*BenchFunc)(void *pArg, uint64_t n);
+
+static std::vector<BenchResult> results;
+static double o_min_time = 0.5;
+
+static struct option long_options[] = {
+    {"mak", 1, 0, 'm'},
+    {"out", 1, 0, 'o'},
+    {"time", 1, 0, 'T'},
+    {"filter", 1, 0, 'f'},
+    {"version", 0, 0, 'V'},
+    {"help", 0, 0, 'h'},
+    {0, 0, 0, 0}
+};
+
+static void do_help(const char *arg0, int exitval)
+{
+    std::cerr << "Usage: " << arg0 << " [--help] [{--mak|-m} mak] "
+        "[{--out|-o} jsonfile] [{--time|-T} seconds] [{--filter|-f} name] "
+        "[<tivofile> ...]\n\n"
+        " -m, --mak         media access key for the end to end decodes\n"
+        " -o, --out,        write the results as JSON (default stdout)\n"
+        " -T, --time,       minimum time per benchmark (default 0.5s)\n"
+        " -f, --filter,     only run benchmarks whose name contains this\n"
+        " -V, --version,    print the version information and exit\n"
+        " -h, --help,       print this help and exit\n\n"
+        "Each tivofile is decoded from memory and from disk.\n\n";
+    std::exit(exitval);
+}
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline uint64_t ticks()
+{
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Grow the iteration count until one repetition takes a fifth of the
+ * minimum time, then keep the best of BENCH_REPS repetitions.
+ */
+static void run(const char *filter, const char *name, double bytes,
+                BenchFunc func, void *pArg)
+{
+    BenchResult result;
+    uint64_t n = 1;
+
+    if (filter && !std::strstr(name, filter))
+        return;
+
+    func(pArg, 1);      // warm up
+
+    while (1)
+    {
+        double start = now();
+        func(pArg, n);
+        double elapsed = now() - start;
+
+        if ((elapsed >= o_min_time / BENCH_REPS) || (n >= (1ULL << 40)))
+            break;
+
+        n = (elapsed > 0) ?
+            (uint64_t)(n * 1.2 * (o_min_time / BENCH_REPS) / elapsed) + 1 :
+            n * 10;
+    }
+
+    result.name       = name;
+    result.bytes      = bytes;
+    result.iterations = n;
+    result.seconds    = 0;
+    result.cycles     = 0;
+
+    for (int rep = 0; rep < BENCH_REPS; rep++)
+    {
+        uint64_t t0    = ticks();
+        double   start = now();
+        func(pArg, n);
+        double   elapsed = now() - start;
+        uint64_t t1    = ticks();
+
+        if ((0 == rep) || (elapsed < result.seconds))
+        {
+            result.seconds = elapsed;
+            result.cycles  = (double)(t1 - t0);
+        }
+    }
+
+    double total = bytes * n;
+
+    std::fprintf(stderr, "%-24s %10.2f MB/s %8.3f ns/byte", name,
+                 total / MB / result.seconds,
+                 result.seconds * 1e9 / total);
+    if (result.cycles > 0)
+        std::fprintf(stderr, " %8.3f cycles/byte", result.cycles / total);
+    std::fprintf(stderr, " %10.1f ns/op\n", result.seconds * 1e9 / n);
+
+    results.push_back(result);
+}
+
+/* kernels */
+
+typedef struct
+{
+    Turing      turing;
+    TuringState state;
+    uint8_t     key[20];
+    uint8_t     iv[20];
+    uint8_t     buffer[64 * 1024];
+} CipherArgs;
+
+static void bench_turing_key(void *pArg, uint64_t n)
+{
+    CipherArgs *pArgs = (CipherArgs *)pArg;
+
+    for (uint64_t i = 0; i < n; i++)
+    {
+        pArgs->key[0] = (uint8_t)i;
+        pArgs->turing.key(pArgs->key, 20);
+    }
+}
+
+static void bench_turing_iv(void *pArg, uint64_t n)
+{
+    CipherArgs *pArgs = (CipherArgs *)pArg;
+
+    for (uint64_t i = 0; i < n; i++)
+    {
+        pArgs->iv[0] = (uint8_t)i;
+        pArgs->turing.IV(pArgs->iv, 20);
+    }
+}
+
+static void bench_turing_gen(void *pArg, uint64_t n)
+{
+    CipherArgs *pArgs = (CipherArgs *)pArg;
+
+    for (uint64_t i = 0; i < n; i++)
+        pArgs->turing.gen(pArgs->buffer);
+}
+
+static void bench_decrypt_buffer(void *pArg, uint64_t n)
+{
+    CipherArgs *pArgs = (CipherArgs *)pArg;
+
+    for (uint64_t i = 0; i < n; i++)
+        pArgs->state.decrypt_buffer(pArgs->buffer, sizeof(pArgs->buffer));
+}
+
+static void bench_sha1(void *pArg, uint64_t n)
+{
+    CipherArgs *pArgs = (CipherArgs *)pArg;
+    SHA1 context;
+
+    for (uint64_t i = 0; i < n; i++)
+    {
+        context.init();
+        context.update(pArgs->buffer, sizeof(pArgs->buffer));
+        context.final(pArgs->key);
+    }
+}
+
+// what a video PES packet carries ahead of its first slice
+static const uint8_t pes_headers[] = {
+    0x00, 0x00, 0x01, 0xE0, 0x00, 0x00, 0x84, 0xC0, 0x0A, 0x31, 0x00, 0x01,
+    0x00, 0x01, 0x11, 0x00, 0x01, 0x00, 0x01,
+    0x00, 0x00, 0x01, 0xB3, 0x2D, 0x01, 0xE0, 0x24, 0x17, 0xFF, 0xE0, 0x18,
+    0x00, 0x00, 0x01, 0xB5, 0x14, 0x8A, 0x00, 0x01, 0x00, 0x00,
+    0x00, 0x00, 0x01, 0xB8, 0x00, 0x08, 0x00, 0x40,
+    0x00, 0x00, 0x01, 0x00, 0x00, 0x0F, 0xFF, 0xF8,
+    0x00, 0x00, 0x01, 0xB5, 0x8F, 0xFF, 0xF3, 0x41, 0x80,
+    0x00, 0x00, 0x01, 0x01, 0x13, 0xF8
+};
+
+static void bench_mpeg_parser(void *pArg, uint64_t n)
+{
+    TiVoDecoderTsStream *pStream = (TiVoDecoderTsStream *)pArg;
+
+    for (uint64_t i = 0; i < n; i++)
+    {
+        pStream->pesHdrLengths.clear();
+        pStream->getPesHdrLength((uint8_t *)pes_headers,
+                                 sizeof(pes_headers));
+    }
+}
+
+typedef struct
+{
+    HappyFile   file;
+    const char *name;
+    uint8_t     buffer[64 * 1024];
+    size_t      size;
+} FileArgs;
+
+static void bench_happyfile_read(void *pArg, uint64_t n)
+{
+    FileArgs *pArgs = (FileArgs *)pArg;
+
+    for (uint64_t i = 0; i < n; i++)
+    {
+        if (pArgs->file.read(pArgs->buffer, pArgs->size) != pArgs->size)
+        {
+            pArgs->file.seek(0);
+            pArgs->file.read(pArgs->buffer, pArgs->size);
+        }
+    }
+}
+
+// The scratch file written afresh, to its flush and close.
+static void bench_happyfile_write(void *pArg, uint64_t n)
+{
+    FileArgs *pArgs = (FileArgs *)pArg;
+
+    if (!pArgs->file.open(pArgs->name, "wb"))
+    {
+        std::perror(pArgs->name);
+        return;
+    }
+
+    for (uint64_t i = 0; i < n; i++)
+        pArgs->file.write(pArgs->buffer, pArgs->size);
+
+    bool ok = (0 == pArgs->file.flush());
+    ok = (0 == pArgs->file.close()) && ok;
+
+    if (!ok)
+        std::perror(pArgs->name);
+}
+
+/* end to end */
+
+typedef struct
+{
+    const char *filename;
+    char       *mak;
+    uint8_t    *pData;      // whole file, for the in memory runs
+    size_t      size;
+    uint8_t    *pOut;       // sink for the in memory runs
+    size_t      outLen;
+    FILE       *pOutFile;   // sink for the disk runs
+    bool        memory;
+    bool        failed;
+} DecodeArgs;
+
+// The decoded output: copied to pOut in memory, or written to pOutFile.
+static void decode_output(void *pContext, const void *ptr, size_t size)
+{
+    DecodeArgs *pArgs = (DecodeArgs *)pContext;
+
+    if (pArgs->pOutFile)
+    {
+        if (std::fwrite(ptr, 1, size, pArgs->pOutFile) != size)
+            pArgs->failed = true;
+    }
+    else if (pArgs->outLen + size <= pArgs->size)
+    {
+        std::memcpy(pArgs->pOut + pArgs->outLen, ptr, size);
+        pArgs->outLen += size;
+    }
+    else
+        pArgs->failed = true;
+}
+
+/*
+ * One decode through TiVoStreamDecoder, which reads the header and keys
+ * the cipher as the library does for every caller: the file pushed whole
+ * from memory, or read from disk a piece at a time.
+ */
+static bool decode(DecodeArgs *pArgs)
+{
+    TiVoStreamDecoder decoder(pArgs->mak, decode_output, pArgs);
+    bool ok = true;
+
+    // benchmarks never verify the MAK
+    decoder.noVerify = true;
+
+    pArgs->outLen   = 0;
+    pArgs->pOutFile = NULL;
+
+    if (pArgs->memory)
+        return decoder.push(pArgs->pData, pArgs->size) && decoder.finish();
+
+    FILE *in = std::fopen(pArgs->filename, "rb");
+    pArgs->pOutFile = std::tmpfile();
+
+    if (!in || !pArgs->pOutFile)
+    {
+        std::perror(pArgs->filename);
+        ok = false;
+    }
+
+    std::vector<uint8_t> buffer(BENCH_CHUNK);
+    size_t len;
+
+    while (ok && ((len = std::fread(&buffer[0], 1, BENCH_CHUNK, in)) > 0))
+        ok = decoder.push(&buffer[0], len);
+
+    ok = ok && !std::ferror(in) && decoder.finish();
+
+    if (in)
+        std::fclose(in);
+    if (pArgs->pOutFile)
+        std::fclose(pArgs->pOutFile);
+    pArgs->pOutFile = NULL;
+
+    return ok;
+}
+
+static void bench_decode(void *pArg, uint64_t n)
+{
+    DecodeArgs *pArgs = (DecodeArgs *)pArg;
+
+    for (uint64_t i = 0; i < n; i++)
+    {
+        if (false == decode(pArgs))
+            pArgs->failed = true;
+    }
+}
+
+static uint8_t *slurp(const char *filename, size_t *pSize)
+{
+    FILE *fh = std::fopen(filename, "rb");
+    uint8_t *pData = NULL;
+    long size;
+
+    if (!fh)
+        return NULL;
+
+    if ((std::fseek(fh, 0, SEEK_END) == 0) && ((size = std::ftell(fh)) > 0))
+    {
+        std::rewind(fh);
+        pData = (uint8_t *)std::malloc(size);
+        if (pData && (std::fread(pData, 1, size, fh) != (size_t)size))
+        {
+            std::free(pData);
+            pData = NULL;
+        }
+        *pSize = size;
+    }
+
+    std::fclose(fh);
+    return pData;
+}
+
+static void report(FILE *pOut)
+{
+    struct utsname host;
+
+    std::memset(&host, 0, sizeof(host));
+    uname(&host);
+
+    std::fprintf(pOut, "{\n  \"format\": \"tdbench-1\",\n"
+                 "  \"host\": {\"name\": \"%s\", \"machine\": \"%s\", "
+                 "\"cpus\": %ld},\n  \"results\": [\n",
+                 host.nodename, host.machine, sysconf(_SC_NPROCESSORS_ONLN));
+
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        BenchResult *pResult = &results[i];
+        double total = pResult->bytes * pResult->iterations;
+
+        std::fprintf(pOut, "    {\"name\": \"%s\", \"bytes_per_op\": %.0f, "
+                     "\"ops\": %llu, \"seconds\": %.6f, "
+                     "\"mb_per_s\": %.3f, \"ns_per_byte\": %.4f, "
+                     "\"ns_per_op\": %.1f, \"cycles_per_byte\": ",
+                     pResult->name.c_str(), pResult->bytes,
+                     (unsigned long long)pResult->iterations,
+                     pResult->seconds, total / MB / pResult->seconds,
+                     pResult->seconds * 1e9 / total,
+                     pResult->seconds * 1e9 / pResult->iterations);
+
+        if (pResult->cycles > 0)
+            std::fprintf(pOut, "%.4f}", pResult->cycles / total);
+        else
+            std::fprintf(pOut, "null}");
+
+        std::fprintf(pOut, "%s\n", (i + 1 < results.size()) ? "," : "");
+    }
+
+    std::fprintf(pOut, "  ]\n}\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *outfile = NULL;
+    const char *filter  = NULL;
+    int makgiven = 0;
+
+    char mak[12];
+    std::memset(mak, 0, sizeof(mak));
+
+    while (1)
+    {
+        int c = getopt_long(argc, argv, "m:o:T:f:Vh", long_options, 0);
+
+        if (c == -1)
+            break;
+
+        switch (c)
+        {
+            case 'm':
+                std::strncpy(mak, optarg, 11);
+                mak[11] = '\0';
+                makgiven = 1;
+                break;
+            case 'o':
+                outfile = optarg;
+                break;
+            case 'T':
+                o_min_time = std::atof(optarg);
+                if (o_min_time <= 0)
+                    do_help(argv[0], 4);
+                break;
+            case 'f':
+                filter = optarg;
+                break;
+            case 'h':
+                do_help(argv[0], 1);
+                break;
+            case '?':
+                do_help(argv[0], 2);
+                break;
+            case 'V':
+                do_version(10);
+                break;
+            default:
+                do_help(argv[0], 3);
+                break;
+        }
+    }
+
+    if (!makgiven)
+        makgiven = get_mak_from_conf_file(mak);
+
+    if ((optind < argc) && !makgiven)
+        do_help(argv[0], 5);
+
+    print_qualcomm_msg();
+
+    CipherArgs *pCipher = new CipherArgs;
+    std::memset(pCipher, 0, sizeof(CipherArgs));
+    for (size_t i = 0; i < sizeof(pCipher->buffer); i++)
+        pCipher->buffer[i] = (uint8_t)(i * 131);
+    pCipher->turing.key(pCipher->key, 20);
+    pCipher->turing.IV(pCipher->iv, 20);
+    pCipher->state.setup_key(pCipher->buffer, 64, (char *)"0123456789");
+    pCipher->state.prepare_frame(0xe0, 1);
+
+    run(filter, "turing.key", 20, bench_turing_key, pCipher);
+    run(filter, "turing.iv", 20, bench_turing_iv, pCipher);
+    run(filter, "turing.gen", MAXSTREAM, bench_turing_gen, pCipher);
+    run(filter, "turing_state.decrypt", sizeof(pCipher->buffer),
+        bench_decrypt_buffer, pCipher);
+    run(filter, "sha1", sizeof(pCipher->buffer), bench_sha1, pCipher);
+
+    TiVoDecoderTsStream *pStream = new TiVoDecoderTsStream(0x1011);
+    run(filter, "mpeg2.pes_headers", sizeof(pes_headers),
+        bench_mpeg_parser, pStream);
+    delete pStream;
+
+    pCipher->state.destruct();
+
+    // writes, then reads, of a scratch file
+    FileArgs *pFile = new FileArgs;
+    char scratch[] = "/tmp/tdbenchXXXXXX";
+    int fd;
+
+    pFile->name = scratch;
+    pFile->size = sizeof(pFile->buffer);
+    std::memcpy(pFile->buffer, pCipher->buffer, pFile->size);
+
+    if ((fd = mkstemp(scratch)) >= 0)
+    {
+        close(fd);
+
+        run(filter, "happyfile.write", pFile->size,
+            bench_happyfile_write, pFile);
+
+        // filled afresh for the reads, whatever the writes left
+        fd = open(scratch, O_WRONLY | O_TRUNC);
+        bool ok = (fd >= 0);
+
+        for (int i = 0; ok && (i < SCRATCH_SIZE / (int)pFile->size); i++)
+            ok = (write(fd, pFile->buffer, pFile->size) ==
+                  (ssize_t)pFile->size);
+        if (fd >= 0)
+            close(fd);
+
+        if (ok && pFile->file.open(scratch, "rb"))
+        {
+            run(filter, "happyfile.read", pFile->size,
+                bench_happyfile_read, pFile);
+            pFile->file.close();
+        }
+        else
+            std::perror(scratch);
+
+        unlink(scratch);
+    }
+    else
+        std::perror("creating scratch file");
+
+    delete pFile;
+    delete pCipher;
+
+    int rc = 0;
+
+    for (int i = optind; i < argc; i++)
+    {
+        DecodeArgs args;
+        std::string name;
+        const char *base = std::strrchr(argv[i], '/');
+
+        base = base ? base + 1 : argv[i];
+
+        std::memset(&args, 0, sizeof(args));
+        args.filename = argv[i];
+        args.mak      = mak;
+        args.pData    = slurp(argv[i], &args.size);
+
+        if (!args.pData)
+        {
+            std::perror(argv[i]);
+            rc = 6;
+            continue;
+        }
+
+        args.pOut = (uint8_t *)std::malloc(args.size);
+
+        args.memory = true;
+        name = std::string("decode.memory:") + base;
+        run(filter, name.c_str(), args.size, bench_decode, &args);
+
+        args.memory = false;
+        name = std::string("decode.disk:") + base;
+        run(filter, name.c_str(), args.size, bench_decode, &args);
+
+        if (true == args.failed)
+        {
+            std::fprintf(stderr, "%s: decode failed\n", argv[i]);
+            rc = 9;
+        }
+
+        std::free(args.pData);
+        std::free(args.pOut);
+    }
+
+    FILE *pOut = stdout;
+
+    if (outfile && !(pOut = std::fopen(outfile, "w")))
+    {
+        std::perror(outfile);
+        return 7;
+    }
+
+    report(pOut);
+
+    if (pOut != stdout)
+        std::fclose(pOut);
+
+    return rc;
+}
+
+/* vi:set ai ts=4 sw=4 expandtab: */
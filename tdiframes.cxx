@@ -0,0 +1,186 @@
+/*
+ * tivodecode-ng
+ * Copyright 2006-2015, Jeremy Drake et al.
+ * See COPYING file for license terms
+ *
+ * Checks a video elementary stream demultiplexed from an --iframes decode
+ * against the same stream from a full decode: the I pictures must be the
+ * same, and nothing of any other picture left.  Given the --keyframes CSV
+ * of the full decode too, it must list as many I pictures.  Run by "make
+ * verify".
+ */
+#ifdef HAVE_CONFIG_H
+#include "tdconfig.h"
+#endif
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include <stdint.h>
+
+typedef std::vector<uint8_t> Bytes;
+
+static bool read_file(const char *filename, Bytes &data)
+{
+    FILE *f = std::fopen(filename, "rb");
+    if (!f)
+    {
+        std::perror(filename);
+        return false;
+    }
+
+    uint8_t buf[65536];
+    size_t  n;
+
+    while ((n = std::fread(buf, 1, sizeof(buf), f)) > 0)
+        data.insert(data.end(), buf, buf + n);
+
+    bool ok = !std::ferror(f);
+    if (!ok)
+        std::perror(filename);
+
+    std::fclose(f);
+    return ok;
+}
+
+/*
+ * The pictures of a stream, each from the sequence, GOP or picture header
+ * after the slices of the one before, less the zero stuffing at its end.
+ * I pictures go to iPictures; others count in other if they have slices.
+ */
+static void split(const Bytes &data, std::vector<Bytes> &iPictures,
+                  size_t &other)
+{
+    size_t start   = 0;
+    size_t len     = data.size();
+    int    type    = 0;
+    bool   headers = true;
+    bool   slices  = false;
+
+    other = 0;
+
+    for (size_t i = 0; i <= len; i++)
+    {
+        uint8_t code = 0xff;
+
+        if (i + 3 < len)
+        {
+            if (data[i] || data[i+1] || (data[i+2] != 0x01))
+                continue;
+            code = data[i+3];
+        }
+
+        if ((code >= 0x01) && (code <= 0xAF))
+        {
+            headers = false;
+            slices  = true;
+            continue;
+        }
+
+        bool next = ((code == 0x00) || (code == 0xB3) || (code == 0xB7) ||
+                     (code == 0xB8)) && (false == headers);
+
+        if ((true == next) || (i + 3 >= len))
+        {
+            size_t end = (i + 3 >= len) ? len : i;
+
+            while ((end > start) && !data[end - 1])
+                end--;
+
+            if (1 == type)
+                iPictures.push_back(Bytes(data.begin() + start,
+                                          data.begin() + end));
+            else if (true == slices)
+                other++;
+
+            if (i + 3 >= len)
+                break;
+
+            start   = i;
+            type    = 0;
+            headers = true;
+            slices  = false;
+        }
+
+        if ((code == 0x00) && (i + 5 < len))
+            type = (data[i+5] >> 3) & 0x7;
+
+        i += 3;
+    }
+}
+
+// The I pictures a --keyframes CSV lists.
+static size_t keyframes(const Bytes &csv)
+{
+    size_t count  = 0;
+    size_t fields = 0;
+
+    for (size_t i = 0; i < csv.size(); i++)
+    {
+        if (csv[i] == '\n')
+            fields = 0;
+        else if (csv[i] == ',')
+            fields++;
+        else if ((2 == fields) && (csv[i] == 'I'))
+            count++;
+    }
+
+    return count;
+}
+
+int main(int argc, char *argv[])
+{
+    if ((argc != 3) && (argc != 4))
+    {
+        std::fprintf(stderr, "usage: %s full.m2v iframes.m2v "
+                     "[keyframes.csv]\n", argv[0]);
+        return 2;
+    }
+
+    Bytes full, iframes, csv;
+
+    if (!read_file(argv[1], full) || !read_file(argv[2], iframes) ||
+        ((4 == argc) && !read_file(argv[3], csv)))
+        return 2;
+
+    std::vector<Bytes> fullI, iframesI;
+    size_t fullOther, iframesOther;
+
+    split(full, fullI, fullOther);
+    split(iframes, iframesI, iframesOther);
+
+    size_t bytes = 0;
+    size_t same  = 0;
+
+    for (size_t i = 0; i < fullI.size() && i < iframesI.size(); i++)
+    {
+        if (fullI[i] != iframesI[i])
+        {
+            std::fprintf(stderr, "I picture %u: %u bytes, %u in the full "
+                         "decode\n", (unsigned)i, (unsigned)iframesI[i].size(),
+                         (unsigned)fullI[i].size());
+            break;
+        }
+
+        bytes += fullI[i].size();
+        same++;
+    }
+
+    std::printf("%u of %u I pictures match (%u bytes), %u other pictures "
+                "left of %u\n", (unsigned)same, (unsigned)fullI.size(),
+                (unsigned)bytes, (unsigned)iframesOther, (unsigned)fullOther);
+
+    if (4 == argc)
+        std::printf("%u I pictures in %s\n", (unsigned)keyframes(csv),
+                    argv[3]);
+
+    if (!fullI.size() || (same != fullI.size()) ||
+        (iframesI.size() != fullI.size()) || iframesOther ||
+        ((4 == argc) && (keyframes(csv) != fullI.size())))
+        return 1;
+
+    return 0;
+}
+
+/* vi:set ai ts=4 sw=4 expandtab: */
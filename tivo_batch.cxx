@@ -0,0 +1,361 @@
+/*
+ * tivodecode-ng
+ * Copyright 2006-2015, Jeremy Drake et al.
+ * See COPYING file for license terms
+ */
+#ifdef HAVE_CONFIG_H
+#include "tdconfig.h"
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#include <dirent.h>
+#include <strings.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
+
+#include "tivo_batch.hxx"
+
+TiVoBatchWorker::TiVoBatchWorker(int workerIndex)
+{
+    index = workerIndex;
+    std::memset(&turing, 0, sizeof(turing));
+}
+
+TiVoBatchWorker::~TiVoBatchWorker()
+{
+    turing.destruct();
+}
+
+TiVoBatch::TiVoBatch()
+{
+    remaining = 0;
+    func      = NULL;
+    pContext  = NULL;
+}
+
+// Whether dev is a spinning disk, from sysfs; false where unknown.
+static bool rotational(dev_t dev)
+{
+#ifdef __linux__
+    // a partition's queue is its disk's
+    static const char *formats[] = {
+        "/sys/dev/block/%u:%u/queue/rotational",
+        "/sys/dev/block/%u:%u/../queue/rotational"
+    };
+
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+    {
+        char path[64];
+        std::snprintf(path, sizeof(path), formats[i], major(dev), minor(dev));
+
+        FILE *f = std::fopen(path, "r");
+        if (!f)
+            continue;
+
+        int c = std::fgetc(f);
+        std::fclose(f);
+        return (c == '1');
+    }
+#endif
+    return false;
+}
+
+bool TiVoBatch::addFile(const char *path)
+{
+    struct stat st;
+
+    if (stat(path, &st) < 0)
+    {
+        std::perror(path);
+        return false;
+    }
+
+    TiVoBatchJob job;
+    job.input   = path;
+    job.size    = (hoff_t)st.st_size;
+    job.device  = st.st_dev;
+    job.rc      = -1;
+    job.written = 0;
+    job.seconds = 0;
+    jobs.push_back(job);
+
+    if ((limit.find(st.st_dev) == limit.end()) && rotational(st.st_dev))
+        limit[st.st_dev] = BATCH_ROTATIONAL_JOBS;
+
+    return true;
+}
+
+// Every .TiVo file in the directory, in name order.
+bool TiVoBatch::addDirectory(const char *path)
+{
+    std::vector<std::string> names;
+    DIR *dir = opendir(path);
+
+    if (!dir)
+    {
+        std::perror(path);
+        return false;
+    }
+
+    struct dirent *pEntry;
+    while ((pEntry = readdir(dir)) != NULL)
+    {
+        size_t len = std::strlen(pEntry->d_name);
+
+        if ((len > 5) &&
+            !strcasecmp(pEntry->d_name + len - 5, ".tivo"))
+            names.push_back(pEntry->d_name);
+    }
+    closedir(dir);
+
+    std::sort(names.begin(), names.end());
+
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        if (false == addFile((std::string(path) + "/" + names[i]).c_str()))
+            return false;
+    }
+
+    return true;
+}
+
+// One input per line, - for stdin; blank lines and # comments are skipped.
+bool TiVoBatch::addList(const char *path)
+{
+    FILE *f = std::strcmp(path, "-") ? std::fopen(path, "r") : stdin;
+    char line[4096];
+    bool ok = true;
+
+    if (!f)
+    {
+        std::perror(path);
+        return false;
+    }
+
+    while (ok && std::fgets(line, sizeof(line), f))
+    {
+        char *name = line + std::strspn(line, " \t");
+        name[std::strcspn(name, "\r\n")] = '\0';
+
+        if (name[0] && (name[0] != '#'))
+            ok = add(name);
+    }
+
+    if (f != stdin)
+        std::fclose(f);
+
+    return ok;
+}
+
+/*
+ * Queue the inputs named by arg: a .TiVo file, a directory of them, or
+ * @list for a file listing them.
+ */
+bool TiVoBatch::add(const char *arg)
+{
+    struct stat st;
+
+    if (arg[0] == '@')
+        return addList(arg + 1);
+
+    if (stat(arg, &st) < 0)
+    {
+        std::perror(arg);
+        return false;
+    }
+
+    if (S_ISDIR(st.st_mode))
+        return addDirectory(arg);
+
+    return addFile(arg);
+}
+
+/*
+ * How many files to decode at once: one per threadsPerFile cores, no more
+ * than the files, nor than the disks they are on allow.
+ */
+int TiVoBatch::workers(int threadsPerFile)
+{
+    int cores = (int)std::thread::hardware_concurrency();
+    int count = std::max(1, cores / std::max(1, threadsPerFile));
+    std::map<dev_t, int> devices;
+    int disks = 0;
+
+    for (size_t i = 0; i < jobs.size(); i++)
+        devices[jobs[i].device]++;
+
+    for (std::map<dev_t, int>::iterator it = devices.begin();
+         it != devices.end(); it++)
+    {
+        std::map<dev_t, int>::iterator lim = limit.find(it->first);
+
+        // any device without a limit can take them all
+        if (lim == limit.end())
+            disks += count;
+        else
+            disks += std::min(it->second, lim->second);
+    }
+
+    count = std::min(count, disks);
+    return std::max(1, std::min(count, (int)jobs.size()));
+}
+
+/*
+ * Reserve an output name, adding -2, -3 ... before the extension when
+ * another file of the batch already has it.
+ */
+std::string TiVoBatch::claim(const std::string &name)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::string unique = name;
+
+    size_t slash = name.rfind('/');
+    size_t dot   = name.rfind('.');
+    if ((dot == std::string::npos) ||
+        ((slash != std::string::npos) && (dot < slash)))
+        dot = name.size();
+
+    for (int n = 2; outputs.count(unique); n++)
+    {
+        char suffix[16];
+        std::snprintf(suffix, sizeof(suffix), "-%d", n);
+        unique = name.substr(0, dot) + suffix + name.substr(dot);
+    }
+
+    outputs.insert(unique);
+    return unique;
+}
+
+bool TiVoBatch::runnable(int job)
+{
+    dev_t dev = jobs[job].device;
+    std::map<dev_t, int>::iterator lim = limit.find(dev);
+
+    return (lim == limit.end()) || (busy[dev] < lim->second);
+}
+
+/*
+ * The next job for worker self: from the front of its own queue, or
+ * stolen from the back of another's, skipping files whose disk is busy.
+ * False when none are left.
+ */
+bool TiVoBatch::take(int self, int *pJob)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    int count = (int)queues.size();
+
+    while (remaining)
+    {
+        for (int k = 0; k < count; k++)
+        {
+            BatchQueue &queue = queues[(self + k) % count];
+
+            for (size_t i = 0; i < queue.size(); i++)
+            {
+                // own queue from the front, the others from the back
+                size_t at = k ? queue.size() - 1 - i : i;
+
+                if (false == runnable(queue[at]))
+                    continue;
+
+                *pJob = queue[at];
+                queue.erase(queue.begin() + at);
+                busy[jobs[*pJob].device]++;
+                remaining--;
+                return true;
+            }
+        }
+
+        wake.wait(guard);
+    }
+
+    return false;
+}
+
+void TiVoBatch::workerMain(int self)
+{
+    TiVoBatchWorker worker(self);
+    int job;
+
+    while (take(self, &job))
+    {
+        TiVoBatchJob *pJob = &jobs[job];
+        std::chrono::steady_clock::time_point start =
+            std::chrono::steady_clock::now();
+
+        pJob->rc = func(this, pJob, &worker, pContext);
+        pJob->seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+
+        if (0 == pJob->rc)
+            std::fprintf(stderr, "batch: %s -> %s: %.1f MB in %.2fs "
+                         "(%.1f MB/s)\n", pJob->input.c_str(),
+                         pJob->output.c_str(), pJob->written / 1e6,
+                         pJob->seconds, pJob->size / 1e6 /
+                         std::max(pJob->seconds, 1e-9));
+        else
+            std::fprintf(stderr, "batch: %s: failed, exit %d\n",
+                         pJob->input.c_str(), pJob->rc);
+
+        std::lock_guard<std::mutex> guard(lock);
+        busy[pJob->device]--;
+        wake.notify_all();
+    }
+}
+
+// orders job indices largest file first
+struct LargerJob
+{
+    const std::vector<TiVoBatchJob> *pJobs;
+
+    LargerJob(const std::vector<TiVoBatchJob> *pJobList) : pJobs(pJobList) {}
+
+    bool operator()(int a, int b) const
+        { return (*pJobs)[a].size > (*pJobs)[b].size; }
+};
+
+/*
+ * Decode every job with pFunc on count workers.  Returns the number of
+ * jobs which failed.
+ */
+int TiVoBatch::run(int count, TiVoBatchFunc pFunc, void *pFuncContext)
+{
+    std::vector<int> order;
+    BatchThreads threads;
+    int failed = 0;
+
+    func      = pFunc;
+    pContext  = pFuncContext;
+    remaining = jobs.size();
+
+    for (size_t i = 0; i < jobs.size(); i++)
+        order.push_back((int)i);
+
+    std::stable_sort(order.begin(), order.end(), LargerJob(&jobs));
+
+    queues.assign(count, BatchQueue());
+    for (size_t i = 0; i < order.size(); i++)
+        queues[i % count].push_back(order[i]);
+
+    for (int i = 0; i < count; i++)
+        threads.push_back(std::thread(&TiVoBatch::workerMain, this, i));
+
+    for (int i = 0; i < count; i++)
+        threads[i].join();
+
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        if (jobs[i].rc)
+            failed++;
+    }
+
+    return failed;
+}
+
+/* vi:set ai ts=4 sw=4 expandtab: */
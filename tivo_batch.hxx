@@ -0,0 +1,109 @@
+/*
+ * tivodecode-ng
+ * Copyright 2006-2015, Jeremy Drake et al.
+ * See COPYING file for license terms
+ */
+
+#ifndef TIVO_BATCH_HXX_
+#define TIVO_BATCH_HXX_
+
+#ifdef HAVE_CONFIG_H
+#include "tdconfig.h"
+#endif
+
+#include <sys/types.h>
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "happyfile.hxx"
+#include "tivo_parse.hxx"
+
+// concurrent files on one spinning disk, where more would only seek
+#define BATCH_ROTATIONAL_JOBS   1
+
+typedef struct
+{
+    std::string input;
+    std::string output;
+    hoff_t      size;
+    dev_t       device;
+
+    // results
+    int         rc;
+    hoff_t      written;
+    double      seconds;
+} TiVoBatchJob;
+
+/*
+ * What one worker keeps from file to file: its cipher contexts, reset
+ * between files rather than freed, and its file buffers.
+ */
+class TiVoBatchWorker
+{
+    public:
+        int         index;
+        TuringState turing;
+        HappyFile   in;
+        HappyFile   out;
+
+        TiVoBatchWorker(int workerIndex);
+        ~TiVoBatchWorker();
+};
+
+class TiVoBatch;
+
+typedef int (*TiVoBatchFunc)(TiVoBatch *pBatch, TiVoBatchJob *pJob,
+                             TiVoBatchWorker *pWorker, void *pContext);
+
+typedef std::deque<int>                 BatchQueue;
+typedef std::vector<std::thread>        BatchThreads;
+
+/*
+ * --batch: decode many files in one process.  Each worker has its own
+ * queue, dealt largest files first; it takes from the front of its own
+ * and, once that is empty, steals from the back of another's.  Files on a
+ * rotational disk are limited to BATCH_ROTATIONAL_JOBS at a time.
+ */
+class TiVoBatch
+{
+    private:
+        std::vector<BatchQueue>     queues;
+        std::map<dev_t, int>        busy;
+        std::map<dev_t, int>        limit;
+        std::set<std::string>       outputs;
+        size_t                      remaining;
+
+        std::mutex                  lock;
+        std::condition_variable     wake;
+
+        TiVoBatchFunc               func;
+        void                        *pContext;
+
+        bool addFile(const char *path);
+        bool addDirectory(const char *path);
+        bool addList(const char *path);
+        bool runnable(int job);
+        bool take(int self, int *pJob);
+        void workerMain(int self);
+
+    public:
+        std::vector<TiVoBatchJob>   jobs;
+
+        bool        add(const char *arg);
+        int         workers(int threadsPerFile);
+        std::string claim(const std::string &name);
+        int         run(int count, TiVoBatchFunc pFunc, void *pFuncContext);
+
+        TiVoBatch();
+};
+
+#endif /* TIVO_BATCH_HXX_ */
+
+/* vi:set ai ts=4 sw=4 expandtab: */
@@ -11,6 +11,7 @@
 #include <cstdio>
 
 #include "tivo_decoder_base.hxx"
+#include "tivo_decoder_index.hxx"
 
 TiVoDecoder::TiVoDecoder(TuringState *pTuringState, HappyFile *pInfile,
                          HappyFile *pOutfile)
@@ -25,12 +26,82 @@ TiVoDecoder::TiVoDecoder(TuringState *pTuringState, HappyFile *pInfile,
     pFileOut = pOutfile;
     pTuring  = pTuringState;
     isValid  = true;
+
+    rangeStart   = 0;
+    rangeEnd     = -1;
+    rangeExact   = true;
+    dryRun       = false;
+    needLookback = false;
+    verbose      = 0;
+    noVerify     = false;
+    pStats       = NULL;
+    pVerify      = NULL;
+    pIndex       = NULL;
+    pFrames      = NULL;
+    pCaptions    = NULL;
+    pSegments    = NULL;
+    iframesOnly  = false;
+    pSelect      = NULL;
 }
 
 TiVoDecoder::~TiVoDecoder()
 {
 }
 
+/*
+ * Only write the output for the input between start and end (-1 for the
+ * end of file), a boundary found with findSync().  Decoding begins at the
+ * current input position, and everything ahead of start is replayed
+ * without output or keystream to rebuild the decoder and cipher state.
+ * Output for adjacent ranges concatenates to the output of a full decode.
+ *
+ * Unless exact is set, i.e. the replay begins at the start of the stream,
+ * the recovered state is checked with isSynced() when start is reached;
+ * if it is incomplete process() fails with needLookback set, and the
+ * caller should retry from further back.
+ */
+void TiVoDecoder::setRange(hoff_t start, hoff_t end, bool exact)
+{
+    rangeStart = start;
+    rangeEnd   = end;
+    rangeExact = exact;
+    dryRun     = (pFileIn->tell() < start) || !exact;
+
+    if (true == dryRun)
+        pTuring->dry_run(true);
+}
+
+bool TiVoDecoder::beginOutput()
+{
+    if ((false == rangeExact) && (false == isSynced()))
+    {
+        VERBOSE("Range : cipher state unknown at %lld\n",
+                (long long)rangeStart);
+        needLookback = true;
+        return false;
+    }
+
+    VERBOSE("Range : output begins at %lld\n", (long long)rangeStart);
+    dryRun = false;
+    return true;
+}
+
+/*
+ * Pick up the decode at a seek point of the index: the input is already
+ * there, and each stream's cipher is put back where it was.
+ */
+bool TiVoDecoder::restore(TiVoDecoderIndex *,
+                          const TiVoIndexPoint *pPoint)
+{
+    VERBOSE("Index : resume at input %lld, output %lld\n",
+            (long long)pPoint->in, (long long)pPoint->out);
+
+    for (size_t i = 0; i < pPoint->ciphers.size(); i++)
+        pTuring->restore(&pPoint->ciphers[i]);
+
+    return true;
+}
+
 /**
  * This is from analyzing the TiVo directshow dll.  Most of the 
  * parameters I have no idea what they are for.
@@ -5,18 +5,26 @@
 #include "tdconfig.h"
 #endif
 
+#include <cerrno>
 #include <cstdio>
+#include <set>
 
 #include "tivo_parse.hxx"
 #include "turing_stream.hxx"
 
+// process_frame(): the input ended part way into the frame
+#define FRAME_TRUNCATED 2
+
 #define LOOK_AHEAD(fh, bytes, n) do {\
+    errno = 0; \
     int retval = fh->read((bytes) + looked_ahead, (n) - looked_ahead);\
     if ( retval == 0 )\
     {\
         return 0;  \
     }\
     else if ( retval != (n) - looked_ahead) { \
+        if ( errno == 0 ) \
+            return FRAME_TRUNCATED; \
         perror ("read"); \
         return -1; \
     } else { \
@@ -24,6 +32,33 @@
     } \
 } while (0)
 
+// Initial distance to replay ahead of a range to recover the decoder state
+#define RANGE_LOOKBACK  (1 << 20)
+
+// Input searched for a video PTS by findPts() before giving up
+#define PTS_SEARCH      (4 << 20)
+
+// kinds of stream for --streams
+#define SELECT_VIDEO    0x01
+#define SELECT_AUDIO    0x02
+#define SELECT_DATA     0x04
+
+// --pids and --streams: the streams written, by kind, TS PID or PS stream id
+typedef struct
+{
+    int                kinds;
+    std::set<uint16_t> pids;
+    std::set<uint8_t>  codes;
+} TiVoDecoderSelect;
+
+class TiVoDecoderStats;
+class TiVoDecoderVerify;
+class TiVoDecoderIndex;
+class TiVoDecoderFrames;
+class TiVoDecoderCaptions;
+class TiVoDecoderSegments;
+struct TiVoIndexPoint;
+
 /* All elements are in big-endian format and are packed */
 
 class TiVoDecoder
@@ -36,9 +71,54 @@ class TiVoDecoder
         HappyFile   *pFileIn;
         HappyFile   *pFileOut;
 
+        // output range, see setRange()
+        hoff_t       rangeStart;
+        hoff_t       rangeEnd;
+        bool         rangeExact;
+        bool         dryRun;
+        bool         needLookback;
+
+        // this decode's -v level, and whether to skip the MAK check
+        int          verbose;
+        bool         noVerify;
+
+        // counters for --stats, or NULL
+        TiVoDecoderStats *pStats;
+
+        // block marks for --verify-against-reference, or NULL
+        TiVoDecoderVerify *pVerify;
+
+        // seek points for --write-index, or NULL
+        TiVoDecoderIndex *pIndex;
+
+        // I picture and GOP marks for --keyframes, or NULL
+        TiVoDecoderFrames *pFrames;
+
+        // picture caption data for --captions, or NULL
+        TiVoDecoderCaptions *pCaptions;
+
+        // cut points for --segment-duration, or NULL
+        TiVoDecoderSegments *pSegments;
+
+        // --iframes: write only the video PES packets of I pictures; TS
+        // decodes must be on one thread
+        bool         iframesOnly;
+
+        // --pids and --streams, or NULL to write every stream; streams
+        // left out are never keyed or decrypted
+        const TiVoDecoderSelect *pSelect;
+
         int do_header(uint8_t *arg_0, int *block_no, int *arg_8,
                       int *crypted, int *arg_10, int *arg_14);
 
+        void setRange(hoff_t start, hoff_t end, bool exact);
+        bool beginOutput();
+
+        virtual hoff_t findSync(hoff_t offset) = 0;
+        virtual bool isSynced() = 0;
+        virtual int64_t findPts(hoff_t offset, hoff_t *pAt) = 0;
+        virtual bool restore(TiVoDecoderIndex *pSeekIndex,
+                             const TiVoIndexPoint *pPoint);
         virtual bool process() = 0;
 
         TiVoDecoder(TuringState *pTuringState, HappyFile *pInfile,
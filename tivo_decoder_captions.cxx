@@ -0,0 +1,213 @@
+/*
+ * tivodecode-ng
+ * Copyright 2006-2015, Jeremy Drake et al.
+ * See COPYING file for license terms
+ */
+#ifdef HAVE_CONFIG_H
+#include "tdconfig.h"
+#endif
+
+#include <cstdio>
+#include <cstring>
+
+#include <strings.h>
+
+#include "tivo_decoder_captions.hxx"
+
+/*
+ * The raw sidecar, all big-endian:
+ *   "TDCC", version, 3 reserved bytes
+ * then a record per picture with captions, in display order:
+ *   8 byte PTS (all ones for none), cc_count, cc_count * 3 bytes of
+ *   cc_data as in the user data (marker bits, cc_valid and cc_type, then
+ *   cc_data_1 and cc_data_2)
+ */
+#define CAPTIONS_MAGIC      "TDCC"
+#define CAPTIONS_VERSION    1
+
+#define PTS_MASK            ((1LL << 33) - 1)
+
+// 90kHz ticks in a frame at 29.97Hz
+#define FRAME_TICKS         3003
+
+TiVoDecoderCaptions::TiVoDecoderCaptions()
+{
+    pFile    = NULL;
+    scc      = false;
+    firstPts = -1;
+    lastPts  = -1;
+    words    = 0;
+    count    = 0;
+}
+
+TiVoDecoderCaptions::~TiVoDecoderCaptions()
+{
+    if (pFile)
+        std::fclose(pFile);
+}
+
+bool TiVoDecoderCaptions::open(const char *filename)
+{
+    size_t len = std::strlen(filename);
+
+    name  = filename;
+    scc   = (len > 4) && !strcasecmp(filename + len - 4, ".scc");
+    count = 0;
+
+    pFile = std::fopen(filename, scc ? "w" : "wb");
+    if (!pFile)
+    {
+        std::perror(filename);
+        return false;
+    }
+
+    if (scc)
+    {
+        std::fputs("Scenarist_SCC V1.0\n\n", pFile);
+    }
+    else
+    {
+        uint8_t header[8];
+
+        std::memset(header, 0, sizeof(header));
+        std::memcpy(header, CAPTIONS_MAGIC, 4);
+        header[4] = CAPTIONS_VERSION;
+
+        std::fwrite(header, 1, sizeof(header), pFile);
+    }
+
+    return true;
+}
+
+// SMPTE drop frame timecode for 90kHz ticks since the first picture.
+static void timecode(int64_t at, char *pBuf, size_t len)
+{
+    int64_t frames = (at > 0) ? at / FRAME_TICKS : 0;
+    int64_t tens   = frames / 17982;
+    int64_t rest   = frames % 17982;
+
+    // two frame numbers are left out each minute but every tenth
+    frames += 18 * tens + ((rest > 1) ? 2 * ((rest - 2) / 1798) : 0);
+
+    std::snprintf(pBuf, len, "%02d:%02d:%02d;%02d",
+                  (int)(frames / 108000), (int)(frames / 1800 % 60),
+                  (int)(frames / 30 % 60), (int)(frames % 30));
+}
+
+void TiVoDecoderCaptions::write(int64_t at, const TiVoCaption &caption)
+{
+    const std::vector<uint8_t> &cc = caption.cc;
+
+    if (false == scc)
+    {
+        uint8_t record[9];
+        uint64_t pts = (uint64_t)caption.pts;
+
+        for (int i = 0; i < 8; i++)
+            record[i] = (uint8_t)(pts >> ((7 - i) * 8));
+        record[8] = (uint8_t)(cc.size() / 3);
+
+        std::fwrite(record, 1, sizeof(record), pFile);
+        std::fwrite(&cc[0], 1, cc.size(), pFile);
+        count++;
+        return;
+    }
+
+    bool any = false;
+
+    for (size_t i = 0; i + 3 <= cc.size(); i += 3)
+    {
+        // valid field 1 pairs, less the null padding
+        if (!(cc[i] & 0x04) || (cc[i] & 0x03) ||
+            (!(cc[i + 1] & 0x7f) && !(cc[i + 2] & 0x7f)))
+            continue;
+
+        if (!words)
+        {
+            char tc[16];
+
+            timecode(at, tc, sizeof(tc));
+            std::fprintf(pFile, "%s\t", tc);
+        }
+        else
+            std::fputc(' ', pFile);
+
+        std::fprintf(pFile, "%02x%02x", cc[i + 1], cc[i + 2]);
+        any = true;
+
+        if (++words == CAPTIONS_SCC_WORDS)
+        {
+            std::fputs("\n\n", pFile);
+            words = 0;
+        }
+    }
+
+    // a picture of only padding ends the line
+    if (!any && words)
+    {
+        std::fputs("\n\n", pFile);
+        words = 0;
+    }
+
+    if (any)
+        count++;
+}
+
+// Note the captions of a video picture, if it has any.
+void TiVoDecoderCaptions::add(const mpeg_picture_info &info)
+{
+    if (!pFile || !info.ccCount)
+        return;
+
+    TiVoCaption caption;
+
+    // one without a PTS stays after the picture before it
+    caption.pts = (info.pts >= 0) ? info.pts : lastPts;
+    caption.cc.assign(info.cc, info.cc + info.ccCount * 3);
+    lastPts = caption.pts;
+
+    if ((firstPts < 0) && (caption.pts >= 0))
+        firstPts = caption.pts;
+
+    // since the first picture, across a wrap, and less for one shown before
+    int64_t at = 0;
+    if (caption.pts >= 0)
+    {
+        at = (caption.pts - firstPts) & PTS_MASK;
+        if (at > (PTS_MASK >> 1))
+            at -= PTS_MASK + 1;
+    }
+
+    pending.insert(std::make_pair(at, caption));
+
+    if (pending.size() > CAPTIONS_REORDER)
+    {
+        write(pending.begin()->first, pending.begin()->second);
+        pending.erase(pending.begin());
+    }
+}
+
+bool TiVoDecoderCaptions::close()
+{
+    if (!pFile)
+        return true;
+
+    for (std::multimap<int64_t, TiVoCaption>::iterator it = pending.begin();
+         it != pending.end(); it++)
+        write(it->first, it->second);
+    pending.clear();
+
+    if (words)
+        std::fputs("\n", pFile);
+
+    bool ok = !std::ferror(pFile);
+    ok = (0 == std::fclose(pFile)) && ok;
+    pFile = NULL;
+
+    if (!ok)
+        std::perror(name.c_str());
+
+    return ok;
+}
+
+/* vi:set ai ts=4 sw=4 expandtab: */
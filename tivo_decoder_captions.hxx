@@ -0,0 +1,68 @@
+/*
+ * tivodecode-ng
+ * Copyright 2006-2015, Jeremy Drake et al.
+ * See COPYING file for license terms
+ */
+
+#ifndef TIVO_DECODER_CAPTIONS_HXX_
+#define TIVO_DECODER_CAPTIONS_HXX_
+
+#ifdef HAVE_CONFIG_H
+#include "tdconfig.h"
+#endif
+
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "tivo_decoder_mpeg_parser.hxx"
+
+// pictures held back to put them from decode into display order
+#define CAPTIONS_REORDER    16
+
+// caption words on an SCC line before another is started
+#define CAPTIONS_SCC_WORDS  32
+
+// the cc_data of one picture
+typedef struct
+{
+    int64_t              pts;
+    std::vector<uint8_t> cc;
+} TiVoCaption;
+
+/*
+ * --captions: the ATSC A/53 caption data found in the video user data as
+ * the decode passes it, in display order, so that the output need not be
+ * read again for it.  A file named .scc gets the CEA-608 field 1 pairs as
+ * Scenarist SCC; any other, the raw cc_data with its PTS.
+ */
+class TiVoDecoderCaptions
+{
+    private:
+        FILE        *pFile;
+        std::string name;
+        bool        scc;
+        int64_t     firstPts;
+        int64_t     lastPts;
+        size_t      words;
+
+        // by PTS since the first, till CAPTIONS_REORDER more have come
+        std::multimap<int64_t, TiVoCaption> pending;
+
+        void write(int64_t at, const TiVoCaption &caption);
+
+    public:
+        size_t      count;
+
+        bool open(const char *filename);
+        void add(const mpeg_picture_info &info);
+        bool close();
+
+        TiVoDecoderCaptions();
+        ~TiVoDecoderCaptions();
+};
+
+#endif /* TIVO_DECODER_CAPTIONS_HXX_ */
+
+/* vi:set ai ts=4 sw=4 expandtab: */
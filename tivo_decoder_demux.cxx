@@ -0,0 +1,293 @@
+/*
+ * tivodecode-ng
+ * Copyright 2006-2015, Jeremy Drake et al.
+ * See COPYING file for license terms
+ */
+#ifdef HAVE_CONFIG_H
+#include "tdconfig.h"
+#endif
+
+#include <algorithm>
+#include <cstring>
+
+#include "tivo_parse.hxx"
+#include "tivo_decoder_demux.hxx"
+
+TiVoDecoderDemux::TiVoDecoderDemux(const char *namePrefix, int formatType,
+                                   bool wholePes)
+{
+    prefix     = namePrefix;
+    format     = formatType;
+    pes        = wholePes;
+    failed     = false;
+    partialLen = 0;
+    count      = 0;
+}
+
+TiVoDecoderDemux::~TiVoDecoderDemux()
+{
+    close();
+}
+
+void TiVoDecoderDemux::sink(void *pContext, const void *ptr, size_t size)
+{
+    ((TiVoDecoderDemux *)pContext)->feed((const uint8_t *)ptr, size);
+}
+
+// The file extension for a stream, from its id and first payload.
+static const char *es_extension(uint8_t streamId, const uint8_t *pData,
+                                size_t len)
+{
+    if ((streamId >= 0xe0) && (streamId <= 0xef))
+    {
+        // H.264 opens with a 4 byte start code or an access unit delimiter
+        if ((len >= 4) && !pData[0] && !pData[1] &&
+            (((pData[2] == 0) && (pData[3] == 1)) ||
+             ((pData[2] == 1) && (pData[3] == 0x09))))
+            return "264";
+
+        return "m2v";
+    }
+
+    if ((streamId >= 0xc0) && (streamId <= 0xdf))
+        return "mp2";
+
+    if ((len >= 2) && (pData[0] == 0x0b) && (pData[1] == 0x77))
+        return "ac3";
+
+    return "es";
+}
+
+void TiVoDecoderDemux::payload(int id, TiVoDemuxStream &stream,
+                               const uint8_t *pData, size_t len)
+{
+    if (!len || failed)
+        return;
+
+    if (!stream.pFile)
+    {
+        char name[32];
+
+        std::snprintf(name, sizeof(name),
+                      (format == TIVO_FORMAT_TS) ? ".%04x.%s" : ".%02x.%s", id,
+                      pes ? "pes" : es_extension(stream.streamId, pData, len));
+
+        std::string path = prefix + name;
+        stream.pFile = std::fopen(path.c_str(), "wb");
+        if (!stream.pFile)
+        {
+            std::perror(path.c_str());
+            failed = true;
+            return;
+        }
+
+        count++;
+    }
+
+    if (std::fwrite(pData, 1, len, stream.pFile) != len)
+    {
+        std::perror("demux: writing");
+        failed = true;
+    }
+
+    stream.written += len;
+}
+
+// whether the PES header in head is all there
+static inline bool head_done(const std::vector<uint8_t> &head)
+{
+    return (head.size() >= 9) && (head.size() >= 9u + head[8]);
+}
+
+// One TS packet: the payload of PIDs carrying PES, from their first start.
+void TiVoDecoderDemux::packet(const uint8_t *pPkt)
+{
+    if ((pPkt[0] != 0x47) || !(pPkt[3] & 0x10))
+        return;
+
+    int    pid    = ((pPkt[1] & 0x1f) << 8) | pPkt[2];
+    bool   start  = (pPkt[1] & 0x40) != 0;
+    size_t offset = 4;
+
+    if (pPkt[3] & 0x20)
+        offset += 1 + pPkt[4];
+    if (offset >= DEMUX_TS_PACKET)
+        return;
+
+    const uint8_t *pData = pPkt + offset;
+    size_t len = DEMUX_TS_PACKET - offset;
+    TiVoDemuxStream &stream = streams[pid];
+
+    if (start)
+    {
+        // PSI sections never open with a start code prefix
+        stream.pes = (len >= 4) && !pData[0] && !pData[1] && (pData[2] == 1);
+        if (!stream.pes)
+            return;
+
+        stream.streamId = pData[3];
+        stream.started  = true;
+        stream.head.clear();
+    }
+
+    if (!stream.started || !stream.pes)
+        return;
+
+    if (pes)
+    {
+        payload(pid, stream, pData, len);
+        return;
+    }
+
+    while (len && !head_done(stream.head))
+    {
+        size_t want = (stream.head.size() < 9) ? 9 - stream.head.size() :
+                      9 + stream.head[8] - stream.head.size();
+        size_t n = std::min(want, len);
+
+        stream.head.insert(stream.head.end(), pData, pData + n);
+        pData += n;
+        len   -= n;
+    }
+
+    if (head_done(stream.head))
+        payload(pid, stream, pData, len);
+}
+
+/*
+ * Whole PS units in pending: pack headers and end codes are passed over,
+ * PES packets of elementary streams written.  What is left waits for more.
+ */
+void TiVoDecoderDemux::parse()
+{
+    const uint8_t *pBuf = pending.empty() ? NULL : &pending[0];
+    size_t size = pending.size();
+    size_t at   = 0;
+
+    while (at + 4 <= size)
+    {
+        if (pBuf[at] || pBuf[at + 1] || (pBuf[at + 2] != 1))
+        {
+            at++;
+            continue;
+        }
+
+        uint8_t code = pBuf[at + 3];
+        size_t  len;
+
+        if (code == 0xba)
+        {
+            if (at + 14 > size)
+                break;
+            len = ((pBuf[at + 4] >> 6) == 1) ? 14 + (pBuf[at + 13] & 0x07) : 12;
+        }
+        else if (code == 0xb9)
+            len = 4;
+        else if (code >= 0xbb)
+        {
+            if (at + 6 > size)
+                break;
+            len = 6 + ((pBuf[at + 4] << 8) | pBuf[at + 5]);
+        }
+        else
+        {
+            at += 3;
+            continue;
+        }
+
+        if (at + len > size)
+            break;
+
+        const uint8_t *pPkt = pBuf + at;
+        at += len;
+
+        // padding, private stream 2 and the system header carry no ES
+        if ((code != 0xbd) && ((code < 0xc0) || (code > 0xef)))
+            continue;
+
+        TiVoDemuxStream &stream = streams[code];
+        stream.streamId = code;
+
+        if (pes)
+        {
+            payload(code, stream, pPkt, len);
+            continue;
+        }
+
+        if ((len < 9) || ((pPkt[6] >> 6) != 2) || (9u + pPkt[8] > len))
+            continue;
+
+        const uint8_t *pData = pPkt + 9 + pPkt[8];
+        size_t dlen = len - 9 - pPkt[8];
+
+        // DVD style private stream 1: a substream id and 3 bytes before AC-3
+        if ((code == 0xbd) && !stream.started)
+            stream.strip = ((dlen >= 6) && (pData[0] >= 0x80) &&
+                            (pData[0] <= 0x87) && (pData[4] == 0x0b) &&
+                            (pData[5] == 0x77)) ? 4 : 0;
+
+        stream.started = true;
+        if (dlen < stream.strip)
+            continue;
+
+        payload(code, stream, pData + stream.strip, dlen - stream.strip);
+    }
+
+    pending.erase(pending.begin(), pending.begin() + at);
+}
+
+void TiVoDecoderDemux::feed(const uint8_t *pData, size_t len)
+{
+    if (format != TIVO_FORMAT_TS)
+    {
+        pending.insert(pending.end(), pData, pData + len);
+        parse();
+        return;
+    }
+
+    if (partialLen)
+    {
+        size_t n = std::min(DEMUX_TS_PACKET - partialLen, len);
+
+        std::memcpy(partial + partialLen, pData, n);
+        partialLen += n;
+        pData      += n;
+        len        -= n;
+
+        if (partialLen < DEMUX_TS_PACKET)
+            return;
+
+        packet(partial);
+        partialLen = 0;
+    }
+
+    for (; len >= DEMUX_TS_PACKET; pData += DEMUX_TS_PACKET,
+                                   len -= DEMUX_TS_PACKET)
+        packet(pData);
+
+    std::memcpy(partial, pData, len);
+    partialLen = len;
+}
+
+// Close the stream files, false if any write failed.
+bool TiVoDecoderDemux::close()
+{
+    for (std::map<int, TiVoDemuxStream>::iterator it = streams.begin();
+         it != streams.end(); it++)
+    {
+        if (!it->second.pFile)
+            continue;
+
+        if (0 != std::fclose(it->second.pFile))
+        {
+            std::perror("demux: closing");
+            failed = true;
+        }
+
+        it->second.pFile = NULL;
+    }
+
+    return !failed;
+}
+
+/* vi:set ai ts=4 sw=4 expandtab: */
@@ -0,0 +1,76 @@
+/*
+ * tivodecode-ng
+ * Copyright 2006-2015, Jeremy Drake et al.
+ * See COPYING file for license terms
+ */
+
+#ifndef TIVO_DECODER_DEMUX_HXX_
+#define TIVO_DECODER_DEMUX_HXX_
+
+#ifdef HAVE_CONFIG_H
+#include "tdconfig.h"
+#endif
+
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "happyfile.hxx"
+
+#define DEMUX_TS_PACKET     188
+
+// one output file, for a TS PID or a PS stream id
+typedef struct
+{
+    FILE                 *pFile;
+    uint8_t               streamId;
+    bool                  started;      // a PES start was seen
+    bool                  pes;          // TS: the PID carries PES packets
+    std::vector<uint8_t>  head;         // TS: PES header bytes so far
+    size_t                strip;        // PS: substream header bytes
+    hoff_t                written;
+} TiVoDemuxStream;
+
+/*
+ * --demux: split the decoded output into a file per stream as it is
+ * written, through a HappyFile sink, instead of muxing it.  Each gets the
+ * elementary stream (.m2v, .264, .mp2, .ac3) or, with pes set, its whole
+ * PES packets (.pes).
+ */
+class TiVoDecoderDemux
+{
+    private:
+        std::string                         prefix;
+        int                                 format;
+        bool                                pes;
+        bool                                failed;
+
+        std::map<int, TiVoDemuxStream>      streams;
+
+        // TS: a packet split between writes; PS: the unparsed tail
+        uint8_t                             partial[DEMUX_TS_PACKET];
+        size_t                              partialLen;
+        std::vector<uint8_t>                pending;
+
+        void packet(const uint8_t *pPkt);
+        void parse();
+        void payload(int id, TiVoDemuxStream &stream, const uint8_t *pData,
+                     size_t len);
+
+    public:
+        size_t count;
+
+        void feed(const uint8_t *pData, size_t len);
+        bool close();
+
+        static void sink(void *pContext, const void *ptr, size_t size);
+
+        TiVoDecoderDemux(const char *namePrefix, int formatType,
+                         bool wholePes);
+        ~TiVoDecoderDemux();
+};
+
+#endif /* TIVO_DECODER_DEMUX_HXX_ */
+
+/* vi:set ai ts=4 sw=4 expandtab: */
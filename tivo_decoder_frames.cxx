@@ -0,0 +1,134 @@
+/*
+ * tivodecode-ng
+ * Copyright 2006-2015, Jeremy Drake et al.
+ * See COPYING file for license terms
+ */
+#ifdef HAVE_CONFIG_H
+#include "tdconfig.h"
+#endif
+
+#include <cstdio>
+#include <cstring>
+
+#include <strings.h>
+
+#include "tivo_decoder_frames.hxx"
+
+/*
+ * The binary sidecar, all big-endian:
+ *   "TDKF", version, 3 reserved bytes
+ * then a record per frame:
+ *   8 byte output offset, 8 byte PTS, 8 byte DTS (all ones for none),
+ *   2 byte PID (PS: stream id), picture_coding_type, flags (1: GOP start)
+ * A file named .csv gets the same as text, one line per frame.
+ */
+#define FRAMES_MAGIC        "TDKF"
+#define FRAMES_VERSION      1
+
+TiVoDecoderFrames::TiVoDecoderFrames()
+{
+    pFile = NULL;
+    csv   = false;
+    count = 0;
+}
+
+TiVoDecoderFrames::~TiVoDecoderFrames()
+{
+    if (pFile)
+        std::fclose(pFile);
+}
+
+bool TiVoDecoderFrames::open(const char *filename)
+{
+    size_t len = std::strlen(filename);
+
+    name  = filename;
+    csv   = (len > 4) && !strcasecmp(filename + len - 4, ".csv");
+    count = 0;
+
+    pFile = std::fopen(filename, csv ? "w" : "wb");
+    if (!pFile)
+    {
+        std::perror(filename);
+        return false;
+    }
+
+    if (csv)
+    {
+        std::fputs("offset,pid,type,gop,pts,dts\n", pFile);
+    }
+    else
+    {
+        uint8_t header[8];
+
+        std::memset(header, 0, sizeof(header));
+        std::memcpy(header, FRAMES_MAGIC, 4);
+        header[4] = FRAMES_VERSION;
+
+        std::fwrite(header, 1, sizeof(header), pFile);
+    }
+
+    return true;
+}
+
+static void put(uint8_t *&pPtr, uint64_t val, int bytes)
+{
+    while (bytes--)
+        *pPtr++ = (uint8_t)(val >> (bytes * 8));
+}
+
+// Note the PES packet at output offset out if it starts an I picture or GOP.
+void TiVoDecoderFrames::mark(hoff_t out, uint16_t id,
+                             const mpeg_picture_info &info)
+{
+    if (!pFile || ((info.pictureType != 1) && (false == info.gop)))
+        return;
+
+    if (csv)
+    {
+        static const char types[] = "-IPBD---";
+        char pts[24] = "";
+        char dts[24] = "";
+
+        if (info.pts >= 0)
+            std::snprintf(pts, sizeof(pts), "%lld", (long long)info.pts);
+        if (info.dts >= 0)
+            std::snprintf(dts, sizeof(dts), "%lld", (long long)info.dts);
+
+        std::fprintf(pFile, "%lld,%u,%c,%d,%s,%s\n", (long long)out, id,
+                     types[info.pictureType & 7], info.gop ? 1 : 0, pts, dts);
+    }
+    else
+    {
+        uint8_t record[28];
+        uint8_t *pPtr = record;
+
+        put(pPtr, out, 8);
+        put(pPtr, (uint64_t)info.pts, 8);
+        put(pPtr, (uint64_t)info.dts, 8);
+        put(pPtr, id, 2);
+        put(pPtr, info.pictureType, 1);
+        put(pPtr, info.gop ? 1 : 0, 1);
+
+        std::fwrite(record, 1, sizeof(record), pFile);
+    }
+
+    count++;
+}
+
+bool TiVoDecoderFrames::close()
+{
+    if (!pFile)
+        return true;
+
+    bool ok = !std::ferror(pFile);
+    ok = (0 == std::fclose(pFile)) && ok;
+    pFile = NULL;
+
+    if (!ok)
+        std::perror(name.c_str());
+
+    return ok;
+}
+
+/* vi:set ai ts=4 sw=4 expandtab: */
@@ -0,0 +1,45 @@
+/*
+ * tivodecode-ng
+ * Copyright 2006-2015, Jeremy Drake et al.
+ * See COPYING file for license terms
+ */
+
+#ifndef TIVO_DECODER_FRAMES_HXX_
+#define TIVO_DECODER_FRAMES_HXX_
+
+#ifdef HAVE_CONFIG_H
+#include "tdconfig.h"
+#endif
+
+#include <cstdio>
+#include <string>
+
+#include "happyfile.hxx"
+#include "tivo_decoder_mpeg_parser.hxx"
+
+/*
+ * --keyframes: the output offset, PTS and DTS of every video PES packet
+ * holding an I picture or a GOP header, written as the decode goes, so
+ * that the output need not be read again to find its cut points.
+ */
+class TiVoDecoderFrames
+{
+    private:
+        FILE        *pFile;
+        std::string name;
+        bool        csv;
+
+    public:
+        size_t      count;
+
+        bool open(const char *filename);
+        void mark(hoff_t out, uint16_t id, const mpeg_picture_info &info);
+        bool close();
+
+        TiVoDecoderFrames();
+        ~TiVoDecoderFrames();
+};
+
+#endif /* TIVO_DECODER_FRAMES_HXX_ */
+
+/* vi:set ai ts=4 sw=4 expandtab: */
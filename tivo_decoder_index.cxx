@@ -0,0 +1,363 @@
+/*
+ * tivodecode-ng
+ * Copyright 2006-2015, Jeremy Drake et al.
+ * See COPYING file for license terms
+ */
+#ifdef HAVE_CONFIG_H
+#include "tdconfig.h"
+#endif
+
+#include <cstdio>
+#include <cstring>
+
+#ifdef WIN32
+# include <io.h>
+#else
+# include <unistd.h>
+#endif
+
+#include "tivo_decoder_index.hxx"
+
+/*
+ * The sidecar, all big-endian:
+ *   "TDIX", version, format, 2 reserved bytes, 8 byte mpeg_offset
+ * then records, a PID table applying to the points after it:
+ *   'T', 2 byte PMT PID, count, count * (PID 2, type id, type, stream id,
+ *   16 byte key)
+ * and seek points:
+ *   'P', 8 byte input offset, 8 byte output offset, count,
+ *   count * (stream id, 4 byte block, 4 byte bytes used)
+ */
+#define INDEX_MAGIC         "TDIX"
+#define INDEX_VERSION       1
+
+TiVoDecoderIndex::TiVoDecoderIndex(int formatType, hoff_t mpeg_offset)
+{
+    format     = formatType;
+    mpegOffset = mpeg_offset;
+    lastIn     = 0;
+    lastSave   = std::chrono::steady_clock::now();
+
+    checkpointSeconds = CHECKPOINT_SECONDS;
+}
+
+static bool same_table(const TiVoIndexTable &a, const TiVoIndexTable &b)
+{
+    if ((a.pmtPid != b.pmtPid) || (a.pids.size() != b.pids.size()))
+        return false;
+
+    for (size_t i = 0; i < a.pids.size(); i++)
+    {
+        if (std::memcmp(&a.pids[i], &b.pids[i], sizeof(TiVoIndexPid)))
+            return false;
+    }
+
+    return true;
+}
+
+// Note a seek point; pTable is the TS PID table, NULL for PS.
+void TiVoDecoderIndex::add(hoff_t in, hoff_t out, TuringState *pTuring,
+                           const TiVoIndexTable *pTable)
+{
+    TiVoIndexPoint point;
+
+    point.in    = in;
+    point.out   = out;
+    point.table = -1;
+    pTuring->positions(&point.ciphers);
+
+    if (pTable)
+    {
+        if (tables.empty() || !same_table(tables.back(), *pTable))
+            tables.push_back(*pTable);
+
+        point.table = (int)tables.size() - 1;
+    }
+
+    points.push_back(point);
+    lastIn = in;
+}
+
+// The last point at or before output offset out, NULL for none.
+const TiVoIndexPoint *TiVoDecoderIndex::find(hoff_t out)
+{
+    const TiVoIndexPoint *pPoint = NULL;
+    size_t lo = 0;
+    size_t hi = points.size();
+
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+
+        if (points[mid].out <= out)
+        {
+            pPoint = &points[mid];
+            lo = mid + 1;
+        }
+        else
+            hi = mid;
+    }
+
+    return pPoint;
+}
+
+// The first point at or after output offset out, NULL for none.
+const TiVoIndexPoint *TiVoDecoderIndex::after(hoff_t out)
+{
+    const TiVoIndexPoint *pPoint = find(out);
+
+    if (pPoint && (pPoint->out == out))
+        return pPoint;
+
+    size_t next = pPoint ? (pPoint - &points[0]) + 1 : 0;
+    return (next < points.size()) ? &points[next] : NULL;
+}
+
+/*
+ * --resume: drop the points past output offset out, and return the last one
+ * left for the decode to go on from, NULL for none.
+ */
+const TiVoIndexPoint *TiVoDecoderIndex::resume(hoff_t out)
+{
+    const TiVoIndexPoint *pPoint = find(out);
+    size_t keep = pPoint ? (pPoint - &points[0]) + 1 : 0;
+
+    points.resize(keep);
+    if (points.empty())
+    {
+        tables.clear();
+        lastIn = 0;
+        return NULL;
+    }
+
+    tables.resize(points.back().table + 1);
+    lastIn = points.back().in;
+    return &points.back();
+}
+
+/*
+ * --checkpoint: every checkpointSeconds, or now, commit the output to disk
+ * and then replace the checkpoint file with the index so far, so that every
+ * point in it is inside the output on disk.
+ */
+void TiVoDecoderIndex::checkpoint(HappyFile *pOut, bool now)
+{
+    std::chrono::steady_clock::time_point at =
+        std::chrono::steady_clock::now();
+
+    if (checkpointFile.empty() ||
+        (!now && (std::chrono::duration<double>(at - lastSave).count() <
+                  checkpointSeconds)))
+        return;
+
+    lastSave = at;
+
+    if (pOut->sync() < 0)
+    {
+        std::perror("checkpoint: syncing output");
+        return;
+    }
+
+    std::string temp = checkpointFile + ".tmp";
+
+    if (write(temp.c_str()) &&
+        (std::rename(temp.c_str(), checkpointFile.c_str()) < 0))
+        std::perror(checkpointFile.c_str());
+}
+
+static void put(std::vector<uint8_t> &buf, uint64_t val, int bytes)
+{
+    while (bytes--)
+        buf.push_back((uint8_t)(val >> (bytes * 8)));
+}
+
+static uint64_t get(const uint8_t *&pPtr, int bytes)
+{
+    uint64_t val = 0;
+
+    while (bytes--)
+        val = (val << 8) | *pPtr++;
+
+    return val;
+}
+
+bool TiVoDecoderIndex::write(const char *filename)
+{
+    std::vector<uint8_t> buf;
+    int table = -1;
+
+    buf.insert(buf.end(), INDEX_MAGIC, INDEX_MAGIC + 4);
+    put(buf, INDEX_VERSION, 1);
+    put(buf, format, 1);
+    put(buf, 0, 2);
+    put(buf, mpegOffset, 8);
+
+    for (size_t i = 0; i < points.size(); i++)
+    {
+        const TiVoIndexPoint &point = points[i];
+
+        if (point.table != table)
+        {
+            const TiVoIndexTable &pids = tables[point.table];
+
+            put(buf, 'T', 1);
+            put(buf, pids.pmtPid, 2);
+            put(buf, pids.pids.size(), 1);
+
+            for (size_t j = 0; j < pids.pids.size(); j++)
+            {
+                const TiVoIndexPid &pid = pids.pids[j];
+
+                put(buf, pid.pid, 2);
+                put(buf, pid.typeId, 1);
+                put(buf, pid.type, 1);
+                put(buf, pid.streamId, 1);
+                buf.insert(buf.end(), pid.key, pid.key + 16);
+            }
+
+            table = point.table;
+        }
+
+        put(buf, 'P', 1);
+        put(buf, point.in, 8);
+        put(buf, point.out, 8);
+        put(buf, point.ciphers.size(), 1);
+
+        for (size_t j = 0; j < point.ciphers.size(); j++)
+        {
+            put(buf, point.ciphers[j].stream_id, 1);
+            put(buf, point.ciphers[j].block_id, 4);
+            put(buf, point.ciphers[j].consumed, 4);
+        }
+    }
+
+    FILE *f = std::fopen(filename, "wb");
+    if (!f)
+    {
+        std::perror(filename);
+        return false;
+    }
+
+    bool ok = (std::fwrite(&buf[0], 1, buf.size(), f) == buf.size()) &&
+              (0 == std::fflush(f));
+
+    // on disk before a checkpoint is renamed over the last
+#ifdef WIN32
+    ok = ok && (0 == _commit(_fileno(f)));
+#else
+    ok = ok && (0 == fsync(fileno(f)));
+#endif
+    if ((0 != std::fclose(f)) || !ok)
+    {
+        std::perror(filename);
+        return false;
+    }
+
+    return true;
+}
+
+bool TiVoDecoderIndex::read(const char *filename)
+{
+    std::vector<uint8_t> buf;
+    uint8_t chunk[65536];
+    size_t  len;
+
+    FILE *f = std::fopen(filename, "rb");
+    if (!f)
+    {
+        std::perror(filename);
+        return false;
+    }
+
+    while ((len = std::fread(chunk, 1, sizeof(chunk), f)) > 0)
+        buf.insert(buf.end(), chunk, chunk + len);
+    std::fclose(f);
+
+    tables.clear();
+    points.clear();
+
+    const uint8_t *pPtr = &buf[0];
+    const uint8_t *pEnd = pPtr + buf.size();
+
+    if ((buf.size() < 16) || std::memcmp(pPtr, INDEX_MAGIC, 4) ||
+        (pPtr[4] != INDEX_VERSION))
+    {
+        std::fprintf(stderr, "%s: not a tivodecode index\n", filename);
+        return false;
+    }
+
+    pPtr += 5;
+    format     = (int)get(pPtr, 1);
+    pPtr += 2;
+    mpegOffset = (hoff_t)get(pPtr, 8);
+
+    while (pPtr < pEnd)
+    {
+        uint8_t type  = *pPtr++;
+        size_t  count = 0;
+
+        if ((type == 'T') && (pEnd - pPtr >= 3))
+        {
+            TiVoIndexTable pids;
+
+            pids.pmtPid = (uint16_t)get(pPtr, 2);
+            count       = (size_t)get(pPtr, 1);
+
+            if ((size_t)(pEnd - pPtr) < count * 21)
+                break;
+
+            for (size_t j = 0; j < count; j++)
+            {
+                TiVoIndexPid pid;
+
+                pid.pid      = (uint16_t)get(pPtr, 2);
+                pid.typeId   = (uint8_t)get(pPtr, 1);
+                pid.type     = (uint8_t)get(pPtr, 1);
+                pid.streamId = (uint8_t)get(pPtr, 1);
+                std::memcpy(pid.key, pPtr, 16);
+                pPtr += 16;
+
+                pids.pids.push_back(pid);
+            }
+
+            tables.push_back(pids);
+        }
+        else if ((type == 'P') && (pEnd - pPtr >= 17))
+        {
+            TiVoIndexPoint point;
+
+            point.in    = (hoff_t)get(pPtr, 8);
+            point.out   = (hoff_t)get(pPtr, 8);
+            point.table = (int)tables.size() - 1;
+            count       = (size_t)get(pPtr, 1);
+
+            if ((size_t)(pEnd - pPtr) < count * 9)
+                break;
+
+            for (size_t j = 0; j < count; j++)
+            {
+                turing_position pos;
+
+                pos.stream_id = (uint8_t)get(pPtr, 1);
+                pos.block_id  = (unsigned int)get(pPtr, 4);
+                pos.consumed  = (size_t)get(pPtr, 4);
+
+                point.ciphers.push_back(pos);
+            }
+
+            points.push_back(point);
+        }
+        else
+            break;
+    }
+
+    if (pPtr != pEnd)
+    {
+        std::fprintf(stderr, "%s: index is damaged\n", filename);
+        return false;
+    }
+
+    return true;
+}
+
+/* vi:set ai ts=4 sw=4 expandtab: */
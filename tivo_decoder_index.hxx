@@ -0,0 +1,96 @@
+/*
+ * tivodecode-ng
+ * Copyright 2006-2015, Jeremy Drake et al.
+ * See COPYING file for license terms
+ */
+
+#ifndef TIVO_DECODER_INDEX_HXX_
+#define TIVO_DECODER_INDEX_HXX_
+
+#ifdef HAVE_CONFIG_H
+#include "tdconfig.h"
+#endif
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "happyfile.hxx"
+#include "tivo_parse.hxx"
+
+// input between seek points, at the next PES or pack start past it
+#define INDEX_SPACING       (256 * 1024)
+
+// --checkpoint without seconds: how often the checkpoint file is saved
+#define CHECKPOINT_SECONDS  10
+
+// a TS PID as the PAT, PMT and TiVo private data left it
+typedef struct
+{
+    uint16_t pid;
+    uint8_t  typeId;            // PMT stream_type
+    uint8_t  type;              // ts_stream_types
+    uint8_t  streamId;          // from the TiVo private data
+    uint8_t  key[16];
+} TiVoIndexPid;
+
+typedef struct
+{
+    uint16_t                  pmtPid;
+    std::vector<TiVoIndexPid> pids;
+} TiVoIndexTable;
+
+/*
+ * A point the decode can restart from: the input and output offsets, the
+ * cipher position of every stream, and for TS the PID table in effect.
+ */
+typedef struct TiVoIndexPoint
+{
+    hoff_t                       in;
+    hoff_t                       out;
+    std::vector<turing_position> ciphers;
+    int                          table;
+} TiVoIndexPoint;
+
+/*
+ * --write-index and --range: a sidecar of seek points, noted by the
+ * decoders as they pass PES or pack starts, from which a range of the
+ * output can be decoded without decoding what comes before it.
+ */
+class TiVoDecoderIndex
+{
+    private:
+        hoff_t                      lastIn;
+        std::chrono::steady_clock::time_point lastSave;
+
+    public:
+        int                         format;
+        hoff_t                      mpegOffset;
+        std::vector<TiVoIndexTable> tables;
+        std::vector<TiVoIndexPoint> points;
+
+        // --checkpoint: where the index is saved as the decode goes
+        std::string                 checkpointFile;
+        double                      checkpointSeconds;
+
+        // whether a seek point at input offset in would be kept
+        inline bool due(hoff_t in)
+            { return points.empty() || (in - lastIn >= INDEX_SPACING); }
+
+        void add(hoff_t in, hoff_t out, TuringState *pTuring,
+                 const TiVoIndexTable *pTable);
+        const TiVoIndexPoint *find(hoff_t out);
+        const TiVoIndexPoint *after(hoff_t out);
+        const TiVoIndexPoint *resume(hoff_t out);
+        void checkpoint(HappyFile *pOut, bool now = false);
+
+        bool write(const char *filename);
+        bool read(const char *filename);
+
+        TiVoDecoderIndex(int formatType, hoff_t mpeg_offset);
+};
+
+#endif /* TIVO_DECODER_INDEX_HXX_ */
+
+/* vi:set ai ts=4 sw=4 expandtab: */
@@ -7,7 +7,9 @@
 #include "tdconfig.h"
 #endif
 
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
 
 #include "tivo_decoder_mpeg_parser.hxx"
 
@@ -31,6 +33,8 @@ TiVoDecoder_MPEG2_Parser::TiVoDecoder_MPEG2_Parser()
     vertical_size           = 0x00;
     scalable_mode           = 0x00;
     picture_structure       = 0x00;
+
+    clearInfo();
 }
 
 TiVoDecoder_MPEG2_Parser::TiVoDecoder_MPEG2_Parser(uint8_t *pBuffer,
@@ -54,6 +58,8 @@ TiVoDecoder_MPEG2_Parser::TiVoDecoder_MPEG2_Parser(uint8_t *pBuffer,
     vertical_size        = 0x00;
     scalable_mode        = 0x00;
     picture_structure    = 0x00;
+
+    clearInfo();
 }
 
 void TiVoDecoder_MPEG2_Parser::setBuffer(uint8_t *pBuffer, uint16_t bufLen)
@@ -62,6 +68,71 @@ void TiVoDecoder_MPEG2_Parser::setBuffer(uint8_t *pBuffer, uint16_t bufLen)
     _buffer_length = bufLen;
     _bit_ptr = 0;
     _end_of_file = false;
+    clearInfo();
+}
+
+void TiVoDecoder_MPEG2_Parser::clearInfo()
+{
+    info.pts         = -1;
+    info.dts         = -1;
+    info.pictureType = 0;
+    info.gop         = false;
+    info.ccCount     = 0;
+}
+
+/*
+ * ATSC A/53 captions, from the user data after its start code: "GA94",
+ * user_data_type_code 3, the cc_count, em_data, then cc_count triplets of
+ * cc_valid and cc_type and two bytes, which are added to pInfo.
+ */
+void mpeg_cc_data(const uint8_t *pData, size_t len, mpeg_picture_info *pInfo)
+{
+    if ((len < 7) || std::memcmp(pData, "GA94", 4) || (pData[4] != 0x03) ||
+        !(pData[5] & 0x40))
+        return;
+
+    size_t count = std::min((size_t)(pData[5] & 0x1f), (len - 7) / 3);
+    count = std::min(count, (size_t)(MPEG_CC_MAX - pInfo->ccCount));
+
+    std::memcpy(pInfo->cc + pInfo->ccCount * 3, pData + 7, count * 3);
+    pInfo->ccCount += count;
+}
+
+/*
+ * For --captions, the caption data of the user data ahead of the first
+ * slice, in the decrypted start of a video PES or its payload.
+ */
+void mpeg_scan_captions(const uint8_t *pData, size_t len,
+                        mpeg_picture_info *pInfo)
+{
+    pInfo->ccCount = 0;
+
+    for (size_t i = 0; i + 4 < len; i++)
+    {
+        if (pData[i] || pData[i+1] || (pData[i+2] != 0x01))
+            continue;
+
+        uint8_t code = pData[i+3];
+
+        if ((code >= 0x01) && (code <= 0xAF))
+            return;
+
+        if (code == 0xB2)
+            mpeg_cc_data(pData + i + 4, len - i - 4, pInfo);
+
+        i += 3;
+    }
+}
+
+// The PTS or DTS at the read position, -1 if it runs past the buffer.
+int64_t TiVoDecoder_MPEG2_Parser::timestamp()
+{
+    uint32_t pos = _bit_ptr / 8;
+
+    if (pos + 5 > _buffer_length)
+        return -1;
+
+    return mpeg_timestamp(&_pBuffer[pos]);
 }
 
 bool TiVoDecoder_MPEG2_Parser::byteAligned()
@@ -407,6 +478,7 @@ void TiVoDecoder_MPEG2_Parser::group_of_pictures_header(uint16_t &len)
 {
 //  group_start_code:32;
     advanceBits(32);
+    info.gop = true;
 //  time_code:25;
     advanceBits(25);
 //  closed_gop:1;
@@ -427,6 +499,7 @@ void TiVoDecoder_MPEG2_Parser::picture_header(uint16_t &len)
 //  picture_coding_type:3;
     uint8_t picture_coding_type = nextbits(3);
     advanceBits(3);
+    info.pictureType = picture_coding_type;
 //  vbv_delay:16;
     advanceBits(16);
 
@@ -546,6 +619,7 @@ void TiVoDecoder_MPEG2_Parser::pes_header_extension(uint16_t &len)
 
     if (PTS_DTS_flags == 2)
     {
+        info.pts = timestamp();
 //      marker_bit:4 = 0;
         advanceBits(4);
 //      pts_32_30:3 = 0;
@@ -563,6 +637,7 @@ void TiVoDecoder_MPEG2_Parser::pes_header_extension(uint16_t &len)
     }
     else if (PTS_DTS_flags == 3)
     {
+        info.pts = timestamp();
 //      marker_bit:4 = 0;
         advanceBits(4);
 //      pts_32_30:3 = 0;
@@ -577,6 +652,7 @@ void TiVoDecoder_MPEG2_Parser::pes_header_extension(uint16_t &len)
         advanceBits(15);
 //      marker_bit:1 = 0;
         advanceBits(1);
+        info.dts = timestamp();
 //      marker_bit:4 = 0;
         advanceBits(4);
 //      dts_32_30:3 = 0;
@@ -5,8 +5,36 @@
 #include "tdconfig.h"
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
 
+// cc_count is five bits
+#define MPEG_CC_MAX         31
+
+// what the headers ahead of the first slice said, for --keyframes
+typedef struct
+{
+    int64_t pts;                // 90kHz, -1 if none
+    int64_t dts;
+    uint8_t pictureType;        // picture_coding_type, 0 if no picture header
+    bool    gop;                // a GOP header was seen
+    uint8_t ccCount;            // A/53 cc_data triplets in user data
+    uint8_t cc[MPEG_CC_MAX * 3];
+} mpeg_picture_info;
+
+// a PTS or DTS from its five bytes in a PES header
+inline int64_t mpeg_timestamp(const uint8_t *pPtr)
+{
+    return ((int64_t)(pPtr[0] & 0x0E) << 29) | ((int64_t)pPtr[1] << 22) |
+           ((int64_t)(pPtr[2] & 0xFE) << 14) | ((int64_t)pPtr[3] << 7) |
+           (pPtr[4] >> 1);
+}
+
+void mpeg_cc_data(const uint8_t *pData, size_t len,
+                  mpeg_picture_info *pInfo);
+void mpeg_scan_captions(const uint8_t *pData, size_t len,
+                        mpeg_picture_info *pInfo);
+
 class TiVoDecoder_MPEG2_Parser
 {
     private:
@@ -30,7 +58,11 @@ class TiVoDecoder_MPEG2_Parser
         uint8_t  scalable_mode;
         uint8_t  picture_structure;
 
+        int64_t  timestamp();
+
     public:
+        mpeg_picture_info info;
+
         TiVoDecoder_MPEG2_Parser();
         TiVoDecoder_MPEG2_Parser(uint8_t *pBuffer, uint16_t bufLen);
         void setBuffer(uint8_t *pBuffer, uint16_t bufLen);
@@ -38,6 +70,7 @@ class TiVoDecoder_MPEG2_Parser
         inline bool   isEndOfFile() { return _end_of_file; }
         inline uint16_t getReadPos()  { return _bit_ptr / 8; }
         inline void   clear()       { hdr_len = 0;         }
+        void          clearInfo();
 
         bool  byteAligned();
         void  advanceBits(uint32_t n);
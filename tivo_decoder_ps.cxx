@@ -7,15 +7,22 @@
 #include "tdconfig.h"
 #endif
 
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
 
 #include "hexlib.hxx"
+#include "profiler.hxx"
 #include "tivo_parse.hxx"
+#include "tivo_probes.hxx"
 #include "tivo_decoder_ps.hxx"
-
-extern int o_verbose;
-extern int o_no_verify;
+#include "tivo_decoder_frames.hxx"
+#include "tivo_decoder_captions.hxx"
+#include "tivo_decoder_segments.hxx"
+#include "tivo_decoder_index.hxx"
+#include "tivo_decoder_mpeg_parser.hxx"
+#include "tivo_decoder_stats.hxx"
+#include "tivo_decoder_verify.hxx"
 
 static packet_tag_info packet_tags[] = {
     {0x00, 0x00, PACK_SPECIAL},     // pic start
@@ -48,11 +55,137 @@ TiVoDecoderPS::TiVoDecoderPS(
         pInfile, 
         pOutfile)
 {
-    marker = 0xFFFFFFFF;
+    marker      = 0xFFFFFFFF;
+    byte        = 0x00;
+    first       = true;
+    verifySlices  = 0;
+    verifyPackets = 0;
+    iframeMarker  = 0xFFFFFFFF;
+    iframeNeed    = 0;
+    iframeKeep    = false;
+    iframeHeaders = false;
+    iframeKnown   = false;
+    pIFrameHold   = NULL;
+    iframeHeld    = 0;
+    iframeHoldRun = 0;
+    iframeHoldSplit = false;
+    iframeHoldDone  = false;
+    iframeHoldKept  = false;
+    packOut     = 0;
+    videoMarker   = 0xFFFFFFFF;
+    videoNeed     = 0;
+    videoHeaders  = false;
+    videoPtsUsed  = false;
+    videoPts      = -1;
+    videoDts      = -1;
+    pictureCode   = 0;
+    pictureOut    = 0;
+    picturePack   = 0;
+    std::memset(&picture, 0, sizeof(picture));
+    videoUserData = false;
+    videoUserLen  = 0;
+    pAlignedBuf = new uint64_t[PS_PACKET_BUFFER / sizeof(uint64_t) + 1];
 }
 
 TiVoDecoderPS::~TiVoDecoderPS()
 {
+    delete [] pIFrameHold;
+    delete [] pAlignedBuf;
+}
+
+/*
+ * Locate the first pack header at or after offset.  Besides the start code,
+ * the marker bits must be valid and another start code must follow it, as
+ * the encrypted payloads are full of random start code look-alikes.
+ */
+hoff_t TiVoDecoderPS::findSync(hoff_t offset)
+{
+    uint8_t buf[65536];
+    size_t  len = 0;
+    size_t  i   = 0;
+
+    while (1)
+    {
+        if (pFileIn->seek(offset) < 0)
+            return -1;
+
+        len = pFileIn->read(buf, sizeof(buf));
+        if (len < 32)
+            return -1;
+
+        for (i = 0; i + 32 <= len; i++)
+        {
+            if (buf[i] != 0x00 || buf[i+1] != 0x00 || buf[i+2] != 0x01 ||
+                buf[i+3] != 0xBA)
+                continue;
+
+            uint8_t *pPack   = &buf[i + 4];
+            int     stuffing = pPack[9] & 0x07;
+
+            if (((pPack[0] & 0xC4) == 0x44) && (pPack[2] & 0x04) &&
+                (pPack[4] & 0x04) && (pPack[5] & 0x01) &&
+                ((pPack[8] & 0x03) == 0x03) &&
+                (pPack[10 + stuffing] == 0x00) &&
+                (pPack[11 + stuffing] == 0x00) &&
+                (pPack[12 + stuffing] == 0x01))
+            {
+                return offset + (hoff_t)i;
+            }
+        }
+
+        offset += (hoff_t)i;
+    }
+}
+
+/*
+ * The PTS of the first video PES at or after input offset, or -1 if there
+ * is none within PTS_SEARCH; *pAt gets the offset of the pack it is in, if
+ * that was seen, or else of the PES.  PES headers are never encrypted.
+ */
+int64_t TiVoDecoderPS::findPts(hoff_t offset, hoff_t *pAt)
+{
+    uint8_t buf[65536];
+    hoff_t  last = offset + PTS_SEARCH;
+    hoff_t  pack = -1;
+    size_t  len  = 0;
+    size_t  i    = 0;
+
+    while (offset < last)
+    {
+        if (pFileIn->seek(offset) < 0)
+            return -1;
+
+        len = pFileIn->read(buf, sizeof(buf));
+        if (len < 16)
+            return -1;
+
+        for (i = 0; i + 16 <= len; i++)
+        {
+            if (buf[i] != 0x00 || buf[i+1] != 0x00 || buf[i+2] != 0x01)
+                continue;
+
+            if (buf[i+3] == 0xBA)
+            {
+                pack = offset + (hoff_t)i;
+            }
+            else if (((buf[i+3] & 0xF0) == 0xE0) &&
+                     ((buf[i+6] >> 6) == 0x2) && (buf[i+7] & 0x80) &&
+                     ((buf[i+9] & 0x21) == 0x21))
+            {
+                *pAt = (pack >= 0) ? pack : offset + (hoff_t)i;
+                return mpeg_timestamp(&buf[i+9]);
+            }
+        }
+
+        offset += (hoff_t)i;
+    }
+
+    return -1;
+}
+
+bool TiVoDecoderPS::isSynced()
+{
+    return pTuring->synced();
 }
 
 bool TiVoDecoderPS::process()
@@ -63,31 +196,74 @@ bool TiVoDecoderPS::process()
         return false;
     }
 
-    bool first = true;
-    uint8_t byte = 0x00;
-    
+    o_log_level = verbose;
+
     while (running)
     {
+        // a queued input resumes here once the largest frame is in
+        if (pFileIn->starved(PS_PACKET_BUFFER + 32))
+            return true;
+
+        // input offset of the byte (or frame) handled by this pass
+        hoff_t offset = pFileIn->tell() - 1;
+
+        if ((false == first) && (rangeEnd >= 0) && (offset >= rangeEnd))
+        {
+            VERBOSE("End of range\n");
+            break;
+        }
+
+        if ((false == first) && (true == dryRun) && (offset >= rangeStart))
+        {
+            if (false == beginOutput())
+                return false;
+
+            pTuring->dry_run(false);
+        }
+
         if ((marker & 0xFFFFFF00) == 0x100)
         {
             hoff_t position = pFileIn->tell();
+
+            // a seek point for --write-index at each pack start, whose
+            // first three bytes have been written
+            if (pIndex && (0xBA == byte) && (false == dryRun) &&
+                pIndex->due(position - 4))
+            {
+                pIndex->add(position - 4, pFileOut->written() - 3, pTuring,
+                            NULL);
+                pIndex->checkpoint(pFileOut);
+            }
+
+            if ((0xBA == byte) && (false == dryRun))
+                packOut = pFileOut->written() - 3;
+
             int ret = process_frame(byte, position);
 
             if (ret == 1)
             {
                 marker = 0xFFFFFFFF;
             }
-            else if (ret == 0)
+            else if ((ret == 0) && (false == dryRun))
             {
                 pFileOut->write(&byte, 1);
             }
+            else if (ret == FRAME_TRUNCATED)
+            {
+                // a recording cut short ends as if the frame were not there
+                VERBOSE("End of File in a frame\n");
+                break;
+            }
             else if (ret < 0)
             {
-                std::perror("processing frame");
-                return 10;
+                if (errno)
+                    std::perror("processing frame");
+                else
+                    std::fprintf(stderr, "processing frame: bad packet\n");
+                return false;
             }
         }
-        else if (!first)
+        else if (!first && (false == dryRun))
         {
             pFileOut->write(&byte, 1);
         }
@@ -107,17 +283,369 @@ bool TiVoDecoderPS::process()
         first = false;
     }    
 
+    if (iframeHeld)
+        releaseIFrame(true, false);
+
     VERBOSE("PS Process\n");
     return true;
 }
 
+// The PTS and DTS of a video PES, from its packet_length field on.
+static void pes_timestamps(const uint8_t *pPes, int header_len,
+                           int64_t *pPts, int64_t *pDts)
+{
+    *pPts = -1;
+    *pDts = -1;
+
+    if (((pPes[2] >> 6) == 0x2) && (pPes[3] & 0x80) && (header_len >= 10))
+        *pPts = mpeg_timestamp(&pPes[5]);
+
+    if (((pPes[2] >> 6) == 0x2) && (pPes[3] & 0x40) && (header_len >= 15))
+        *pDts = mpeg_timestamp(&pPes[10]);
+}
+
+/*
+ * Carry the start code scan on through the decrypted payload of a video
+ * PES written at output offset out, whose header from its packet_length
+ * field on is at pPes.  The headers of a picture run from the
+ * sequence, GOP or picture header after the slices of the one before to
+ * its first slice, where what they said is done with; a PES may start
+ * anywhere in a picture, or hold the end of one and the start of the next.
+ * The picture takes the PTS and DTS of the PES its picture header starts
+ * in, if no picture before it there has, and the captions of the user data
+ * among its headers.
+ */
+void TiVoDecoderPS::scanVideo(uint8_t code, hoff_t out, const uint8_t *pPes,
+                              int header_len, const uint8_t *pData,
+                              size_t len)
+{
+    int64_t pts, dts;
+
+    pes_timestamps(pPes, header_len, &pts, &dts);
+    videoPts     = pts;
+    videoDts     = dts;
+    videoPtsUsed = false;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        videoMarker = (videoMarker << 8) | pData[i];
+
+        if (videoNeed && (0 == --videoNeed))
+            picture.pictureType = (pData[i] >> 3) & 0x7;
+
+        if (true == videoUserData)
+        {
+            if (videoUserLen < sizeof(videoUser))
+                videoUser[videoUserLen] = pData[i];
+            videoUserLen++;
+        }
+
+        if ((videoMarker & 0xFFFFFF00) != 0x00000100)
+            continue;
+
+        uint8_t start = videoMarker & 0xFF;
+
+        // user data runs up to the start code after it (the class is
+        // packed, so the picture is added to through an aligned copy)
+        if (true == videoUserData)
+        {
+            mpeg_picture_info info = picture;
+
+            mpeg_cc_data(videoUser, std::min(videoUserLen - 4,
+                                             sizeof(videoUser)), &info);
+            picture       = info;
+            videoUserData = false;
+        }
+
+        if ((start >= 0x01) && (start <= 0xAF))
+        {
+            if (true == videoHeaders)
+                videoPicture();
+            videoHeaders = false;
+            continue;
+        }
+
+        if (((start == 0x00) || (start == 0xB3) || (start == 0xB8)) &&
+            (false == videoHeaders))
+        {
+            // the next picture starts
+            std::memset(&picture, 0, sizeof(picture));
+            picture.pts  = -1;
+            picture.dts  = -1;
+            pictureCode  = code;
+            pictureOut   = out;
+            picturePack  = packOut;
+            videoHeaders = true;
+        }
+
+        if (false == videoHeaders)
+            continue;
+
+        if (start == 0xB8)
+        {
+            picture.gop = true;
+        }
+        else if (start == 0xB2)
+        {
+            videoUserData = true;
+            videoUserLen  = 0;
+        }
+        else if (start == 0x00)
+        {
+            videoNeed = 2;
+
+            if (false == videoPtsUsed)
+            {
+                picture.pts  = videoPts;
+                picture.dts  = videoDts;
+                videoPtsUsed = true;
+            }
+        }
+    }
+}
+
+// The headers of a picture are done with, at its first slice.
+void TiVoDecoderPS::videoPicture()
+{
+    if (pFrames)
+        pFrames->mark(pictureOut, pictureCode, picture);
+
+    if (pCaptions)
+        pCaptions->add(picture);
+
+    // a segment starts at the pack holding the picture's first header
+    if (pSegments)
+        pSegments->picture(picturePack, picture);
+}
+
+/*
+ * --iframes: blank out what a decrypted video payload holds of pictures
+ * other than I pictures, and return whether anything is left.  A picture
+ * runs over as many packets as it takes, from the sequence, GOP or picture
+ * header which follows the last slice of the one before; it is kept until
+ * its picture header says otherwise.  Zero bytes are stuffing ahead of the
+ * next start code, so a packet with both keeps its length.
+ *
+ * Start codes and picture headers may be split between packets.  If the
+ * packet ends before the type of its last picture is known, or in the
+ * first three bytes of a start code, *pRun is where that picture starts,
+ * and the packet is to be held back until a later one settles it.
+ */
+bool TiVoDecoderPS::filterIFrame(uint8_t *pData, size_t len, size_t *pRun)
+{
+    bool   kept  = false;
+    size_t start = 0;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        iframeMarker = (iframeMarker << 8) | pData[i];
+
+        if (iframeNeed && (0 == --iframeNeed))
+        {
+            iframeKeep  = (1 == ((pData[i] >> 3) & 0x7));
+            iframeKnown = true;
+            settleIFrame();
+        }
+
+        if ((iframeMarker & 0xFFFFFF00) != 0x00000100)
+        {
+            // the bytes held back were not a start code after all
+            if ((true == iframeHoldSplit) && (iframeMarker & 0xFF) &&
+                ((iframeMarker & 0xFFFFFF) != 0x000001))
+            {
+                iframeHoldSplit = false;
+                settleIFrame();
+            }
+            continue;
+        }
+
+        uint8_t code = iframeMarker & 0xFF;
+        size_t  at   = (i >= 3) ? i - 3 : 0;
+        bool    next = ((code == 0x00) || (code == 0xB3) ||
+                        (code == 0xB7) || (code == 0xB8)) &&
+                       (false == iframeHeaders);
+
+        // the start code held back goes with the picture before unless
+        // it starts the next
+        if (true == iframeHoldSplit)
+        {
+            iframeHoldSplit = false;
+            if (false == next)
+                settleIFrame();
+        }
+
+        if ((code >= 0x01) && (code <= 0xAF))
+        {
+            // slices with no picture header ahead are kept
+            if ((false == iframeKnown) && (true == iframeHeaders))
+            {
+                iframeKnown = true;
+                settleIFrame();
+            }
+            iframeHeaders = false;
+        }
+        else if (true == next)
+        {
+            // the next picture starts: the run before it is done
+            if (false == iframeKeep)
+                std::memset(pData + start, 0, at - start);
+            else if (at > start)
+                kept = true;
+
+            start         = at;
+            iframeKeep    = true;
+            iframeHeaders = true;
+            iframeKnown   = false;
+        }
+
+        if (code == 0x00)
+            iframeNeed = 2;
+    }
+
+    if (false == iframeKeep)
+        std::memset(pData + start, 0, len - start);
+    else if (len > start)
+        kept = true;
+
+    *pRun = len;
+
+    if (false == iframeKnown)
+    {
+        *pRun = start;
+    }
+    else if ((len >= 3) && ((iframeMarker & 0xFFFFFF) == 0x000001))
+    {
+        // as it was, until the picture it goes with is known
+        pData[len - 1]  = 0x01;
+        *pRun           = len - 3;
+        iframeHoldSplit = true;
+    }
+    else if (len && (false == iframeKeep) && !(iframeMarker & 0xFF))
+    {
+        // zeros which a picture kept after may need for its start code
+        *pRun           = ((len >= 2) && !(iframeMarker & 0xFFFF)) ?
+                          len - 2 : len - 1;
+        iframeHoldSplit = true;
+    }
+
+    return kept;
+}
+
+// The picture the packets held back end in is known: blank it if need be.
+// Pictures after it in the packet which settles it are nothing to them.
+void TiVoDecoderPS::settleIFrame()
+{
+    if (!iframeHeld || (true == iframeHoldDone))
+        return;
+
+    if (false == iframeKeep)
+    {
+        for (int k = 0; k < iframeHeld; k++)
+        {
+            uint8_t *pPacket = pIFrameHold + k * PS_PACKET_BUFFER;
+            size_t   from    = k ? iframeHoldPayload[k] : iframeHoldRun;
+
+            std::memset(pPacket + from, 0, iframeHoldLen[k] - from);
+        }
+    }
+
+    iframeHoldDone = true;
+    iframeHoldKept = iframeKeep;
+}
+
+/*
+ * Hold back a video packet of len bytes from its stream id, whose payload
+ * starts at payload and, if it is the first held, the picture of unknown
+ * type at run in that.
+ */
+void TiVoDecoderPS::holdIFrame(const uint8_t *pPacket, size_t len,
+                               size_t payload, size_t run, int header_len)
+{
+    if (!pIFrameHold)
+        pIFrameHold = new uint8_t[PS_IFRAME_HOLD * PS_PACKET_BUFFER];
+
+    if (!iframeHeld)
+        iframeHoldRun = payload + run;
+
+    std::memcpy(pIFrameHold + iframeHeld * PS_PACKET_BUFFER, pPacket, len);
+    iframeHoldLen[iframeHeld]     = len;
+    iframeHoldPayload[iframeHeld] = payload;
+    iframeHoldHeader[iframeHeld]  = header_len;
+    iframeHeld++;
+}
+
+/*
+ * Write the video packets held back, blanking the picture they end in if
+ * done, as it will never be known.  If next, the three bytes of the start
+ * code after them have been written, and are again after them; otherwise
+ * each goes ahead of a packet.  A packet of a picture not kept with
+ * nothing left is left out.
+ */
+void TiVoDecoderPS::releaseIFrame(bool done, bool next)
+{
+    static uint8_t prefix[3] = { 0x00, 0x00, 0x01 };
+    bool open = next;
+
+    if (true == done)
+    {
+        iframeKeep = false;
+        settleIFrame();
+    }
+
+    for (int k = 0; k < iframeHeld; k++)
+    {
+        uint8_t *pPacket = pIFrameHold + k * PS_PACKET_BUFFER;
+        size_t   len     = iframeHoldLen[k];
+        size_t   payload = iframeHoldPayload[k];
+        size_t   i;
+
+        for (i = payload; (i < len) && !pPacket[i]; i++)
+            ;
+        if ((i == len) && (false == iframeHoldKept))
+            continue;
+
+        if ((false == open) && (pFileOut->write(prefix, 3) != 3))
+            PERROR_LIMITED("writing buffer");
+        open = false;
+
+        if ((pFrames || pCaptions || pSegments) && iframeHoldHeader[k])
+            scanVideo(pPacket[0], pFileOut->written() - 3, pPacket + 1,
+                      iframeHoldHeader[k], pPacket + payload, len - payload);
+
+        if (pFileOut->write(pPacket, len) != len)
+            PERROR_LIMITED("writing buffer");
+    }
+
+    if ((true == next) && (false == open) &&
+        (pFileOut->write(prefix, 3) != 3))
+        PERROR_LIMITED("writing buffer");
+
+    iframeHeld     = 0;
+    iframeHoldDone = false;
+}
+
+/*
+ * Whether --pids and --streams keep the PES packets of stream id code;
+ * the pack and system headers and the stream map always are.
+ */
+bool TiVoDecoderPS::keepStream(uint8_t code)
+{
+    if (!pSelect || (code < 0xbd) || pSelect->codes.count(code))
+        return true;
+
+    if ((code >= 0xe0) && (code <= 0xef))
+        return (pSelect->kinds & SELECT_VIDEO) ? true : false;
+
+    if ((code == 0xbd) || ((code >= 0xc0) && (code <= 0xdf)))
+        return (pSelect->kinds & SELECT_AUDIO) ? true : false;
+
+    return (pSelect->kinds & SELECT_DATA) ? true : false;
+}
+
 int TiVoDecoderPS::process_frame(uint8_t code, hoff_t packet_start)
 {
-    static union {
-        uint64_t align;
-        uint8_t packet_buffer[65536 + sizeof(uint64_t) + 2];
-    } aligned_buf;
-    
+    uint8_t *packet_buffer = (uint8_t *)pAlignedBuf;
+
     uint8_t bytes[32];
     int looked_ahead = 0;
     int i;
@@ -125,6 +653,13 @@ int TiVoDecoderPS::process_frame(uint8_t code, hoff_t packet_start)
     int header_len = 0;
     int length;
 
+    // a stream left out is never keyed
+    bool keep = keepStream(code);
+
+    // --iframes: the video packet held back goes ahead of the end code
+    if ((code == 0xB9) && iframeHeld && (false == dryRun))
+        releaseIFrame(true, true);
+
     std::memset(bytes, 0, 32);
 
     for (i = 0; packet_tags[i].packet != PACK_NONE; i++)
@@ -137,6 +672,10 @@ int TiVoDecoderPS::process_frame(uint8_t code, hoff_t packet_start)
             {
                 if (packet_tags[i].packet == PACK_PES_COMPLEX)
                 {
+                    PROFILE(PROF_PES);
+
+                    TD_PROBE(pes, code, pFileIn->tell());
+
                     LOOK_AHEAD(pFileIn, bytes, 5);
 
                     // packet_length is 0 and 1
@@ -203,12 +742,21 @@ int TiVoDecoderPS::process_frame(uint8_t code, hoff_t packet_start)
                                     VERBOSE("%zu : stream_no: %x, block_no: %d\n", (size_t)packet_start, code, block_no);
                                     VVERBOSE("---Turing : prepare : code 0x%02x block_no %d\n", code, block_no );
 
-                                    pTuring->prepare_frame(code, block_no);
+                                    if (pStats && !dryRun)
+                                        pStats->block(code, block_no);
+
+                                    if (pVerify && !dryRun)
+                                        pVerify->block(code, block_no);
 
-                                    VVERBOSE("CCC : code 0x%02x, blockno %d, crypted 0x%08x\n", code, block_no, crypted );
-                                    VVERBOSE("---Turing : decrypt : crypted 0x%08x len %d\n", crypted, 4 );
+                                    if (true == keep)
+                                    {
+                                        pTuring->prepare_frame(code, block_no);
 
-                                    pTuring->decrypt_buffer((uint8_t *)&crypted, 4);
+                                        VVERBOSE("CCC : code 0x%02x, blockno %d, crypted 0x%08x\n", code, block_no, crypted );
+                                        VVERBOSE("---Turing : decrypt : crypted 0x%08x len %d\n", crypted, 4 );
+
+                                        pTuring->decrypt_buffer((uint8_t *)&crypted, 4);
+                                    }
 
                                     VVERBOSE("DDD : code 0x%02x, blockno %d, crypted 0x%08x\n", code, block_no, crypted );
 
@@ -239,17 +787,17 @@ int TiVoDecoderPS::process_frame(uint8_t code, hoff_t packet_start)
 
                 length = bytes[1] | (bytes[0] << 8);
 
-                std::memcpy(aligned_buf.packet_buffer + sizeof(uint64_t),
+                std::memcpy(packet_buffer + sizeof(uint64_t),
                             bytes, looked_ahead);
 
-                LOOK_AHEAD (pFileIn, aligned_buf.packet_buffer +
+                LOOK_AHEAD (pFileIn, packet_buffer +
                             sizeof(uint64_t), length + 2);
                 {
-                    uint8_t *packet_ptr = aligned_buf.packet_buffer +
+                    uint8_t *packet_ptr = packet_buffer +
                         sizeof(uint64_t);
                     size_t packet_size;
 
-                    aligned_buf.packet_buffer[sizeof(uint64_t) - 1] = code;
+                    packet_buffer[sizeof(uint64_t) - 1] = code;
 
                     if (header_len)
                     {
@@ -262,40 +810,60 @@ int TiVoDecoderPS::process_frame(uint8_t code, hoff_t packet_start)
                         packet_size = length;
                     }
 
-                    if (scramble == 3)
+                    TD_PROBE(packet, code, pFileIn->tell());
+
+                    if (pStats && !dryRun)
+                    {
+                        pStats->packet(code, packet_size, scramble == 3);
+                        pStats->tick();
+                    }
+
+                    // --iframes leaves out audio, and video but for I
+                    // pictures
+                    bool iframe = keep && iframesOnly &&
+                                  (false == dryRun) && (code == 0xe0);
+                    bool drop   = !keep ||
+                                  (iframesOnly && (false == dryRun) &&
+                                   ((code == 0xbd) ||
+                                    ((code >= 0xc0) && (code <= 0xdf))));
+
+                    if ((scramble == 3) && (true == keep))
                     {
                         VVERBOSE("---Turing : decrypt : size %d\n", (int)packet_size );
 
-                        pTuring->decrypt_buffer(packet_ptr, packet_size);
+                        if (true == drop)
+                            pTuring->pass_buffer(packet_size);
+                        else
+                            pTuring->decrypt_buffer(packet_ptr, packet_size);
 
                         // turn off scramble bits
-                        aligned_buf.packet_buffer[sizeof(uint64_t) + 2] &= ~0x30;
+                        packet_buffer[sizeof(uint64_t) + 2] &= ~0x30;
 
-                        // scan video buffer for Slices.  If no slices are
-                        // found, the MAK is wrong.
-                        if (!o_no_verify && code == 0xe0) {
-                            int slice_count=0;
+                        // scan video buffer for Slices.  If none are
+                        // found in the first few packets, the MAK is wrong.
+                        if (!noVerify && !dryRun && code == 0xe0) {
                             size_t offset;
 
                             for (offset = sizeof(uint64_t); offset + 4 < packet_size; offset++)
                             {
-                                if (aligned_buf.packet_buffer[offset] == 0x00 &&
-                                    aligned_buf.packet_buffer[offset+1] == 0x00 &&
-                                    aligned_buf.packet_buffer[offset+2] == 0x01 &&
-                                    aligned_buf.packet_buffer[offset+3] >= 0x01 &&
-                                    aligned_buf.packet_buffer[offset+3] <= 0xAF)
+                                if (packet_buffer[offset] == 0x00 &&
+                                    packet_buffer[offset+1] == 0x00 &&
+                                    packet_buffer[offset+2] == 0x01 &&
+                                    packet_buffer[offset+3] >= 0x01 &&
+                                    packet_buffer[offset+3] <= 0xAF)
                                 {
-                                    slice_count++;
+                                    verifySlices++;
                                 }
                                 // choose 8 as a good test that if 8 slices
                                 // are seen, it's probably not random noise
-                                if (slice_count > 8)
+                                if (verifySlices > 8)
                                 {
                                     // disable future verification
-                                    o_no_verify = 1;
+                                    noVerify = true;
                                 }
                             }
-                            if (!o_no_verify)
+                            if (!noVerify &&
+                                (++verifyPackets >= PS_VERIFY_PACKETS))
                             {
                                 VERBOSE("Invalid MAK -- aborting\n");
                                 return -2;
@@ -307,14 +875,61 @@ int TiVoDecoderPS::process_frame(uint8_t code, hoff_t packet_start)
                         // don't know why, but tivo dll does this.
                         // I can find no good docs on the format of the program_stream_map
                         // but I think this clears a reserved bit.  No idea why
-                        aligned_buf.packet_buffer[sizeof(uint64_t) + 2] &= ~0x20;
+                        packet_buffer[sizeof(uint64_t) + 2] &= ~0x20;
+                    }
+
+                    if (true == iframe)
+                    {
+                        size_t run;
+
+                        drop = !filterIFrame(packet_ptr, packet_size, &run);
+
+                        // the packets held go ahead of this one once what
+                        // they end in is known, or if there is no more
+                        // room, and this one waits if it ends undecided
+                        if (iframeHeld &&
+                            ((true == iframeHoldDone) ||
+                             ((run < packet_size) &&
+                              (PS_IFRAME_HOLD == iframeHeld))))
+                            releaseIFrame(false, true);
+
+                        if (run < packet_size)
+                        {
+                            uint8_t *pPacket = packet_buffer +
+                                sizeof(uint64_t) - 1;
+
+                            holdIFrame(pPacket, length + 3,
+                                       packet_ptr - pPacket, run, header_len);
+                            drop = true;
+                        }
                     }
 
-                    if (pFileOut->write(aligned_buf.packet_buffer +
+                    // the PES starts with the three bytes already written
+                    if ((pFrames || pCaptions || pSegments) &&
+                        (false == dryRun) && (false == drop) &&
+                        (code == 0xe0) && header_len)
+                    {
+                        // the pictures may be anywhere in the payload
+                        scanVideo(code, pFileOut->written() - 3,
+                                  packet_buffer + sizeof(uint64_t),
+                                  header_len, packet_ptr, packet_size);
+                    }
+
+                    if ((false == dryRun) && (true == drop))
+                    {
+                        // what follows the start code is an empty
+                        // padding packet instead
+                        static uint8_t padding[3] = { 0xbe, 0x00, 0x00 };
+
+                        if (pFileOut->write(padding, 3) != 3)
+                            PERROR_LIMITED("writing buffer");
+                    }
+                    else if ((false == dryRun) &&
+                        (pFileOut->write(packet_buffer +
                                     sizeof(uint64_t) - 1, length + 3) !=
-                        (size_t)(length + 3))
+                        (size_t)(length + 3)))
                     {
-                        std::perror("writing buffer");
+                        PERROR_LIMITED("writing buffer");
                     }
 
                     return 1;
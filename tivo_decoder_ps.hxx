@@ -8,11 +8,23 @@
 #include <cstdio>
 
 #include "tivo_decoder_base.hxx"
+#include "tivo_decoder_mpeg_parser.hxx"
 
 //============================
 // PS Specific data structures
 //============================
 
+// a PES of up to 64k, after 8 bytes which end with its start code
+#define PS_PACKET_BUFFER    (65536 + sizeof(uint64_t) + 2)
+
+// --iframes: video packets held back at most while the type of the picture
+// they end in is not known; more are let go as if it were an I picture
+#define PS_IFRAME_HOLD      4
+
+// video packets searched for slices before the MAK is taken to be wrong;
+// one packet from mid-frame, as a shard starts with, may have none
+#define PS_VERIFY_PACKETS   32
+
 typedef enum
 {
     PACK_NONE,
@@ -39,10 +51,81 @@ class TiVoDecoderPS : public TiVoDecoder
 {
     private:
         uint32_t marker;
+
+        // the byte last read, and whether there is one
+        uint8_t  byte;
+        bool     first;
+
+        // MAK check: slices seen so far, in how many video packets
+        int      verifySlices;
+        int      verifyPackets;
+
+        // --iframes: the start code scan of the video, which carries on
+        // across packets, the picture header bytes still to come, whether
+        // the picture it has got to is kept, whether its headers, not yet
+        // its slices, are being read, and whether its type is known
+        uint32_t iframeMarker;
+        int      iframeNeed;
+        bool     iframeKeep;
+        bool     iframeHeaders;
+        bool     iframeKnown;
+
+        // video packets ending in a picture whose type is not yet known,
+        // or in what may be the first bytes of a start code, are held back
+        // from their stream ids on, PS_PACKET_BUFFER apart, until one after
+        // says; where the picture starts in the first, whether that is the
+        // split start code, whether it is now known, and whether kept
+        uint8_t *pIFrameHold;
+        int      iframeHeld;
+        size_t   iframeHoldRun;
+        bool     iframeHoldSplit;
+        bool     iframeHoldDone;
+        bool     iframeHoldKept;
+        size_t   iframeHoldLen[PS_IFRAME_HOLD];
+        size_t   iframeHoldPayload[PS_IFRAME_HOLD];
+        int      iframeHoldHeader[PS_IFRAME_HOLD];
+
+        // --segment-duration: the output offset of the last pack start
+        hoff_t   packOut;
+
+        // --keyframes, --captions and --segment-duration: the start code
+        // scan of the video, which carries on across packets, the PTS and
+        // DTS of the packet it is in and whether a picture has taken them,
+        // the picture whose headers it is in, with the output offsets of
+        // the packet and pack they start in, and the start of any user
+        // data block it is in, up to the most captions there can be
+        uint32_t videoMarker;
+        int      videoNeed;         // picture header bytes still to come
+        bool     videoHeaders;
+        bool     videoPtsUsed;
+        int64_t  videoPts;
+        int64_t  videoDts;
+        uint8_t  pictureCode;
+        hoff_t   pictureOut;
+        hoff_t   picturePack;
+        mpeg_picture_info picture;
+        bool     videoUserData;
+        size_t   videoUserLen;
+        uint8_t  videoUser[7 + MPEG_CC_MAX * 3];
+
+        // the PES being decoded, 8 byte aligned for the cipher
+        uint64_t *pAlignedBuf;
         
     public:
+        virtual hoff_t findSync(hoff_t offset);
+        virtual bool isSynced();
+        virtual int64_t findPts(hoff_t offset, hoff_t *pAt);
         virtual bool process();
         int process_frame(uint8_t code, hoff_t packet_start);
+        bool filterIFrame(uint8_t *pData, size_t len, size_t *pRun);
+        void settleIFrame();
+        void holdIFrame(const uint8_t *pPacket, size_t len, size_t payload,
+                        size_t run, int header_len);
+        void releaseIFrame(bool done, bool next);
+        void scanVideo(uint8_t code, hoff_t out, const uint8_t *pPes,
+                       int header_len, const uint8_t *pData, size_t len);
+        void videoPicture();
+        bool keepStream(uint8_t code);
     
         TiVoDecoderPS(TuringState *pTuringState, HappyFile *pInfile,
                       HappyFile *pOutfile);
@@ -0,0 +1,284 @@
+/*
+ * tivodecode-ng
+ * Copyright 2006-2015, Jeremy Drake et al.
+ * See COPYING file for license terms
+ */
+#ifdef HAVE_CONFIG_H
+#include "tdconfig.h"
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "tivo_parse.hxx"
+#include "tivo_decoder_segments.hxx"
+
+#define PTS_MASK            ((1LL << 33) - 1)
+
+TiVoDecoderSegments::TiVoDecoderSegments(const char *namePrefix,
+                                         const char *nameExtension,
+                                         int formatType, double seconds)
+{
+    prefix    = namePrefix;
+    extension = nameExtension;
+    playlist  = prefix + ".m3u8";
+    duration  = seconds;
+    format    = formatType;
+    failed    = false;
+    pFile     = NULL;
+    heldAt    = 0;
+    scanned   = 0;
+    pmtPid    = 0;
+    havePat   = false;
+    havePmt   = false;
+    startPts  = -1;
+    reached   = 0;
+}
+
+TiVoDecoderSegments::~TiVoDecoderSegments()
+{
+    if (pFile)
+        std::fclose(pFile);
+}
+
+void TiVoDecoderSegments::sink(void *pContext, const void *ptr, size_t size)
+{
+    ((TiVoDecoderSegments *)pContext)->feed((const uint8_t *)ptr, size);
+}
+
+// The PMT PID of the first program in a PAT packet, 0 for none.
+static uint16_t pat_pmt_pid(const uint8_t *pPkt)
+{
+    int offset = 4;
+
+    if (pPkt[3] & 0x20)
+        offset += 1 + pPkt[4];
+    if (offset >= SEGMENT_TS_PACKET)
+        return 0;
+
+    // pointer_field
+    offset += 1 + pPkt[offset];
+    if (offset + 8 > SEGMENT_TS_PACKET)
+        return 0;
+
+    const uint8_t *pSection = pPkt + offset;
+    int end = std::min(3 + (((pSection[1] & 0x0f) << 8) | pSection[2]) - 4,
+                       SEGMENT_TS_PACKET - offset);
+
+    for (int i = 8; i + 4 <= end; i += 4)
+    {
+        // program 0 gives the network PID
+        if (pSection[i] || pSection[i + 1])
+            return ((pSection[i + 2] & 0x1f) << 8) | pSection[i + 3];
+    }
+
+    return 0;
+}
+
+// TS: keep the latest PAT and PMT for the start of the next segment.
+void TiVoDecoderSegments::scan()
+{
+    while (scanned + SEGMENT_TS_PACKET <= heldAt + (hoff_t)held.size())
+    {
+        const uint8_t *pPkt = &held[scanned - heldAt];
+        scanned += SEGMENT_TS_PACKET;
+
+        if ((pPkt[0] != 0x47) || !(pPkt[1] & 0x40))
+            continue;
+
+        uint16_t pid = ((pPkt[1] & 0x1f) << 8) | pPkt[2];
+
+        if (0 == pid)
+        {
+            std::memcpy(pat, pPkt, SEGMENT_TS_PACKET);
+            havePat = true;
+
+            uint16_t pmt_pid = pat_pmt_pid(pPkt);
+            if (pmt_pid)
+                pmtPid = pmt_pid;
+        }
+        else if (pmtPid && (pid == pmtPid))
+        {
+            std::memcpy(pmt, pPkt, SEGMENT_TS_PACKET);
+            havePmt = true;
+        }
+    }
+}
+
+bool TiVoDecoderSegments::openSegment()
+{
+    char suffix[16];
+
+    std::snprintf(suffix, sizeof(suffix), "-%05u", (unsigned)segments.size());
+
+    TiVoSegment segment;
+    segment.name    = prefix + suffix + extension;
+    segment.seconds = 0;
+
+    pFile = std::fopen(segment.name.c_str(), "wb");
+    if (!pFile)
+    {
+        std::perror(segment.name.c_str());
+        failed = true;
+        return false;
+    }
+
+    // a segment after the first gets the tables to play on its own
+    if (!segments.empty() && havePat && havePmt &&
+        ((std::fwrite(pat, 1, SEGMENT_TS_PACKET, pFile) != SEGMENT_TS_PACKET) ||
+         (std::fwrite(pmt, 1, SEGMENT_TS_PACKET, pFile) != SEGMENT_TS_PACKET)))
+    {
+        std::perror(segment.name.c_str());
+        failed = true;
+    }
+
+    segments.push_back(segment);
+    return true;
+}
+
+void TiVoDecoderSegments::put(const uint8_t *pData, size_t len)
+{
+    if (failed || !len || (!pFile && !openSegment()))
+        return;
+
+    if (std::fwrite(pData, 1, len, pFile) != len)
+    {
+        std::perror(segments.back().name.c_str());
+        failed = true;
+    }
+}
+
+// Write the held output before offset upTo to the segment file.
+void TiVoDecoderSegments::writeHeld(hoff_t upTo)
+{
+    size_t n = (size_t)std::min(std::max(upTo - heldAt, (hoff_t)0),
+                                (hoff_t)held.size());
+
+    if (!n)
+        return;
+
+    put(&held[0], n);
+    held.erase(held.begin(), held.begin() + n);
+    heldAt += n;
+}
+
+void TiVoDecoderSegments::closeSegment(double seconds)
+{
+    if (!pFile && !openSegment())
+        return;
+
+    if (0 != std::fclose(pFile))
+    {
+        std::perror(segments.back().name.c_str());
+        failed = true;
+    }
+
+    pFile = NULL;
+    segments.back().seconds = seconds;
+    writePlaylist(false);
+}
+
+/*
+ * The playlist of the segments finished so far, replaced whole so that a
+ * player never reads half of it.
+ */
+void TiVoDecoderSegments::writePlaylist(bool done)
+{
+    std::string temp = playlist + ".tmp";
+    double longest = duration;
+
+    FILE *f = std::fopen(temp.c_str(), "w");
+    if (!f)
+    {
+        std::perror(temp.c_str());
+        failed = true;
+        return;
+    }
+
+    for (size_t i = 0; i < segments.size(); i++)
+        longest = std::max(longest, segments[i].seconds);
+
+    std::fprintf(f, "#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-TARGETDURATION:%d\n"
+                 "#EXT-X-MEDIA-SEQUENCE:0\n", (int)std::ceil(longest));
+
+    for (size_t i = 0; i < segments.size(); i++)
+    {
+        // beside the playlist
+        const std::string &name = segments[i].name;
+        size_t slash = name.rfind('/');
+
+        std::fprintf(f, "#EXTINF:%.3f,\n%s\n", segments[i].seconds,
+                     name.c_str() + ((slash == std::string::npos) ? 0 :
+                                                                    slash + 1));
+    }
+
+    if (done)
+        std::fputs("#EXT-X-ENDLIST\n", f);
+
+    if ((0 != std::fclose(f)) ||
+        (std::rename(temp.c_str(), playlist.c_str()) < 0))
+    {
+        std::perror(playlist.c_str());
+        failed = true;
+    }
+}
+
+void TiVoDecoderSegments::feed(const uint8_t *pData, size_t len)
+{
+    held.insert(held.end(), pData, pData + len);
+
+    if (format == TIVO_FORMAT_TS)
+        scan();
+
+    if (held.size() >= 2 * SEGMENT_HOLD)
+        writeHeld(heldAt + held.size() - SEGMENT_HOLD);
+}
+
+/*
+ * A video picture whose PES (or pack) starts at output offset out: the
+ * next segment starts there if it is an I picture or GOP at least the
+ * duration past the start of this one.
+ */
+void TiVoDecoderSegments::picture(hoff_t out, const mpeg_picture_info &info)
+{
+    if (failed || (info.pts < 0))
+        return;
+
+    if (startPts < 0)
+    {
+        startPts = info.pts;
+        return;
+    }
+
+    // across a wrap; a picture shown before the start is passed over
+    int64_t at = (info.pts - startPts) & PTS_MASK;
+    if (at > (PTS_MASK >> 1))
+        return;
+
+    reached = std::max(reached, at);
+
+    if (((1 != info.pictureType) && (false == info.gop)) ||
+        (at < (int64_t)(duration * 90000)))
+        return;
+
+    writeHeld(out);
+    closeSegment(at / 90000.0);
+
+    startPts = info.pts;
+    reached  = 0;
+}
+
+// Write out the last segment and finish the playlist, false on any error.
+bool TiVoDecoderSegments::close()
+{
+    writeHeld(heldAt + held.size());
+
+    if (pFile)
+        closeSegment(reached / 90000.0);
+
+    writePlaylist(true);
+    return !failed;
+}
+
+/* vi:set ai ts=4 sw=4 expandtab: */
@@ -0,0 +1,94 @@
+/*
+ * tivodecode-ng
+ * Copyright 2006-2015, Jeremy Drake et al.
+ * See COPYING file for license terms
+ */
+
+#ifndef TIVO_DECODER_SEGMENTS_HXX_
+#define TIVO_DECODER_SEGMENTS_HXX_
+
+#ifdef HAVE_CONFIG_H
+#include "tdconfig.h"
+#endif
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "happyfile.hxx"
+#include "tivo_decoder_mpeg_parser.hxx"
+
+// output held back from the segment files, so that a cut can land on a
+// PS pack start already written
+#define SEGMENT_HOLD        (256 * 1024)
+
+#define SEGMENT_TS_PACKET   188
+
+// a finished segment, as the playlist lists it
+typedef struct
+{
+    std::string name;
+    double      seconds;
+} TiVoSegment;
+
+/*
+ * --segment-duration: the output cut into files of about the given length
+ * as it is written, through a HappyFile sink, at the video PES (TS) or the
+ * pack (PS) of the first I picture or GOP past it, with an HLS playlist
+ * rewritten as each is finished.  A TS segment begins with the last PAT
+ * and PMT.
+ */
+class TiVoDecoderSegments
+{
+    private:
+        std::string                 prefix;
+        std::string                 extension;
+        std::string                 playlist;
+        double                      duration;
+        int                         format;
+        bool                        failed;
+
+        FILE                       *pFile;
+        std::vector<TiVoSegment>    segments;
+
+        // output from heldAt not yet in a segment file
+        std::vector<uint8_t>        held;
+        hoff_t                      heldAt;
+
+        // TS: how far the output was looked at, and its PAT and PMT
+        hoff_t                      scanned;
+        uint16_t                    pmtPid;
+        uint8_t                     pat[SEGMENT_TS_PACKET];
+        uint8_t                     pmt[SEGMENT_TS_PACKET];
+        bool                        havePat;
+        bool                        havePmt;
+
+        // 90kHz: the current segment's first PTS, and how far it has got
+        int64_t                     startPts;
+        int64_t                     reached;
+
+        void scan();
+        void put(const uint8_t *pData, size_t len);
+        void writeHeld(hoff_t upTo);
+        bool openSegment();
+        void closeSegment(double seconds);
+        void writePlaylist(bool done);
+
+    public:
+        void feed(const uint8_t *pData, size_t len);
+        void picture(hoff_t out, const mpeg_picture_info &info);
+        bool close();
+
+        inline size_t count() { return segments.size(); }
+        inline const std::string &playlistName() { return playlist; }
+
+        static void sink(void *pContext, const void *ptr, size_t size);
+
+        TiVoDecoderSegments(const char *namePrefix, const char *nameExtension,
+                            int formatType, double seconds);
+        ~TiVoDecoderSegments();
+};
+
+#endif /* TIVO_DECODER_SEGMENTS_HXX_ */
+
+/* vi:set ai ts=4 sw=4 expandtab: */
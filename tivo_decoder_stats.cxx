@@ -0,0 +1,203 @@
+/*
+ * tivodecode-ng
+ * Copyright 2006-2015, Jeremy Drake et al.
+ * See COPYING file for license terms
+ */
+#ifdef HAVE_CONFIG_H
+#include "tdconfig.h"
+#endif
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include <sys/resource.h>
+
+#include "tivo_decoder_stats.hxx"
+
+#define MB  (1024.0 * 1024.0)
+
+TiVoDecoderStats::TiVoDecoderStats(double seconds, int fd)
+{
+    pOut    = stderr;
+    machine = false;
+
+    if (fd >= 0)
+    {
+        if ((pOut = fdopen(fd, "w")))
+        {
+            std::setvbuf(pOut, NULL, _IOLBF, 0);
+            machine = true;
+        }
+        else
+        {
+            std::perror("opening stats descriptor");
+            pOut = stderr;
+        }
+    }
+
+    interval = (seconds > 0) ? seconds : 1.0;
+    start    = now();
+    last     = start;
+    next     = start + interval;
+
+    pFileIn     = NULL;
+    pFileOut    = NULL;
+    inStart     = 0;
+    lastIn      = 0;
+    lastOut     = 0;
+    lastPackets = 0;
+    lastBlocks  = 0;
+    packets     = 0;
+    blocks      = 0;
+    keyChanges  = 0;
+
+    pStreams = new TiVoStreamStats[STATS_IDS];
+    std::memset(pStreams, 0, sizeof(TiVoStreamStats) * STATS_IDS);
+    for (int i = 0; i < STATS_IDS; i++)
+        pStreams[i].block = -1;
+}
+
+TiVoDecoderStats::~TiVoDecoderStats()
+{
+    delete [] pStreams;
+
+    if (pOut != stderr)
+        std::fclose(pOut);
+}
+
+double TiVoDecoderStats::now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void TiVoDecoderStats::block(uint16_t id, int block_no)
+{
+    if (pStreams[id].block != block_no)
+    {
+        pStreams[id].block = block_no;
+        blocks++;
+    }
+}
+
+void TiVoDecoderStats::key(uint16_t id, const uint8_t *pKey)
+{
+    if (std::memcmp(pStreams[id].key, pKey, 16))
+    {
+        std::memcpy(pStreams[id].key, pKey, 16);
+        keyChanges++;
+    }
+}
+
+void TiVoDecoderStats::tick()
+{
+    if (now() >= next)
+        report(false);
+}
+
+void TiVoDecoderStats::finish()
+{
+    report(true);
+}
+
+/*
+ * Rates cover the time since the previous report, or the whole run for
+ * the final one.
+ */
+void TiVoDecoderStats::report(bool final)
+{
+    double t       = now();
+    hoff_t in      = pFileIn ? pFileIn->tell() - inStart : 0;
+    hoff_t out     = pFileOut ? pFileOut->written() : 0;
+    double elapsed = final ? t - start : t - last;
+    double mbIn    = 0;
+    double mbOut   = 0;
+    double pktRate = 0;
+    double blkRate = 0;
+
+    struct rusage usage;
+    std::memset(&usage, 0, sizeof(usage));
+    getrusage(RUSAGE_SELF, &usage);
+
+    if (elapsed > 0)
+    {
+        mbIn    = (final ? in : in - lastIn) / MB / elapsed;
+        mbOut   = (final ? out : out - lastOut) / MB / elapsed;
+        pktRate = (final ? packets : packets - lastPackets) / elapsed;
+        blkRate = (final ? blocks : blocks - lastBlocks) / elapsed;
+    }
+
+    if (true == machine)
+    {
+        std::fprintf(pOut, "{\"time\": %.3f, \"final\": %s, "
+                     "\"in_bytes\": %lld, \"out_bytes\": %lld, "
+                     "\"in_mbps\": %.3f, \"out_mbps\": %.3f, "
+                     "\"packets\": %llu, \"packets_per_s\": %.1f, "
+                     "\"blocks\": %llu, \"blocks_per_s\": %.2f, "
+                     "\"key_changes\": %llu, \"peak_rss_kb\": %ld, "
+                     "\"streams\": [",
+                     t - start, final ? "true" : "false",
+                     (long long)in, (long long)out, mbIn, mbOut,
+                     (unsigned long long)packets, pktRate,
+                     (unsigned long long)blocks, blkRate,
+                     (unsigned long long)keyChanges, usage.ru_maxrss);
+    }
+    else
+    {
+        std::fprintf(pOut, "stats %8.1fs : in %7.2f MB/s, out %7.2f MB/s, "
+                     "%9.0f pkt/s, %6.1f blocks/s, %llu key changes, "
+                     "peak RSS %ld KB%s\n",
+                     t - start, mbIn, mbOut, pktRate, blkRate,
+                     (unsigned long long)keyChanges, usage.ru_maxrss,
+                     final ? " (overall)" : "");
+    }
+
+    bool first = true;
+
+    for (int i = 0; i < STATS_IDS; i++)
+    {
+        TiVoStreamStats *pStream = &pStreams[i];
+        double scrambled;
+
+        if (0 == pStream->bytes)
+            continue;
+
+        scrambled = (double)pStream->scrambled / pStream->bytes;
+
+        if (true == machine)
+        {
+            std::fprintf(pOut, "%s{\"id\": %d, \"bytes\": %llu, "
+                         "\"scrambled\": %.4f, \"high_water\": %u}",
+                         first ? "" : ", ", i,
+                         (unsigned long long)pStream->bytes, scrambled,
+                         pStream->highWater);
+        }
+        else
+        {
+            std::fprintf(pOut, "stats   0x%04x : %12llu bytes, %5.1f%% "
+                         "scrambled, high water %u packets\n", i,
+                         (unsigned long long)pStream->bytes,
+                         scrambled * 100, pStream->highWater);
+        }
+
+        first = false;
+    }
+
+    if (true == machine)
+        std::fprintf(pOut, "]}\n");
+
+    lastIn      = in;
+    lastOut     = out;
+    lastPackets = packets;
+    lastBlocks  = blocks;
+    last        = t;
+
+    // skip intervals missed during a stall rather than catching up
+    while (next <= t)
+        next += interval;
+}
+
+/* vi:set ai ts=4 sw=4 expandtab: */
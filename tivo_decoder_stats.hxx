@@ -0,0 +1,85 @@
+#ifndef TIVO_DECODER_STATS_HXX_
+#define TIVO_DECODER_STATS_HXX_
+
+#ifdef HAVE_CONFIG_H
+#include "tdconfig.h"
+#endif
+
+#include <cstdio>
+
+#include "happyfile.hxx"
+
+// TS PIDs; PS stream ids fit as well
+#define STATS_IDS       0x2000
+
+typedef struct
+{
+    uint64_t bytes;         // payload bytes
+    uint64_t scrambled;     // of those, bytes which were scrambled
+    uint32_t highWater;     // most packets buffered at once
+    int      block;         // last cipher block, -1 for none yet
+    uint8_t  key[16];
+} TiVoStreamStats;
+
+/*
+ * Throughput and per-stream counters for --stats.  The decoders feed it
+ * from their loops and call tick(), which prints a report whenever the
+ * interval has passed: a readable one to stderr, or one JSON object per
+ * line to a file descriptor.
+ */
+class TiVoDecoderStats
+{
+    private:
+        FILE            *pOut;
+        bool             machine;
+        double           interval;
+
+        double           start;
+        double           last;
+        double           next;
+        hoff_t           lastIn;
+        hoff_t           lastOut;
+        uint64_t         lastPackets;
+        uint64_t         lastBlocks;
+
+        TiVoStreamStats *pStreams;
+
+        double           now();
+        void             report(bool final);
+
+    public:
+        HappyFile       *pFileIn;
+        HappyFile       *pFileOut;
+        hoff_t           inStart;
+
+        uint64_t         packets;
+        uint64_t         blocks;
+        uint64_t         keyChanges;
+
+        inline void packet(uint16_t id, size_t len, bool scrambled)
+        {
+            packets++;
+            pStreams[id].bytes += len;
+            if (scrambled)
+                pStreams[id].scrambled += len;
+        }
+
+        inline void buffered(uint16_t id, size_t count)
+        {
+            if (count > pStreams[id].highWater)
+                pStreams[id].highWater = (uint32_t)count;
+        }
+
+        void block(uint16_t id, int block_no);
+        void key(uint16_t id, const uint8_t *pKey);
+
+        void tick();
+        void finish();
+
+        TiVoDecoderStats(double seconds, int fd);
+        ~TiVoDecoderStats();
+};
+
+#endif /* TIVO_DECODER_STATS_HXX_ */
+
+/* vi:set ai ts=4 sw=4 expandtab: */
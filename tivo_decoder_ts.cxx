@@ -12,9 +12,13 @@
 
 #include "hexlib.hxx"
 #include "tivo_parse.hxx"
+#include "tivo_probes.hxx"
 #include "tivo_decoder_ts.hxx"
-
-TsPktDump pktDumpMap;
+#include "tivo_decoder_ts_batch.hxx"
+#include "tivo_decoder_ts_pipeline.hxx"
+#include "tivo_decoder_ts_section.hxx"
+#include "tivo_decoder_stats.hxx"
+#include "tivo_decoder_index.hxx"
 
 ts_packet_tag_info ts_packet_tags[] = {
     {0x0000, 0x0000, TS_PID_TYPE_PROGRAM_ASSOCIATION_TABLE},
@@ -84,8 +88,16 @@ TiVoDecoderTS::TiVoDecoderTS(
         pInfile,
         pOutfile)
 {
-    pktCounter = 0;
+    pktCounter   = 0;
+    pktDumpIndex = 0;
+    pktDumpNext  = 1;
+    pPipeline    = NULL;
+    pBatch       = new TiVoDecoderTsBatch;
+    pPatSection  = new TiVoDecoderTsSection;
+    pPmtSection  = new TiVoDecoderTsSection;
+    pcrPid       = 0;
     streams.clear();
+    std::memset(pidStreams, 0, sizeof(pidStreams));
     std::memset(&patData, 0, sizeof(TS_PAT_data));
 
     // Create stream for PAT
@@ -93,20 +105,388 @@ TiVoDecoderTS::TiVoDecoderTS(
     TiVoDecoderTsStream * pStream = new TiVoDecoderTsStream(0);
     pStream->pOutfile   = pFileOut;
     pStream->setDecoder(this);
-    streams[0]          = pStream;
+    addStream(pStream);
 }
 
 TiVoDecoderTS::~TiVoDecoderTS()
 {
+    if (pPipeline)
+        delete pPipeline;
+
+    delete pBatch;
+    delete pPatSection;
+    delete pPmtSection;
+
+    for (TsStreams_it it = streams.begin(); it != streams.end(); it++)
+        delete it->second;
+
     streams.clear();
 }
 
+void TiVoDecoderTS::addStream(TiVoDecoderTsStream *pStream)
+{
+    pStream->dropped = dropStream(pStream);
+
+    streams[pStream->stream_pid]    = pStream;
+    pidStreams[pStream->stream_pid] = pStream;
+}
+
+// Whether --pids and --streams leave the stream out; never the PAT or PMT.
+bool TiVoDecoderTS::dropStream(TiVoDecoderTsStream *pStream)
+{
+    uint16_t pid = pStream->stream_pid;
+
+    if (!pSelect || (0 == pid) || (patData.program_map_pid == pid) ||
+        pSelect->pids.count(pid))
+        return false;
+
+    switch (pStream->stream_type)
+    {
+        case TS_STREAM_TYPE_VIDEO:
+            return !(pSelect->kinds & SELECT_VIDEO);
+        case TS_STREAM_TYPE_AUDIO:
+            return !(pSelect->kinds & SELECT_AUDIO);
+        default:
+            return !(pSelect->kinds & SELECT_DATA);
+    }
+}
+
+/*
+ * --pids and --streams: take the streams left out from a PMT section that
+ * starts and ends in the packet, and redo its CRC.  Longer ones are left.
+ */
+void TiVoDecoderTS::filterPmt(TiVoDecoderTsPacket *pPkt)
+{
+    uint8_t  section[TS_FRAME_SIZE];
+    uint8_t *pPayload = &pPkt->buffer[pPkt->payloadOffset];
+    int      len      = TS_FRAME_SIZE - pPkt->payloadOffset;
+
+    if (!pPkt->getPayloadStartIndicator() || (len < 1) ||
+        (1 + pPayload[0] + 16 > len))
+        return;
+
+    uint8_t *pSection = pPayload + 1 + pPayload[0];
+    int      room     = (int)(pPayload + len - pSection);
+    int      sectionLen = ((pSection[1] & 0x0F) << 8) | pSection[2];
+
+    if ((0x02 != pSection[0]) || (3 + sectionLen > room) || (sectionLen < 13))
+        return;
+
+    int      infoLen = ((pSection[10] & 0x0F) << 8) | pSection[11];
+    uint8_t *pIn     = pSection + 12 + infoLen;
+    uint8_t *pEnd    = pSection + 3 + sectionLen - 4;
+    int      out     = 12 + infoLen;
+
+    if (pIn > pEnd)
+        return;
+
+    std::memcpy(section, pSection, out);
+
+    while (pIn < pEnd)
+    {
+        if (pIn + 5 > pEnd)
+            return;
+
+        int      esLen = ((pIn[3] & 0x0F) << 8) | pIn[4];
+        uint16_t pid   = portable_ntohs(&pIn[1]) & 0x1FFF;
+
+        if (pIn + 5 + esLen > pEnd)
+            return;
+
+        if (!pidStreams[pid] || !pidStreams[pid]->dropped)
+        {
+            std::memcpy(&section[out], pIn, 5 + esLen);
+            out += 5 + esLen;
+        }
+
+        pIn += 5 + esLen;
+    }
+
+    // section_length counts from after itself, and the CRC
+    sectionLen = out - 3 + 4;
+    section[1] = (section[1] & 0xF0) | (uint8_t)(sectionLen >> 8);
+    section[2] = (uint8_t)sectionLen;
+
+    uint32_t crc = ts_crc32(section, out);
+    section[out++] = (uint8_t)(crc >> 24);
+    section[out++] = (uint8_t)(crc >> 16);
+    section[out++] = (uint8_t)(crc >> 8);
+    section[out++] = (uint8_t)crc;
+
+    std::memcpy(pSection, section, out);
+    std::memset(pSection + out, 0xFF, room - out);
+}
+
+/*
+ * --pids and --streams: a packet of the PCR_PID left out is cut down to its
+ * adaptation field if that holds a PCR, so that the output keeps its clock.
+ * Returns false for one without, which is dropped.
+ */
+bool TiVoDecoderTS::keepPcr(int index)
+{
+    uint8_t *pData = pBatch->packet(index);
+    uint8_t  adaptLen = pData[4];
+
+    if ((pBatch->pid[index] != pcrPid) || !(pData[3] & 0x20) ||
+        (adaptLen < 7) || (adaptLen > TS_FRAME_SIZE - 5) ||
+        !(pData[5] & 0x10))
+        return false;
+
+    // the adaptation field, stuffed to the end, is all the packet holds
+    std::memset(&pData[5 + adaptLen], 0xFF, TS_FRAME_SIZE - 5 - adaptLen);
+    pData[1] &= ~0x40;
+    pData[3]  = (pData[3] & 0x0F) | 0x20;
+    pData[4]  = TS_FRAME_SIZE - 5;
+
+    pBatch->pusi[index]          = 0;
+    pBatch->scrambled[index]     = 0;
+    pBatch->payloadOffset[index] = TS_FRAME_SIZE;
+
+    return true;
+}
+
+/*
+ * Note a seek point for --write-index ahead of the packet at position,
+ * unless a stream is holding back packets of a PES header, which a decode
+ * resumed there would not have.
+ */
+void TiVoDecoderTS::addIndexPoint(hoff_t position)
+{
+    TiVoIndexTable table;
+
+    table.pmtPid = patData.program_map_pid;
+    if (0 == table.pmtPid)
+        return;
+
+    for (TsStreams_it it = streams.begin(); it != streams.end(); it++)
+    {
+        TiVoDecoderTsStream *pStream = it->second;
+
+        if (!pStream->packets.empty())
+            return;
+
+        // the PAT's stream is always there, the PMT's made from its PID
+        if ((0 == pStream->stream_pid) ||
+            (table.pmtPid == pStream->stream_pid))
+            continue;
+
+        TiVoIndexPid pid;
+        std::memset(&pid, 0, sizeof(pid));
+        pid.pid      = pStream->stream_pid;
+        pid.typeId   = pStream->stream_type_id;
+        pid.type     = pStream->stream_type;
+        pid.streamId = pStream->stream_id;
+        std::memcpy(pid.key, pStream->turing_stuff.key, 16);
+
+        table.pids.push_back(pid);
+    }
+
+    pIndex->add(position, pFileOut->written(), pTuring, &table);
+    pIndex->checkpoint(pFileOut);
+}
+
+/*
+ * Set up the streams as the PAT, PMT and TiVo private data had at the
+ * seek point, ahead of the first packet.
+ */
+bool TiVoDecoderTS::restore(TiVoDecoderIndex *pSeekIndex,
+                            const TiVoIndexPoint *pPoint)
+{
+    if (pPoint->table < 0)
+    {
+        std::fprintf(stderr, "Index : no PID table for the seek point\n");
+        return false;
+    }
+
+    const TiVoIndexTable &table = pSeekIndex->tables[pPoint->table];
+
+    patData.program_map_pid = table.pmtPid;
+
+    TiVoDecoderTsStream *pStream = new TiVoDecoderTsStream(table.pmtPid);
+    pStream->pOutfile = pFileOut;
+    pStream->setDecoder(this);
+    addStream(pStream);
+
+    for (size_t i = 0; i < table.pids.size(); i++)
+    {
+        const TiVoIndexPid &pid = table.pids[i];
+
+        pStream = new TiVoDecoderTsStream(pid.pid);
+        pStream->stream_type_id = pid.typeId;
+        pStream->stream_type    = (ts_stream_types)pid.type;
+        pStream->stream_id      = pid.streamId;
+        pStream->pOutfile       = pFileOut;
+        std::memcpy(pStream->turing_stuff.key, pid.key, 16);
+        pStream->setDecoder(this);
+        addStream(pStream);
+    }
+
+    return TiVoDecoder::restore(pSeekIndex, pPoint);
+}
+
+/*
+ * Called when pktCounter reaches pktDumpNext: raise the log level for
+ * packets inside a selected range and restore it past the end.
+ */
+void TiVoDecoderTS::selectPktDump()
+{
+    while ((pktDumpIndex < pktDump.size()) &&
+           (pktDump[pktDumpIndex].second < pktCounter))
+        pktDumpIndex++;
+
+    if (pktDumpIndex == pktDump.size())
+    {
+        o_log_level = verbose;
+        pktDumpNext = UINT32_MAX;
+    }
+    else if (pktDump[pktDumpIndex].first <= pktCounter)
+    {
+        o_log_level = LOG_LEVEL_MAX;
+        pktDumpNext = pktDump[pktDumpIndex].second + 1;
+    }
+    else
+    {
+        o_log_level = verbose;
+        pktDumpNext = pktDump[pktDumpIndex].first;
+    }
+}
+
+/*
+ * With more than one thread, decryption moves onto a pool of workers and
+ * output onto a writer thread; see tivo_decoder_ts_pipeline.cxx.
+ * Set verbose first, the threads take their log level from it.
+ */
+void TiVoDecoderTS::setThreads(int threads)
+{
+    if (pPipeline || threads <= 1)
+        return;
+
+    VERBOSE("TS Process : pipelined on %d threads\n", threads);
+    pPipeline = new TiVoDecoderTsPipeline(this, threads);
+}
+
+/*
+ * Locate the first offset at or after offset with TS_RESYNC_PACKETS
+ * consecutive sync bytes, the same test the packet reader resyncs with.
+ */
+hoff_t TiVoDecoderTS::findSync(hoff_t offset)
+{
+    uint8_t buf[TS_FRAME_SIZE * (TS_RESYNC_PACKETS + 1)];
+    int     i = 0;
+
+    while (1)
+    {
+        if (pFileIn->seek(offset) < 0)
+            return -1;
+
+        if (pFileIn->read(buf, sizeof(buf)) != sizeof(buf))
+            return -1;
+
+        for (i = 0; i < TS_FRAME_SIZE; i++)
+        {
+            int n = 0;
+
+            while ((n < TS_RESYNC_PACKETS) &&
+                   (buf[i + n * TS_FRAME_SIZE] == 'G'))
+                n++;
+
+            if (TS_RESYNC_PACKETS == n)
+                return offset + i;
+        }
+
+        offset += TS_FRAME_SIZE;
+    }
+}
+
+/*
+ * The PTS of the first video PES starting in a packet at or after input
+ * offset, or -1 if there is none within PTS_SEARCH; *pAt gets the offset
+ * of that packet.  PES headers are never encrypted.
+ */
+int64_t TiVoDecoderTS::findPts(hoff_t offset, hoff_t *pAt)
+{
+    uint8_t buf[TS_FRAME_SIZE];
+    hoff_t  last = offset + PTS_SEARCH;
+    hoff_t  pos  = findSync(offset);
+
+    if ((pos < 0) || (pFileIn->seek(pos) < 0))
+        return -1;
+
+    for ( ; pos < last; pos += TS_FRAME_SIZE)
+    {
+        if (pFileIn->read(buf, TS_FRAME_SIZE) != TS_FRAME_SIZE)
+            return -1;
+
+        if (buf[0] != 'G')
+        {
+            pos = findSync(pos + 1);
+            if ((pos < 0) || (pFileIn->seek(pos) < 0))
+                return -1;
+
+            pos -= TS_FRAME_SIZE;
+            continue;
+        }
+
+        // payload unit start, with a payload
+        if (!(buf[1] & 0x40) || !(buf[3] & 0x10))
+            continue;
+
+        int off = 4;
+        if (buf[3] & 0x20)
+            off += 1 + buf[4];
+
+        if (off + 14 > TS_FRAME_SIZE)
+            continue;
+
+        uint8_t *pPes = &buf[off];
+
+        if (pPes[0] || pPes[1] || (pPes[2] != 0x01) ||
+            ((pPes[3] & 0xF0) != 0xE0) || ((pPes[6] >> 6) != 0x2) ||
+            !(pPes[7] & 0x80))
+            continue;
+
+        *pAt = pos;
+        return mpeg_timestamp(&pPes[9]);
+    }
+
+    return -1;
+}
+
+/*
+ * The replayed state is complete once every stream named in the TiVo
+ * private data has started a new block.
+ */
+bool TiVoDecoderTS::isSynced()
+{
+    int keyed = 0;
+
+    for (TsStreams_it stream_iter = streams.begin();
+         stream_iter != streams.end(); stream_iter++)
+    {
+        TiVoDecoderTsStream *pStream = stream_iter->second;
+
+        if ((0 == pStream->stream_id) || (true == pStream->dropped))
+            continue;
+
+        if (false == pTuring->synced(pStream->stream_id))
+            return false;
+
+        keyed++;
+    }
+
+    return (keyed > 0) ? true : false;
+}
+
+/*
+ * PAT and PMT packets repeat every 100ms or so.  Their sections are
+ * reassembled on the PID and parsed only when they differ from the last
+ * copy seen.
+ */
 int TiVoDecoderTS::handlePkt_PAT(TiVoDecoderTsPacket *pPkt)
 {
-    uint16_t pat_field           = 0;
-    uint16_t section_length      = 0;
-    uint16_t transport_stream_id = 0;
-    uint8_t *pPtr                = NULL;
+    uint8_t *pSection  = NULL;
+    uint16_t sectionLen = 0;
+    int      err        = 0;
 
     if (!pPkt)
     {
@@ -114,13 +494,29 @@ int TiVoDecoderTS::handlePkt_PAT(TiVoDecoderTsPacket *pPkt)
         return -1;
     }
 
-    pPtr = &pPkt->buffer[pPkt->payloadOffset];
+    if (pPkt->payloadOffset >= TS_FRAME_SIZE)
+        return 0;
+
+    pPatSection->add(&pPkt->buffer[pPkt->payloadOffset],
+                     TS_FRAME_SIZE - pPkt->payloadOffset,
+                     pPkt->getPayloadStartIndicator());
 
-    if (pPkt->getPayloadStartIndicator())
+    while (pPatSection->next(&pSection, &sectionLen))
     {
-        pPtr++; // advance past pointer field
+        if (handleSection_PAT(pSection))
+            err = -1;
     }
 
+    return err;
+}
+
+int TiVoDecoderTS::handleSection_PAT(uint8_t *pPtr)
+{
+    uint16_t pat_field           = 0;
+    int      section_length      = 0;
+    uint16_t transport_stream_id = 0;
+    uint16_t program_map_pid     = patData.program_map_pid;
+
     if (*pPtr != 0x00)
     {
         std::perror("PAT Table ID must be 0x00");
@@ -167,9 +563,13 @@ int TiVoDecoderTS::handlePkt_PAT(TiVoDecoderTsPacket *pPkt)
     patData.last_section_number = *pPtr++;
     section_length--;
 
-    section_length -= 4; // ignore the CRC for now
+    section_length -= 4; // CRC, checked with the section
 
-    while (section_length > 0)
+    VERBOSE("%-15s : TS ID %d, section %d of %d\n", "TS ProgAssocTbl",
+            transport_stream_id, patData.section_number,
+            patData.last_section_number);
+
+    while (section_length >= 4)
     {
         pat_field = portable_ntohs(pPtr);
         VERBOSE("%-15s : Program Num : %d\n", "TS ProgAssocTbl", pat_field);
@@ -194,7 +594,7 @@ int TiVoDecoderTS::handlePkt_PAT(TiVoDecoderTsPacket *pPkt)
                 new TiVoDecoderTsStream(patData.program_map_pid);
             pStream->pOutfile = pFileOut;
             pStream->setDecoder(this);
-            streams[patData.program_map_pid] = pStream;
+            addStream(pStream);
         }
         else
         {
@@ -206,15 +606,18 @@ int TiVoDecoderTS::handlePkt_PAT(TiVoDecoderTsPacket *pPkt)
         section_length -= 2;
     }
 
+    // a PMT cached from another PID says nothing about the new one
+    if (program_map_pid != patData.program_map_pid)
+        pPmtSection->reset();
+
     return 0;
 }
 
 int TiVoDecoderTS::handlePkt_PMT(TiVoDecoderTsPacket *pPkt)
 {
-    uint16_t section_length = 0;
-    uint16_t pmt_field      = 0;
-    uint16_t i              = 0;
-    uint8_t *pPtr           = NULL;
+    uint8_t *pSection  = NULL;
+    uint16_t sectionLen = 0;
+    int      err        = 0;
 
     if (!pPkt)
     {
@@ -222,11 +625,33 @@ int TiVoDecoderTS::handlePkt_PMT(TiVoDecoderTsPacket *pPkt)
         return -1;
     }
 
-    pPtr = &pPkt->buffer[pPkt->payloadOffset];
+    if (pPkt->payloadOffset >= TS_FRAME_SIZE)
+        return 0;
+
+    pPmtSection->add(&pPkt->buffer[pPkt->payloadOffset],
+                     TS_FRAME_SIZE - pPkt->payloadOffset,
+                     pPkt->getPayloadStartIndicator());
 
-    if (pPkt->getPayloadStartIndicator())
+    while (pPmtSection->next(&pSection, &sectionLen))
     {
-        pPtr++; // advance past pointer field
+        if (handleSection_PMT(pSection))
+            err = -1;
+    }
+
+    return err;
+}
+
+int TiVoDecoderTS::handleSection_PMT(uint8_t *pPtr)
+{
+    int      section_length   = 0;
+    uint16_t pmt_field        = 0;
+    uint16_t program_info_len = 0;
+    uint16_t i                = 0;
+
+    if (*pPtr != 0x02)
+    {
+        VERBOSE("%-15s : skipping table 0x%02x\n", "TS ProgMapTbl", *pPtr);
+        return 0;
     }
 
     // advance past table_id field
@@ -238,14 +663,22 @@ int TiVoDecoderTS::handlePkt_PMT(TiVoDecoderTsPacket *pPkt)
     // advance past section_length
     pPtr += 2;
 
-    // advance past program/section/next numbers
-    pPtr += 9;
-    section_length -= 9;
+    pcrPid = portable_ntohs(pPtr + 5) & 0x1FFF;
+
+    // advance past program/section/next numbers and PCR PID
+    pPtr += 7;
+    section_length -= 7;
 
-    // ignore the CRC for now
+    program_info_len = portable_ntohs(pPtr) & 0x0fff;
+
+    // advance past program info
+    pPtr += 2 + program_info_len;
+    section_length -= 2 + program_info_len;
+
+    // CRC, checked with the section
     section_length -= 4;
 
-    for (i = 0; section_length > 0; i++)
+    for (i = 0; section_length >= 5; i++)
     {
         uint16_t es_info_length = 0;
         const char *strTypeStr;
@@ -321,7 +754,7 @@ int TiVoDecoderTS::handlePkt_PMT(TiVoDecoderTsPacket *pPkt)
             pStream->pOutfile       = pFileOut;
             pStream->setDecoder(this);
 
-            streams[streamPid]      = pStream;
+            addStream(pStream);
         }
         else
         {
@@ -414,6 +847,11 @@ int TiVoDecoderTS::handlePkt_TiVo(TiVoDecoderTsPacket *pPkt)
 
             pStream->stream_id = stream_id;
 
+            TD_PROBE(key, pid, pPtr);
+
+            if (pStats)
+                pStats->key(pid, pPtr);
+
             if (std::memcmp(&pStream->turing_stuff.key[0], pPtr, 16))
             {
                 VERBOSE("\nUpdating PID 0x%04x Type 0x%02x Turing Key\n",
@@ -451,6 +889,63 @@ int TiVoDecoderTS::handlePkt_AudioVideo(TiVoDecoderTsPacket *pPkt)
     return 0;
 }
 
+/*
+ * Packets continuing a PES packet on a stream with nothing buffered need
+ * none of the PES header bookkeeping of TiVoDecoderTsStream::addPkt; they
+ * are decrypted and written straight from the batch.  Returns false if
+ * the packet has to take the full path.
+ */
+bool TiVoDecoderTS::passPkt(int index)
+{
+    uint16_t pid = pBatch->pid[index];
+    uint8_t  offset = pBatch->payloadOffset[index];
+
+    if (pBatch->pusi[index] || (offset > TS_FRAME_SIZE) || pPipeline ||
+        IS_VVERBOSE)
+        return false;
+
+    if ((pid < 0x0020) || (pid > 0x1FFE) || (pid == patData.program_map_pid))
+        return false;
+
+    TiVoDecoderTsStream *pStream = pidStreams[pid];
+
+    if (!pStream || (TS_STREAM_TYPE_PRIVATE_DATA == pStream->stream_type) ||
+        !pStream->packets.empty())
+        return false;
+
+    uint8_t *pData = pBatch->packet(index);
+
+    if (pBatch->scrambled[index])
+    {
+        pData[3] &= ~0xC0;
+
+        if (false == pStream->decrypt(&pData[offset], TS_FRAME_SIZE - offset,
+                                      pStream->dropPes))
+        {
+            // as in addPkt, the packet is left queued on the stream
+            TiVoDecoderTsPacket *pPkt = new TiVoDecoderTsPacket;
+            pPkt->packetId = pktCounter;
+            pPkt->load(pData);
+            pPkt->decode();
+            pPkt->setStream(pStream);
+            pStream->packets.push_back(pPkt);
+
+            PERROR_LIMITED("Packet decrypt fails");
+            ERROR_LIMITED("Failed to add packet to stream : pktId %d\n",
+                          pktCounter);
+            return true;
+        }
+    }
+
+    if ((false == dryRun) && (false == pStream->dropPes) &&
+        (pFileOut->write(pData, TS_FRAME_SIZE) != TS_FRAME_SIZE))
+    {
+        PERROR_LIMITED("Writing packet to output file");
+    }
+
+    return true;
+}
+
 bool TiVoDecoderTS::process()
 {
     int err         = 0;
@@ -458,7 +953,9 @@ bool TiVoDecoderTS::process()
     hoff_t position = 0;
     TiVoDecoderTsStream *pStream = NULL;
     TsStreams_it        stream_iter;
-    TsPktDump_iter      pktDump_iter;
+
+    // on a resumed call, the last batch has been handled
+    int                 index = pBatch->count;
 
     if (false == isValid)
     {
@@ -466,57 +963,100 @@ bool TiVoDecoderTS::process()
         return false;
     }
 
+    o_log_level = verbose;
+
     while (running)
     {
+        if (index == pBatch->count)
+        {
+            // a queued input resumes here once a whole batch is in
+            if (pFileIn->starved(TS_BATCH_BYTES))
+                return true;
+
+            index = 0;
+            if (0 == pBatch->fill(pFileIn))
+            {
+                VERBOSE("End of File\n");
+                running = false;
+                continue;
+            }
+
+            if (pStats)
+                pStats->tick();
+        }
+
         err      = 0;
-        position = pFileIn->tell();
+        position = pBatch->position(index);
         pid      = 0;
 
-        pktCounter++;
-        VVERBOSE("Packet : %d\n", pktCounter);
+        if ((rangeEnd >= 0) && (position >= rangeEnd))
+        {
+            VERBOSE("End of range\n");
+            running = false;
+            continue;
+        }
 
-        TiVoDecoderTsPacket *pPkt = new TiVoDecoderTsPacket;
-        if (!pPkt)
+        if ((true == dryRun) && (position >= rangeStart))
         {
-            std::perror("failed to allocate TS packet");
-            return 10;
+            if (false == beginOutput())
+                return false;
+
+            // the pipeline seeds its own cipher contexts from pTuring
+            if (!pPipeline)
+                pTuring->dry_run(false);
         }
-        
-        pPkt->packetId = pktCounter;
 
-        int readSize = pPkt->read(pFileIn);
+        if (pIndex && pBatch->pusi[index] && (false == dryRun) &&
+            pIndex->due(position))
+            addIndexPoint(position);
+
+        pktCounter++;
+        VVERBOSE("Packet : %d\n", pktCounter);
 
-        VVERBOSE("Read Size : %d\n", readSize);
+        if (__builtin_expect(pktCounter >= pktDumpNext, 0))
+            selectPktDump();
 
-        if (readSize < 0)
+        TD_PROBE(packet, pBatch->pid[index], position);
+
+        if (pStats && (false == dryRun))
         {
-            std::fprintf(stderr,
-                         "Error TS packet read : pkt %d : size read %d",
-                         pktCounter, readSize);
-            return 10;
+            uint8_t offset = pBatch->payloadOffset[index];
+            size_t  len    = (offset < TS_FRAME_SIZE) ?
+                             TS_FRAME_SIZE - offset : 0;
+
+            pStats->packet(pBatch->pid[index], len,
+                           pBatch->scrambled[index] ? true : false);
         }
-        else if (readSize == 0)
+
+        if (pSelect && dropPkt(pBatch->pid[index]) &&
+            (false == keepPcr(index)))
         {
-            VERBOSE("End of File\n");
-            running = false;
+            index++;
             continue;
         }
-        else if (TS_FRAME_SIZE != readSize)
+
+        if (true == passPkt(index))
         {
-            std::fprintf(stderr,
-                         "Error TS packet read : pkt %d : size read %d",
-                         pktCounter, readSize);
-            return 10;
+            index++;
+            continue;
+        }
+
+        TiVoDecoderTsPacket *pPkt = new TiVoDecoderTsPacket;
+        if (!pPkt)
+        {
+            std::perror("failed to allocate TS packet");
+            return false;
         }
         
-        pktDump_iter = pktDumpMap.find(pktCounter);
-        o_pkt_dump   = (pktDump_iter != pktDumpMap.end()) ? true : false;
+        pPkt->packetId = pktCounter;
+        pPkt->load(pBatch->packet(index));
+        index++;
 
         if (false == pPkt->decode())
         {
             std::fprintf(stderr, "packet decode fails : pktId %d\n",
                          pktCounter);
-            return 10;
+            return false;
         }
         
         if (IS_VVERBOSE)
@@ -534,7 +1074,7 @@ bool TiVoDecoderTS::process()
             {
                 err = handlePkt_PAT(pPkt);
                 if (err)
-                    std::perror("ts_handle_pat failed");
+                    PERROR_LIMITED("ts_handle_pat failed");
                 break;
             }
             case TS_PID_TYPE_AUDIO_VIDEO_PRIVATE_DATA:
@@ -544,7 +1084,10 @@ bool TiVoDecoderTS::process()
                     pPkt->setPmtPkt(true);
                     err = handlePkt_PMT(pPkt);
                     if (err)
-                        std::perror("ts_handle_pmt failed");
+                        PERROR_LIMITED("ts_handle_pmt failed");
+
+                    if (pSelect && !err)
+                        filterPmt(pPkt);
                 }
                 else
                 {
@@ -565,13 +1108,13 @@ bool TiVoDecoderTS::process()
                     {
                         err = handlePkt_TiVo(pPkt);
                         if (err)
-                            std::perror("handlePkt_Tivo failed");
+                            PERROR_LIMITED("handlePkt_Tivo failed");
                     }
                     else
                     {
                         err = handlePkt_AudioVideo(pPkt);
                         if (err)
-                            std::perror("handlePkt_AudoVideo failed");
+                            PERROR_LIMITED("handlePkt_AudoVideo failed");
                     }
                 }
                 break;
@@ -579,14 +1122,17 @@ bool TiVoDecoderTS::process()
             default:
             {
                 std::perror("Unknown Packet Type");
-                return 10;
+                return false;
             }
         }
 
         stream_iter = streams.find(pPkt->getPID());
         if (stream_iter == streams.end())
         {
-            std::perror("Can not locate packet stream by PID");
+            // expected while replaying ahead of the PMT
+            if (false == dryRun)
+                PERROR_LIMITED("Can not locate packet stream by PID");
+            delete pPkt;
         }
         else
         {
@@ -594,11 +1140,16 @@ bool TiVoDecoderTS::process()
                      pktCounter, pPkt->getPID(), pPkt->getPID());
 
             pStream = stream_iter->second;
-            if (false == pStream->addPkt(pPkt))
+
+            // TiVo private data left out once its keys are read; a stream
+            // left out gets here only with its PCRs
+            if ((true == pStream->dropped) &&
+                (true == pPkt->getPayloadExists()))
+                delete pPkt;
+            else if (false == pStream->addPkt(pPkt))
             {
-                std::fprintf(stderr,
-                    "Failed to add packet to stream : pktId %d\n", 
-                    pPkt->packetId);
+                ERROR_LIMITED("Failed to add packet to stream : pktId %d\n",
+                              pPkt->packetId);
             }
             else
             {
@@ -608,6 +1159,9 @@ bool TiVoDecoderTS::process()
         }
     }
 
+    if (pPipeline)
+        pPipeline->finish();
+
     return true;
 }
 
@@ -9,14 +9,15 @@
 
 #include <deque>
 #include <map>
+#include <utility>
+#include <vector>
 using namespace std;
 
 #include "tivo_decoder_base.hxx"
-
-extern std::map<uint32_t, bool> pktDumpMap;
-extern std::map<uint32_t, bool>::iterator pktDumpMap_iter;
+#include "tivo_decoder_mpeg_parser.hxx"
 
 #define TS_FRAME_SIZE  188
+#define TS_PID_COUNT   0x2000
 
 #define PICTURE_START_CODE      0x100
 #define SLICE_START_CODE_MIN    0x101
@@ -157,6 +158,9 @@ extern ts_pmt_stream_type_info ts_pmt_stream_tags[];
 class TiVoDecoderTS;
 class TiVoDecoderTsStream;
 class TiVoDecoderTsPacket;
+class TiVoDecoderTsPipeline;
+class TiVoDecoderTsBatch;
+class TiVoDecoderTsSection;
 
 typedef std::deque<uint16_t>                              TsLengths;
 typedef std::deque<uint16_t>::iterator                    TsLengths_it;
@@ -167,10 +171,9 @@ typedef std::deque<TiVoDecoderTsPacket*>::iterator      TsPackets_it;
 typedef std::map<int, TiVoDecoderTsStream*>             TsStreams;
 typedef std::map<int, TiVoDecoderTsStream*>::iterator   TsStreams_it;
 
-typedef std::map<uint32_t,bool>                           TsPktDump;
-typedef std::map<uint32_t,bool>::iterator                 TsPktDump_iter;
-    
-extern TsPktDump pktDumpMap;
+// inclusive ranges of packet numbers selected with --pkt-dump, sorted
+typedef std::pair<uint32_t,uint32_t>                      TsPktRange;
+typedef std::vector<TsPktRange>                           TsPktDump;
 
 /* All elements are in big-endian format and are packed */
 
@@ -181,7 +184,47 @@ class TiVoDecoderTS : public TiVoDecoder
         uint32_t      pktCounter;
         TS_PAT_data patData;
 
+        // streams by PID, for the per packet lookup
+        TiVoDecoderTsStream *pidStreams[TS_PID_COUNT];
+        TiVoDecoderTsBatch  *pBatch;
+
+        // PAT and PMT sections, reassembled and cached
+        TiVoDecoderTsSection *pPatSection;
+        TiVoDecoderTsSection *pPmtSection;
+
+        // the PMT's PCR_PID, whose clock --pids and --streams always keep
+        uint16_t    pcrPid;
+
+        // next packet number at which the --pkt-dump state changes
+        uint32_t    pktDumpNext;
+        size_t      pktDumpIndex;
+
+        void addStream(TiVoDecoderTsStream *pStream);
+        void addIndexPoint(hoff_t position);
+        void selectPktDump();
+        int  handleSection_PAT(uint8_t *pPtr);
+        int  handleSection_PMT(uint8_t *pPtr);
+        bool passPkt(int index);
+        bool dropStream(TiVoDecoderTsStream *pStream);
+        void filterPmt(TiVoDecoderTsPacket *pPkt);
+        bool keepPcr(int index);
+
+        inline bool dropPkt(uint16_t pid);
+
     public:
+        TiVoDecoderTsPipeline *pPipeline;
+
+        // --pkt-dump ranges, sorted
+        TsPktDump   pktDump;
+
+        void setThreads(int threads);
+
+        virtual hoff_t findSync(hoff_t offset);
+        virtual bool isSynced();
+        virtual int64_t findPts(hoff_t offset, hoff_t *pAt);
+        virtual bool restore(TiVoDecoderIndex *pSeekIndex,
+                             const TiVoIndexPoint *pPoint);
+
         int handlePkt_PAT(TiVoDecoderTsPacket *pPkt);
         int handlePkt_PMT(TiVoDecoderTsPacket *pPkt);
         int handlePkt_TiVo(TiVoDecoderTsPacket *pPkt);
@@ -208,13 +251,23 @@ class TiVoDecoderTsStream
         HappyFile       *pOutfile;
 
         TS_Turing_Stuff turing_stuff;
+
+        // the buffered PES packet's picture, for --keyframes
+        mpeg_picture_info picture;
+
+        // --iframes: the current PES packet is left out
+        bool            dropPes;
+
+        // left out by --pids or --streams
+        bool            dropped;
         
         uint8_t           pesDecodeBuffer[TS_FRAME_SIZE * 10];
         
         void            setDecoder(TiVoDecoderTS *pDecoder);
         bool            addPkt(TiVoDecoderTsPacket *pPkt);
         bool            getPesHdrLength(uint8_t *pBuffer, uint16_t bufLen);
-        bool            decrypt(uint8_t *pBuffer, uint16_t bufLen);
+        bool            decrypt(uint8_t *pBuffer, uint16_t bufLen,
+                                bool pass = false);
 
         TiVoDecoderTsStream(uint16_t pid);
         ~TiVoDecoderTsStream();
@@ -223,9 +276,6 @@ class TiVoDecoderTsStream
 class TiVoDecoderTsPacket
 {
     public:
-        static int          globalBufferLen;
-        static uint8_t        globalBuffer[TS_FRAME_SIZE * 3];
-
         TiVoDecoderTsStream *pParent;
         uint32_t              packetId;
 
@@ -240,7 +290,7 @@ class TiVoDecoderTsPacket
         TS_Adaptation_Field tsAdaptation;
         ts_packet_pid_types ts_packet_type;
 
-        int  read(HappyFile *pInfile);
+        void load(const uint8_t *pData);
         bool decode();
         void dump();
         void setStream(TiVoDecoderTsStream *pStream);
@@ -273,6 +323,21 @@ class TiVoDecoderTsPacket
         TiVoDecoderTsPacket();
 };
 
+/*
+ * --pids and --streams: whether a packet goes no further, as PIDs with no
+ * stream do.  The TiVo private data is still parsed for its keys.
+ */
+inline bool TiVoDecoderTS::dropPkt(uint16_t pid)
+{
+    TiVoDecoderTsStream *pStream = pidStreams[pid];
+
+    if (!pStream)
+        return (0 != pid) && (patData.program_map_pid != pid);
+
+    return pStream->dropped &&
+           (TS_STREAM_TYPE_PRIVATE_DATA != pStream->stream_type);
+}
+
 #endif /* TIVO_DECODER_TS_HXX_ */
 
 /* vi:set ai ts=4 sw=4 expandtab: */
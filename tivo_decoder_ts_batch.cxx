@@ -0,0 +1,211 @@
+/*
+ * tivodecode-ng
+ * Copyright 2006-2015, Jeremy Drake et al.
+ * See COPYING file for license terms
+ */
+#ifdef HAVE_CONFIG_H
+#include "tdconfig.h"
+#endif
+
+#include <cstdio>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "tivo_parse.hxx"
+#include "tivo_decoder_ts_batch.hxx"
+
+TiVoDecoderTsBatch::TiVoDecoderTsBatch()
+{
+    bufferLen = 0;
+    consumed  = 0;
+    bufferPos = 0;
+    skipped   = 0;
+    inSync    = true;
+    eof       = false;
+    count     = 0;
+}
+
+/*
+ * Drop the consumed part of the buffer and top it up from the file.  A
+ * followed file gives what it has so far, which is decoded before waiting
+ * for more; it is at its end only when it gives nothing.
+ */
+void TiVoDecoderTsBatch::refill(HappyFile *pInfile)
+{
+    if (0 == bufferLen)
+        bufferPos = pInfile->tell();
+
+    if (consumed)
+    {
+        std::memmove(buffer, buffer + consumed, bufferLen - consumed);
+        bufferLen -= consumed;
+        bufferPos += (hoff_t)consumed;
+        consumed   = 0;
+    }
+
+    if ((false == eof) && (bufferLen < sizeof(buffer)))
+    {
+        size_t want = sizeof(buffer) - bufferLen;
+        size_t got  = pInfile->read(buffer + bufferLen, want, true);
+
+        VVERBOSE("Read handler : size %zu\n", got);
+
+        bufferLen += got;
+        if (0 == got)
+            eof = true;
+    }
+}
+
+/*
+ * Find the first offset from offset on where the sync byte repeats for
+ * TS_RESYNC_PACKETS packets, or bufferLen if there is none.  A single 0x47
+ * is no evidence of sync, payload bytes match it all the time.  With SSE2
+ * sixteen candidate offsets are tested at once, by and-ing the compares of
+ * the bytes one packet apart.
+ */
+size_t TiVoDecoderTsBatch::resync(size_t offset)
+{
+    const size_t span = (TS_RESYNC_PACKETS - 1) * TS_FRAME_SIZE;
+    size_t pos = offset;
+
+#ifdef __SSE2__
+    const __m128i sync = _mm_set1_epi8(0x47);
+
+    for (; pos + span + 16 <= bufferLen; pos += 16)
+    {
+        __m128i hits = _mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i *)&buffer[pos]), sync);
+
+        for (int i = 1; i < TS_RESYNC_PACKETS; i++)
+        {
+            hits = _mm_and_si128(hits, _mm_cmpeq_epi8(
+                _mm_loadu_si128((const __m128i *)
+                                &buffer[pos + i * TS_FRAME_SIZE]), sync));
+        }
+
+        int mask = _mm_movemask_epi8(hits);
+        if (mask)
+            return pos + __builtin_ctz(mask);
+    }
+#endif
+
+    for (; pos + span < bufferLen; pos++)
+    {
+        int i = 0;
+
+        while ((i < TS_RESYNC_PACKETS) &&
+               (buffer[pos + i * TS_FRAME_SIZE] == 'G'))
+            i++;
+
+        if (TS_RESYNC_PACKETS == i)
+            return pos;
+    }
+
+    return bufferLen;
+}
+
+// One pass over the batch, extracting the header fields into arrays.
+void TiVoDecoderTsBatch::decode()
+{
+    for (int i = 0; i < count; i++)
+    {
+        const uint8_t *pPkt = &buffer[offset[i]];
+        uint8_t flags = pPkt[3];
+
+        pid[i]           = ((pPkt[1] & 0x1F) << 8) | pPkt[2];
+        pusi[i]          = pPkt[1] & 0x40;
+        scrambled[i]     = flags & 0xC0;
+        payloadOffset[i] = 4 + ((flags >> 5) & 1) * (1 + pPkt[4]);
+    }
+}
+
+/*
+ * Read and decode the next batch of packets, regaining sync on the way if
+ * needed.  Returns the number of packets, 0 at end of file.
+ */
+int TiVoDecoderTsBatch::fill(HappyFile *pInfile)
+{
+    size_t pos = 0;
+
+    count = 0;
+    refill(pInfile);
+
+    while (count < TS_BATCH_PACKETS)
+    {
+        if (pos + TS_FRAME_SIZE > bufferLen)
+        {
+            // a short read ended in a part packet: read on for the rest
+            if ((0 == count) && (false == eof))
+            {
+                consumed = pos;
+                refill(pInfile);
+                pos = 0;
+                continue;
+            }
+            break;
+        }
+
+        if ((buffer[pos] != 'G') || (false == inSync))
+        {
+            // finish the batch first, so the search gets a full buffer
+            if (count > 0)
+                break;
+
+            if (true == inSync)
+            {
+                ERROR_LIMITED("loss_of_sync\n");
+                inSync = false;
+                pos++;
+                skipped++;
+            }
+
+            size_t next = resync(pos);
+
+            if (next < bufferLen)
+            {
+                ERROR_LIMITED("skipped %zu bytes, found a SYNC\n",
+                              skipped + (next - pos));
+                skipped = 0;
+                inSync  = true;
+                pos     = next;
+                continue;
+            }
+
+            // keep the tail which is too short to be checked yet
+            size_t limit = (TS_RESYNC_PACKETS - 1) * TS_FRAME_SIZE;
+            limit = (bufferLen - pos > limit) ? bufferLen - limit : pos;
+
+            if (true == eof)
+                limit = bufferLen;
+
+            skipped += limit - pos;
+            consumed = limit;
+
+            if (true == eof)
+                return 0;
+
+            refill(pInfile);
+            pos = 0;
+            continue;
+        }
+
+        offset[count++] = (uint32_t)pos;
+        pos += TS_FRAME_SIZE;
+    }
+
+    consumed = pos;
+
+    if ((0 == count) && (bufferLen > pos))
+    {
+        std::fprintf(stderr, "Read error : TS Frame Size : %d, Size Read %zu\n",
+                     TS_FRAME_SIZE, bufferLen - pos);
+    }
+
+    decode();
+    return count;
+}
+
+/* vi:set ai ts=4 sw=4 expandtab: */
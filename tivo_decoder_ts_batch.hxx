@@ -0,0 +1,60 @@
+#ifndef TIVO_DECODER_TS_BATCH_HXX_
+#define TIVO_DECODER_TS_BATCH_HXX_
+
+#ifdef HAVE_CONFIG_H
+#include "tdconfig.h"
+#endif
+
+#include "tivo_decoder_ts.hxx"
+
+#define TS_BATCH_PACKETS    512
+
+// packets whose sync bytes must line up to regain sync
+#define TS_RESYNC_PACKETS   5
+
+// the most one fill() reads
+#define TS_BATCH_BYTES      ((TS_BATCH_PACKETS + TS_RESYNC_PACKETS) * \
+                             TS_FRAME_SIZE)
+
+/*
+ * Reads transport packets in batches straight into one buffer and decodes
+ * the header fields the demux needs into structure-of-arrays form, in one
+ * pass over the batch.  Packets are not copied or allocated; index i of a
+ * batch refers to the packet at packet(i).
+ */
+class TiVoDecoderTsBatch
+{
+    private:
+        uint8_t     buffer[TS_BATCH_BYTES];
+        size_t      bufferLen;
+        size_t      consumed;
+        hoff_t      bufferPos;
+        size_t      skipped;
+        bool        inSync;
+        bool        eof;
+
+        void        refill(HappyFile *pInfile);
+        size_t      resync(size_t offset);
+        void        decode();
+
+    public:
+        int         count;
+        uint32_t    offset[TS_BATCH_PACKETS];
+        uint16_t    pid[TS_BATCH_PACKETS];
+        uint8_t     pusi[TS_BATCH_PACKETS];
+        uint8_t     scrambled[TS_BATCH_PACKETS];
+        uint8_t     payloadOffset[TS_BATCH_PACKETS];
+
+        int         fill(HappyFile *pInfile);
+
+        inline uint8_t *packet(int i)
+            { return &buffer[offset[i]]; }
+        inline hoff_t   position(int i)
+            { return bufferPos + (hoff_t)offset[i]; }
+
+        TiVoDecoderTsBatch();
+};
+
+#endif /* TIVO_DECODER_TS_BATCH_HXX_ */
+
+/* vi:set ai ts=4 sw=4 expandtab: */
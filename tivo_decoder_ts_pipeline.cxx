@@ -0,0 +1,311 @@
+/*
+ * tivodecode-ng
+ * Copyright 2006-2015, Jeremy Drake et al.
+ * See COPYING file for license terms
+ */
+#ifdef HAVE_CONFIG_H
+#include "tdconfig.h"
+#endif
+
+#include <cstdio>
+#include <cstring>
+
+#include "tivo_parse.hxx"
+#include "tivo_decoder_ts.hxx"
+#include "tivo_decoder_ts_pipeline.hxx"
+#include "tivo_decoder_stats.hxx"
+
+TiVoDecoderTsRun::TiVoDecoderTsRun(TuringState *pParent, uint8_t streamId,
+                                   int blockNo)
+{
+    stream_id = streamId;
+    block_no  = blockNo;
+    skip      = 0;
+    scheduled = false;
+    closed    = false;
+
+    std::memset(&turing, 0, sizeof(turing));
+    turing.inherit_key(pParent);
+}
+
+TiVoDecoderTsRun::~TiVoDecoderTsRun()
+{
+    turing.destruct();
+}
+
+TiVoDecoderTsPipeline::TiVoDecoderTsPipeline(TiVoDecoderTS *pTsDecoder,
+                                             int threads)
+{
+    pDecoder = pTsDecoder;
+    stopping = false;
+    finished = false;
+    head     = 0;
+    tail     = 0;
+
+    std::memset(current, 0, sizeof(current));
+    std::memset(slotDone, 0, sizeof(slotDone));
+
+    for (int i = 0; i < threads; i++)
+        workers.push_back(std::thread(&TiVoDecoderTsPipeline::workerMain,
+                                      this));
+
+    writer = std::thread(&TiVoDecoderTsPipeline::writerMain, this);
+}
+
+TiVoDecoderTsPipeline::~TiVoDecoderTsPipeline()
+{
+    finish();
+}
+
+// Wait for the writer to free a reorder slot, returning its index.
+// Only the demux thread fills slots, so tail is stable until it is
+// advanced by flush().
+uint32_t TiVoDecoderTsPipeline::acquire()
+{
+    std::unique_lock<std::mutex> guard(lock);
+
+    while (tail - head >= TS_PIPELINE_WINDOW)
+        slotFree.wait(guard);
+
+    return (uint32_t)(tail % TS_PIPELINE_WINDOW);
+}
+
+// Called with the lock held.
+void TiVoDecoderTsPipeline::closeRun(TiVoDecoderTsRun *pRun)
+{
+    pRun->closed = true;
+    if (false == pRun->scheduled)
+        delete pRun;
+}
+
+/*
+ * Hand over the packets buffered in pStream, in the order the sequential
+ * decoder would write them.  Block numbers are resolved from the stream's
+ * current TiVo key here, on the demux thread, so key updates made by
+ * handlePkt_TiVo apply to exactly the packets they would have applied to.
+ */
+bool TiVoDecoderTsPipeline::flush(TiVoDecoderTsStream *pStream)
+{
+    TiVoDecoderTsPacket *pPkt = NULL;
+
+    while (!pStream->packets.empty())
+    {
+        pPkt = pStream->packets.front();
+
+        VVERBOSE("Flushing packet %d\n", pPkt->packetId);
+
+        uint32_t slot = acquire();
+        int block_no  = 0;
+        int crypted   = 0;
+        bool scrambled = pPkt->getScramblingControl();
+
+        if (true == scrambled)
+        {
+            pPkt->clrScramblingControl();
+            slotOffset[slot] = pPkt->payloadOffset + pPkt->pesHdrOffset;
+            slotLength[slot] = TS_FRAME_SIZE - slotOffset[slot];
+
+            VVERBOSE("Decrypting PktID %d from stream 0x%04x : "
+                    "decrypt offset %d len %d\n", pPkt->packetId,
+                    pStream->stream_pid, slotOffset[slot], slotLength[slot]);
+
+            if (pDecoder->do_header(&pStream->turing_stuff.key[0],
+                                    &block_no, NULL, &crypted, NULL, NULL))
+            {
+                PERROR_LIMITED("do_header did not return 0!\n");
+                PERROR_LIMITED("Packet decrypt fails");
+                return false;
+            }
+
+            VERBOSE("%lld : stream_id: %x, block_no: %d\n",
+                    (long long)pDecoder->pFileIn->tell(),
+                    pStream->stream_id, block_no);
+
+            if (pDecoder->pStats)
+                pDecoder->pStats->block(pStream->stream_pid, block_no);
+        }
+
+        std::memcpy(slots[slot], pPkt->buffer, TS_FRAME_SIZE);
+
+        if (IS_VVERBOSE)
+        {
+            VVERBOSE("Writing PktID %d from stream 0x%04x\n",
+                    pPkt->packetId, pStream->stream_pid);
+            pPkt->dump();
+        }
+
+        pStream->packets.pop_front();
+        delete pPkt;
+
+        std::lock_guard<std::mutex> guard(lock);
+
+        if (true == scrambled)
+        {
+            TiVoDecoderTsRun *pRun = current[pStream->stream_id];
+
+            if (!pRun || pRun->block_no != block_no)
+            {
+                size_t skip = 0;
+
+                // the first run of a stream may continue a block which
+                // was replayed ahead of the output range
+                if (pRun)
+                    closeRun(pRun);
+                else
+                    skip = pDecoder->pTuring->position(pStream->stream_id,
+                                                       block_no);
+
+                pRun = new TiVoDecoderTsRun(pDecoder->pTuring,
+                                            pStream->stream_id, block_no);
+                pRun->skip = skip;
+                current[pStream->stream_id] = pRun;
+            }
+
+            slotDone[slot] = false;
+            pRun->pending.push_back(slot);
+
+            if (false == pRun->scheduled)
+            {
+                pRun->scheduled = true;
+                runQueue.push_back(pRun);
+                workReady.notify_one();
+            }
+        }
+        else
+        {
+            slotDone[slot] = true;
+            slotReady.notify_one();
+        }
+
+        tail++;
+    }
+
+    return true;
+}
+
+void TiVoDecoderTsPipeline::workerMain()
+{
+    std::unique_lock<std::mutex> guard(lock);
+
+    o_log_level = pDecoder->verbose;
+
+    while (1)
+    {
+        while (runQueue.empty() && !stopping)
+            workReady.wait(guard);
+
+        if (runQueue.empty())
+            break;
+
+        TiVoDecoderTsRun *pRun = runQueue.front();
+        runQueue.pop_front();
+
+        while (!pRun->pending.empty())
+        {
+            TsSlots batch;
+            batch.swap(pRun->pending);
+
+            guard.unlock();
+
+            pRun->turing.prepare_frame(pRun->stream_id, pRun->block_no);
+
+            if (pRun->skip)
+            {
+                pRun->turing.skip_data(pRun->skip);
+                pRun->skip = 0;
+            }
+
+            for (TsSlots::iterator it = batch.begin(); it != batch.end(); it++)
+            {
+                pRun->turing.decrypt_buffer(&slots[*it][slotOffset[*it]],
+                                            slotLength[*it]);
+            }
+
+            guard.lock();
+
+            for (TsSlots::iterator it = batch.begin(); it != batch.end(); it++)
+                slotDone[*it] = true;
+
+            slotReady.notify_one();
+        }
+
+        pRun->scheduled = false;
+        if (true == pRun->closed)
+            delete pRun;
+    }
+}
+
+void TiVoDecoderTsPipeline::writerMain()
+{
+    std::unique_lock<std::mutex> guard(lock);
+
+    o_log_level = pDecoder->verbose;
+
+    while (1)
+    {
+        uint32_t first = (uint32_t)(head % TS_PIPELINE_WINDOW);
+
+        if (head == tail || false == slotDone[first])
+        {
+            if (stopping && head == tail)
+                break;
+
+            slotReady.wait(guard);
+            continue;
+        }
+
+        // gather the contiguous run of finished slots, up to the wrap
+        uint32_t count = 0;
+        while (head + count < tail && first + count < TS_PIPELINE_WINDOW &&
+               true == slotDone[first + count])
+        {
+            slotDone[first + count] = false;
+            count++;
+        }
+
+        guard.unlock();
+
+        size_t len = (size_t)count * TS_FRAME_SIZE;
+        if (pDecoder->pFileOut->write(slots[first], len) != len)
+        {
+            PERROR_LIMITED("Writing packet to output file");
+        }
+
+        guard.lock();
+
+        head += count;
+        slotFree.notify_one();
+    }
+}
+
+/*
+ * Close all open runs and wait until every queued packet has been written.
+ */
+void TiVoDecoderTsPipeline::finish()
+{
+    if (true == finished)
+        return;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        for (int i = 0; i < 256; i++)
+        {
+            if (current[i])
+                closeRun(current[i]);
+            current[i] = NULL;
+        }
+
+        stopping = true;
+        workReady.notify_all();
+        slotReady.notify_all();
+    }
+
+    for (TsThreads::iterator it = workers.begin(); it != workers.end(); it++)
+        it->join();
+
+    writer.join();
+    finished = true;
+}
+
+/* vi:set ai ts=4 sw=4 expandtab: */
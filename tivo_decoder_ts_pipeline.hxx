@@ -0,0 +1,94 @@
+#ifndef TIVO_DECODER_TS_PIPELINE_HXX_
+#define TIVO_DECODER_TS_PIPELINE_HXX_
+
+#ifdef HAVE_CONFIG_H
+#include "tdconfig.h"
+#endif
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "tivo_decoder_ts.hxx"
+
+// Packets which may be in flight between the demux and the writer
+#define TS_PIPELINE_WINDOW  8192
+
+class TiVoDecoderTsRun;
+
+typedef std::deque<TiVoDecoderTsRun*>       TsRuns;
+typedef std::deque<uint32_t>                TsSlots;
+typedef std::vector<std::thread>            TsThreads;
+
+/*
+ * A run is the series of packets decrypted with one cipher context: the
+ * packets of a single stream_id carrying the same block number.  The
+ * keystream restarts at every block boundary, so runs are independent of
+ * each other and can be decrypted concurrently, while the packets within a
+ * run are decrypted in order.
+ */
+class TiVoDecoderTsRun
+{
+    public:
+        uint8_t         stream_id;
+        int             block_no;
+        TuringState     turing;
+        size_t          skip;
+        TsSlots         pending;
+        bool            scheduled;
+        bool            closed;
+
+        TiVoDecoderTsRun(TuringState *pParent, uint8_t streamId, int blockNo);
+        ~TiVoDecoderTsRun();
+};
+
+/*
+ * Three stage transport stream pipeline.  The demux thread (the caller of
+ * TiVoDecoderTS::process) parses headers, PSI and TiVo private data and
+ * hands flushed packets to flush().  Scrambled packets are decrypted by a
+ * pool of workers, each run using a private cipher context, and a writer
+ * thread emits packets in the order the sequential decoder would have.
+ */
+class TiVoDecoderTsPipeline
+{
+    private:
+        TiVoDecoderTS           *pDecoder;
+        TsThreads               workers;
+        std::thread             writer;
+
+        std::mutex              lock;
+        std::condition_variable workReady;
+        std::condition_variable slotReady;
+        std::condition_variable slotFree;
+
+        TsRuns                  runQueue;
+        TiVoDecoderTsRun        *current[256];
+        bool                    stopping;
+        bool                    finished;
+
+        // reorder buffer, indexed by output sequence modulo the window
+        uint8_t                 slots[TS_PIPELINE_WINDOW][TS_FRAME_SIZE];
+        uint8_t                 slotOffset[TS_PIPELINE_WINDOW];
+        uint8_t                 slotLength[TS_PIPELINE_WINDOW];
+        bool                    slotDone[TS_PIPELINE_WINDOW];
+        uint64_t                head;
+        uint64_t                tail;
+
+        uint32_t acquire();
+        void     closeRun(TiVoDecoderTsRun *pRun);
+        void     workerMain();
+        void     writerMain();
+
+    public:
+        bool flush(TiVoDecoderTsStream *pStream);
+        void finish();
+
+        TiVoDecoderTsPipeline(TiVoDecoderTS *pTsDecoder, int threads);
+        ~TiVoDecoderTsPipeline();
+};
+
+#endif /* TIVO_DECODER_TS_PIPELINE_HXX_ */
+
+/* vi:set ai ts=4 sw=4 expandtab: */
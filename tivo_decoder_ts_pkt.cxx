@@ -13,9 +13,8 @@
 #include "hexlib.hxx"
 #include "tivo_parse.hxx"
 #include "tivo_decoder_ts.hxx"
-
-int TiVoDecoderTsPacket::globalBufferLen=0;
-uint8_t TiVoDecoderTsPacket::globalBuffer[];
+#include "tivo_decoder_stats.hxx"
+#include "tivo_decoder_verify.hxx"
 
 TiVoDecoderTsPacket::TiVoDecoderTsPacket()
 {
@@ -38,146 +37,11 @@ void TiVoDecoderTsPacket::setStream(TiVoDecoderTsStream *pStream)
     pParent = pStream;
 }
 
-int TiVoDecoderTsPacket::read(HappyFile *pInfile)
+// Take a copy of the packet at pData, for the full demux path.
+void TiVoDecoderTsPacket::load(const uint8_t *pData)
 {
-    int size = 0;
-    int loss_of_sync = 0;
-
-    if (!pInfile)
-    {
-        std::perror("bad parameter");
-        return -1;
-    }
-
-    if (globalBufferLen > TS_FRAME_SIZE)
-    {
-        std::fprintf(stderr, "globalBufferLen > TS_FRAME_SIZE, "
-                             "pulling packet from globalBuffer[]\n");
-
-        globalBufferLen -= TS_FRAME_SIZE;
-
-        std::memmove(globalBuffer, globalBuffer + TS_FRAME_SIZE,
-                     globalBufferLen);
-
-        size = min(globalBufferLen, TS_FRAME_SIZE);
-        std::memcpy(buffer, globalBuffer, size);
-    }
-    else
-    {
-        size = pInfile->read(buffer, TS_FRAME_SIZE);
-        globalBufferLen = 0;
-
-        VVERBOSE("Read handler : size %d\n", size);
-    }
-
-    if (0 == size)
-    {
-        VERBOSE("End of file\n");
-        isValid = true;
-        return size;
-    }
-    else if (TS_FRAME_SIZE != size)
-    {
-        std::fprintf(stderr, "Read error : TS Frame Size : %d, Size Read %d\n",
-                     TS_FRAME_SIZE, size);
-        if (size < 0)
-            return -1;
-        else
-            return 0; // indicate EOF on partial packet
-    }
-
-    if (buffer[0] != 'G')
-    {
-        loss_of_sync = 1;
-        std::fprintf(stderr, "loss_of_sync\n");
-
-        if (globalBufferLen == 0)
-        {
-            std::memcpy(globalBuffer, buffer, size);
-            globalBufferLen = size;
-        }
-    }
-
-    int skip = 0;
-
-    while (loss_of_sync)
-    {
-        for (int i = 1; 1; i++)
-        {
-            skip++;
-
-            if (i < globalBufferLen)
-            {
-                if (globalBuffer[i] == 'G')
-                {
-                    std::fprintf(stderr, "skipped %d bytes, found a SYNC\n",
-                                 skip);
-
-                    globalBufferLen -= i;
-                    std::memmove(globalBuffer, globalBuffer + i,
-                                 globalBufferLen);
-                    break;
-                }
-            }
-            else
-            {
-                size = pInfile->read(globalBuffer, TS_FRAME_SIZE * 3);
-
-                VVERBOSE("Read handler : size %d\n", size);
-
-                if (0 == size)
-                {
-                    VERBOSE("End of file\n");
-                    isValid = true;
-                    return 0;
-                }
-                else if ((TS_FRAME_SIZE*3) != size)
-                {
-                    std::fprintf(stderr,
-                            "Read error : TS Frame Size*3 : %d, Size Read %d\n",
-                            TS_FRAME_SIZE * 3, size);
-
-                    if (size < 0)
-                        return -1;
-                    else
-                        return 0; // indicate EOF on partial packet
-                }
-
-                globalBufferLen = size;
-                i = 0;
-            }
-        }
-
-        size = pInfile->read(globalBuffer + globalBufferLen,
-                             (3 * TS_FRAME_SIZE) - globalBufferLen);
-        if (size < 0)
-        {
-            std::fprintf(stderr, "ERROR: size=%d\n", size);
-            return -1;
-        }
-
-        globalBufferLen += size;
-
-        if (globalBufferLen != (3 * TS_FRAME_SIZE))
-        {
-            std::fprintf(stderr,
-                "ERROR: globalBufferLen != (3 * TS_FRAME_SIZE)\n");
-            return 0;  // indicate EOF on partial packet
-        }
-
-        if (globalBuffer[0] == 'G' && globalBuffer[TS_FRAME_SIZE] == 'G' &&
-            globalBuffer[TS_FRAME_SIZE * 2] == 'G')
-        {
-            loss_of_sync = 0;
-            std::fprintf(stderr, "found 3 syncs in a row, loss_of_sync = 0\n");
-
-            size = TS_FRAME_SIZE;
-            std::memcpy(buffer, globalBuffer, size);
-        }
-    }
-
+    std::memcpy(buffer, pData, TS_FRAME_SIZE);
     isValid = true;
-    return size;
 }
 
 bool TiVoDecoderTsPacket::decode()
@@ -360,7 +224,12 @@ void TiVoDecoderTsPacket::dump()
     hexbulk(buffer, TS_FRAME_SIZE);
 }
 
-bool TiVoDecoderTsStream::decrypt(uint8_t *pBuffer, uint16_t bufferLen)
+/*
+ * Decrypt a packet's payload, or with pass set, only use up its keystream
+ * and leave it encrypted.
+ */
+bool TiVoDecoderTsStream::decrypt(uint8_t *pBuffer, uint16_t bufferLen,
+                                  bool pass)
 {
     if (!pParent)
     {
@@ -379,7 +248,11 @@ bool TiVoDecoderTsStream::decrypt(uint8_t *pBuffer, uint16_t bufferLen)
                            &(turing_stuff.block_no), NULL,
                            &(turing_stuff.crypted), NULL, NULL))
     {
-        std::perror("do_header did not return 0!\n");
+        // replaying ahead of an output range, the key may not be known yet
+        if (true == pParent->dryRun)
+            return true;
+
+        PERROR_LIMITED("do_header did not return 0!\n");
         return false;
     }
 
@@ -388,6 +261,12 @@ bool TiVoDecoderTsStream::decrypt(uint8_t *pBuffer, uint16_t bufferLen)
                      stream_id, turing_stuff.block_no, turing_stuff.crypted);
     VERBOSE("%lld : stream_id: %x, block_no: %d\n", pParent->pFileIn->tell(), stream_id, turing_stuff.block_no);
 
+    if (pParent->pStats && (false == pParent->dryRun))
+        pParent->pStats->block(stream_pid, turing_stuff.block_no);
+
+    if (pParent->pVerify && (false == pParent->dryRun))
+        pParent->pVerify->block(stream_pid, turing_stuff.block_no);
+
     pParent->pTuring->prepare_frame(stream_id, turing_stuff.block_no);
 
     if (IS_VVVERBOSE)
@@ -400,6 +279,12 @@ bool TiVoDecoderTsStream::decrypt(uint8_t *pBuffer, uint16_t bufferLen)
         pParent->pTuring->dump();
     }
 
+    if (true == pass)
+    {
+        pParent->pTuring->pass_buffer(bufferLen);
+        return true;
+    }
+
     pParent->pTuring->decrypt_buffer(pBuffer, bufferLen);
 
     if (IS_VVVERBOSE)
@@ -0,0 +1,231 @@
+/*
+ * tivodecode-ng
+ * Copyright 2006-2015, Jeremy Drake et al.
+ * See COPYING file for license terms
+ */
+#ifdef HAVE_CONFIG_H
+#include "tdconfig.h"
+#endif
+
+#include <cstdio>
+#include <cstring>
+
+#include "tivo_parse.hxx"
+#include "tivo_decoder_ts_section.hxx"
+
+/*
+ * MPEG-2 CRC-32 (polynomial 0x04C11DB7, MSB first, no final xor), eight
+ * bytes per step with the slicing-by-8 tables.
+ */
+struct TsCrcTables
+{
+    uint32_t t[8][256];
+
+    TsCrcTables()
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            uint32_t crc = (uint32_t)i << 24;
+
+            for (int j = 0; j < 8; j++)
+                crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+
+            t[0][i] = crc;
+        }
+
+        for (int k = 1; k < 8; k++)
+        {
+            for (int i = 0; i < 256; i++)
+                t[k][i] = (t[k - 1][i] << 8) ^ t[0][t[k - 1][i] >> 24];
+        }
+    }
+};
+
+uint32_t ts_crc32(const uint8_t *pData, size_t len)
+{
+    static const TsCrcTables tables;
+    const uint32_t (*t)[256] = tables.t;
+    uint32_t crc = 0xFFFFFFFF;
+
+    while (len >= 8)
+    {
+        uint32_t hi = crc ^ ((uint32_t)pData[0] << 24 |
+                             (uint32_t)pData[1] << 16 |
+                             (uint32_t)pData[2] << 8 | pData[3]);
+        uint32_t lo = ((uint32_t)pData[4] << 24 | (uint32_t)pData[5] << 16 |
+                       (uint32_t)pData[6] << 8 | pData[7]);
+
+        crc = t[7][hi >> 24] ^ t[6][(hi >> 16) & 0xFF] ^
+              t[5][(hi >> 8) & 0xFF] ^ t[4][hi & 0xFF] ^
+              t[3][lo >> 24] ^ t[2][(lo >> 16) & 0xFF] ^
+              t[1][(lo >> 8) & 0xFF] ^ t[0][lo & 0xFF];
+
+        pData += 8;
+        len   -= 8;
+    }
+
+    while (len--)
+        crc = (crc << 8) ^ t[0][(crc >> 24) ^ *pData++];
+
+    return crc;
+}
+
+TiVoDecoderTsSection::TiVoDecoderTsSection()
+{
+    reset();
+}
+
+// Forget any partial section and the cached one.
+void TiVoDecoderTsSection::reset()
+{
+    bufferLen  = 0;
+    assembling = false;
+    cacheLen   = 0;
+    pData      = NULL;
+    dataLen    = 0;
+    startAt    = -1;
+}
+
+// Length of the section being assembled, once its header is in.
+uint16_t TiVoDecoderTsSection::total()
+{
+    if (bufferLen < 3)
+        return 3;
+
+    return 3 + (portable_ntohs(&buffer[1]) & 0x0FFF);
+}
+
+/*
+ * Queue the payload of the next packet on the PID.  Sections are read
+ * out of it with next().
+ */
+void TiVoDecoderTsSection::add(const uint8_t *pPayload, int len, bool pusi)
+{
+    pData   = pPayload;
+    dataLen = len;
+    startAt = -1;
+
+    if ((true == pusi) && (len > 0))
+    {
+        startAt = pData[0];
+        pData++;
+        dataLen--;
+
+        if (startAt > dataLen)
+        {
+            VERBOSE("PSI section : bad pointer field %d\n", startAt);
+            assembling = false;
+            dataLen    = 0;
+        }
+    }
+}
+
+/*
+ * Hand out the next complete section of the queued payload which differs
+ * from the last one handed out and passes its CRC.  Returns false once
+ * the payload is used up.
+ */
+bool TiVoDecoderTsSection::next(uint8_t **ppSection, uint16_t *pLen)
+{
+    while (dataLen > 0)
+    {
+        if (false == assembling)
+        {
+            // nothing of this payload starts a section
+            if (startAt < 0)
+                break;
+
+            pData   += startAt;
+            dataLen -= startAt;
+            startAt  = -1;
+
+            // the rest of the payload is stuffing
+            if ((0 == dataLen) || (0xFF == pData[0]))
+                break;
+
+            assembling = true;
+            bufferLen  = 0;
+        }
+
+        // bytes before the pointer belong to the section in progress
+        int avail = (startAt >= 0) ? startAt : dataLen;
+
+        while ((avail > 0) && (bufferLen < total()))
+        {
+            int n = total() - bufferLen;
+            if (n > avail)
+                n = avail;
+
+            if (total() > TS_SECTION_MAX)
+            {
+                VERBOSE("PSI section : length %d too long\n", total());
+                assembling = false;
+                break;
+            }
+
+            std::memcpy(&buffer[bufferLen], pData, n);
+            bufferLen += n;
+            pData     += n;
+            dataLen   -= n;
+            avail     -= n;
+            if (startAt >= 0)
+                startAt -= n;
+        }
+
+        if (false == assembling)
+        {
+            if (startAt < 0)
+                dataLen = 0;
+            continue;
+        }
+
+        if ((bufferLen >= 3) && (bufferLen == total()))
+        {
+            // another section may follow straight on
+            assembling = false;
+            if (startAt < 0)
+                startAt = 0;
+
+            if (true == finish())
+            {
+                *ppSection = buffer;
+                *pLen      = bufferLen;
+                return true;
+            }
+        }
+        else if (0 == startAt)
+        {
+            VERBOSE("PSI section : short section dropped\n");
+            assembling = false;
+        }
+    }
+
+    dataLen = 0;
+    return false;
+}
+
+// Check a complete section against the cache and its CRC.
+bool TiVoDecoderTsSection::finish()
+{
+    // version_number and CRC first, the rest only if those match
+    if ((bufferLen == cacheLen) && (bufferLen >= 8) &&
+        (buffer[5] == cache[5]) &&
+        !std::memcmp(&buffer[bufferLen - 4], &cache[cacheLen - 4], 4) &&
+        !std::memcmp(buffer, cache, bufferLen))
+    {
+        return false;
+    }
+
+    // sections with the long syntax end in a CRC over the whole section
+    if ((buffer[1] & 0x80) && ts_crc32(buffer, bufferLen))
+    {
+        VERBOSE("PSI section : table 0x%02x CRC mismatch\n", buffer[0]);
+        return false;
+    }
+
+    std::memcpy(cache, buffer, bufferLen);
+    cacheLen = bufferLen;
+    return true;
+}
+
+/* vi:set ai ts=4 sw=4 expandtab: */
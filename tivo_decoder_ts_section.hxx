@@ -0,0 +1,50 @@
+#ifndef TIVO_DECODER_TS_SECTION_HXX_
+#define TIVO_DECODER_TS_SECTION_HXX_
+
+#ifdef HAVE_CONFIG_H
+#include "tdconfig.h"
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+// largest private section; PAT and PMT sections are limited to 1024 bytes
+#define TS_SECTION_MAX  4096
+
+uint32_t ts_crc32(const uint8_t *pData, size_t len);
+
+/*
+ * Reassembles the PSI sections carried on one PID from its packet
+ * payloads.  The last section handed out is kept, so a table repeated
+ * unchanged is dropped after a compare instead of being parsed again.
+ */
+class TiVoDecoderTsSection
+{
+    private:
+        uint8_t         buffer[TS_SECTION_MAX];
+        uint16_t        bufferLen;
+        bool            assembling;
+
+        uint8_t         cache[TS_SECTION_MAX];
+        uint16_t        cacheLen;
+
+        // unread part of the current payload, and where in it the
+        // pointer field says the next section starts (-1 for nowhere)
+        const uint8_t  *pData;
+        int             dataLen;
+        int             startAt;
+
+        uint16_t        total();
+        bool            finish();
+
+    public:
+        void            add(const uint8_t *pPayload, int len, bool pusi);
+        bool            next(uint8_t **ppSection, uint16_t *pLen);
+        void            reset();
+
+        TiVoDecoderTsSection();
+};
+
+#endif /* TIVO_DECODER_TS_SECTION_HXX_ */
+
+/* vi:set ai ts=4 sw=4 expandtab: */
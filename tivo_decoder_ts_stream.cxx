@@ -11,8 +11,15 @@
 #include <cstring>
 
 #include "hexlib.hxx"
+#include "profiler.hxx"
 #include "tivo_parse.hxx"
+#include "tivo_probes.hxx"
 #include "tivo_decoder_ts.hxx"
+#include "tivo_decoder_ts_pipeline.hxx"
+#include "tivo_decoder_stats.hxx"
+#include "tivo_decoder_frames.hxx"
+#include "tivo_decoder_captions.hxx"
+#include "tivo_decoder_segments.hxx"
 #include "tivo_decoder_mpeg_parser.hxx"
 
 TiVoDecoderTsStream::TiVoDecoderTsStream(uint16_t pid)
@@ -26,6 +33,18 @@ TiVoDecoderTsStream::TiVoDecoderTsStream(uint16_t pid)
     stream_type    = TS_STREAM_TYPE_NONE;
 
     std::memset(&turing_stuff, 0, sizeof(TS_Turing_Stuff));
+    std::memset(&picture, 0, sizeof(picture));
+    dropPes = false;
+    dropped = false;
+}
+
+TiVoDecoderTsStream::~TiVoDecoderTsStream()
+{
+    // packets still buffered when the decode stopped
+    for (TsPackets_it it = packets.begin(); it != packets.end(); it++)
+        delete *it;
+
+    packets.clear();
 }
 
 void TiVoDecoderTsStream::setDecoder(TiVoDecoderTS *pDecoder)
@@ -57,6 +76,9 @@ bool TiVoDecoderTsStream::addPkt(TiVoDecoderTsPacket *pPkt)
     // The accounts for the situation where the PES headers
     // straddles two packets, and decryption is needed on the 2nd.
 
+    if (true == pPkt->getPayloadStartIndicator())
+        TD_PROBE(pes, stream_pid, pPkt->packetId);
+
     if ((true == pPkt->getPayloadStartIndicator()) || (0 != packets.size()))
     {
         VVERBOSE("Add PktID %d from PID 0x%04x to packet list : payloadStart "
@@ -95,8 +117,8 @@ bool TiVoDecoderTsStream::addPkt(TiVoDecoderTsPacket *pPkt)
         bool pesParse = getPesHdrLength(pesDecodeBuffer, pesDecodeBufferLen);
         if (false == pesParse)
         {
-            std::fprintf(stderr, "failed to parse PES headers : pktID %d\n", 
-                         pPkt->packetId);
+            ERROR_LIMITED("failed to parse PES headers : pktID %d\n",
+                          pPkt->packetId);
             return false;
         }
 
@@ -204,7 +226,50 @@ bool TiVoDecoderTsStream::addPkt(TiVoDecoderTsPacket *pPkt)
         packets.push_back(pPkt);
     }
     
+    if (pParent->pStats)
+        pParent->pStats->buffered(stream_pid, packets.size());
+
     if (true == flushBuffers)
+        TD_PROBE(flush, stream_pid, packets.size());
+
+    // --iframes leaves out audio, and video but for I pictures, from here
+    // to the next PES packet
+    if ((true == flushBuffers) && pParent->iframesOnly &&
+        (true == packets.front()->getPayloadStartIndicator()))
+        dropPes = (TS_STREAM_TYPE_AUDIO == stream_type) ||
+                  ((TS_STREAM_TYPE_VIDEO == stream_type) &&
+                   (1 != picture.pictureType));
+
+    // the PES packet starts at the first buffered packet, about to be
+    // written (--keyframes and --segment-duration decode on one thread)
+    if ((true == flushBuffers) && (pParent->pFrames || pParent->pSegments) &&
+        (false == pParent->dryRun) && (false == dropPes) &&
+        (TS_STREAM_TYPE_VIDEO == stream_type) &&
+        (true == packets.front()->getPayloadStartIndicator()))
+    {
+        if (pParent->pFrames)
+            pParent->pFrames->mark(pOutfile->written(), stream_pid, picture);
+
+        if (pParent->pSegments)
+            pParent->pSegments->picture(pOutfile->written(), picture);
+    }
+
+    // the picture user data is scrambled: its captions are looked for in
+    // the packets of the PES start once decrypted (on one thread)
+    bool captions = (true == flushBuffers) && pParent->pCaptions &&
+        (false == pParent->dryRun) && (false == dropPes) &&
+        (TS_STREAM_TYPE_VIDEO == stream_type) &&
+        (true == packets.front()->getPayloadStartIndicator());
+    size_t captionLen = 0;
+
+    if ((true == flushBuffers) && pParent->pPipeline &&
+        (false == pParent->dryRun))
+    {
+        VVERBOSE("Flush packets to pipeline\n");
+
+        return pParent->pPipeline->flush(this);
+    }
+    else if (true == flushBuffers)
     {        
         VVERBOSE("Flush packets for write\n");
         
@@ -229,13 +294,29 @@ bool TiVoDecoderTsStream::addPkt(TiVoDecoderTsPacket *pPkt)
                         stream_pid, decryptOffset, decryptLen);
 
                 if (false == decrypt(&pPkt2->buffer[decryptOffset],
-                                     decryptLen))
+                                     decryptLen, dropPes))
                 {
-                    std::perror("Packet decrypt fails");
+                    PERROR_LIMITED("Packet decrypt fails");
                     return false;
                 }
             }
         
+            if ((true == pParent->dryRun) || (true == dropPes))
+            {
+                delete pPkt2;
+                continue;
+            }
+
+            if ((true == captions) &&
+                (captionLen + TS_FRAME_SIZE <= sizeof(pesDecodeBuffer)))
+            {
+                size_t n = TS_FRAME_SIZE - pPkt2->payloadOffset;
+
+                std::memcpy(&pesDecodeBuffer[captionLen],
+                            &pPkt2->buffer[pPkt2->payloadOffset], n);
+                captionLen += n;
+            }
+
             if (IS_VVERBOSE)
             { 
                 VVERBOSE("Writing PktID %d from stream 0x%04x\n",
@@ -246,7 +327,7 @@ bool TiVoDecoderTsStream::addPkt(TiVoDecoderTsPacket *pPkt)
             if (pOutfile->write(&pPkt2->buffer[0], TS_FRAME_SIZE) !=
                 TS_FRAME_SIZE)
             {
-                std::perror("Writing packet to output file");
+                PERROR_LIMITED("Writing packet to output file");
             }
             else
             {
@@ -258,6 +339,12 @@ bool TiVoDecoderTsStream::addPkt(TiVoDecoderTsPacket *pPkt)
         }
 
         packets.clear();
+
+        if (true == captions)
+        {
+            mpeg_scan_captions(pesDecodeBuffer, captionLen, &picture);
+            pParent->pCaptions->add(picture);
+        }
     }
     else
     {
@@ -271,6 +358,8 @@ bool TiVoDecoderTsStream::getPesHdrLength(uint8_t *pBuffer, uint16_t bufLen)
 {
     TiVoDecoder_MPEG2_Parser parser(pBuffer, bufLen);
     
+    PROFILE(PROF_PES);
+
     bool     done      = false;
     uint32_t startCode = 0;
     uint16_t len       = 0;
@@ -360,7 +449,8 @@ bool TiVoDecoderTsStream::getPesHdrLength(uint8_t *pBuffer, uint16_t bufLen)
             pesHdrLengths.push_back(len);
         }
     }
-    
+
+    picture = parser.info;
     return true;
 }
 
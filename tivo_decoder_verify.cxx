@@ -0,0 +1,171 @@
+/*
+ * tivodecode-ng
+ * Copyright 2006-2015, Jeremy Drake et al.
+ * See COPYING file for license terms
+ */
+#ifdef HAVE_CONFIG_H
+#include "tdconfig.h"
+#endif
+
+#include <cstdio>
+#include <cstring>
+
+#include "tivo_decoder_ts.hxx"
+#include "tivo_decoder_verify.hxx"
+
+// bytes compared at a time, whole TS packets
+#define VERIFY_BLOCK_SIZE   (TS_FRAME_SIZE * 4096)
+
+TiVoDecoderVerify::TiVoDecoderVerify(int formatType)
+{
+    format  = formatType;
+    pRefOut = NULL;
+    blocks.assign(TS_PID_COUNT, -1);
+}
+
+void TiVoDecoderVerify::block(uint16_t id, int block_no)
+{
+    if (blocks[id] == block_no)
+        return;
+
+    TiVoBlockMark mark;
+
+    mark.offset = pRefOut ? pRefOut->written() : 0;
+    mark.id     = id;
+    mark.block  = block_no;
+
+    marks.push_back(mark);
+    blocks[id] = block_no;
+}
+
+// The block the stream was in at an output offset, or -1 for none.
+int TiVoDecoderVerify::blockAt(uint16_t id, hoff_t offset)
+{
+    int block_no = -1;
+
+    for (size_t i = 0; (i < marks.size()) && (marks[i].offset <= offset); i++)
+    {
+        if (marks[i].id == id)
+            block_no = marks[i].block;
+    }
+
+    return block_no;
+}
+
+static void print_bytes(const char *label, uint8_t *pData, size_t len)
+{
+    std::fprintf(stderr, "  %-10s:", label);
+    for (size_t i = 0; i < len; i++)
+        std::fprintf(stderr, " %02x", pData[i]);
+    std::fprintf(stderr, "\n");
+}
+
+/*
+ * Read both outputs from the start and report the first byte at which
+ * they differ.  Returns true if they are identical.
+ */
+bool TiVoDecoderVerify::compare(HappyFile *pRef, HappyFile *pFast)
+{
+    uint8_t *pRefData  = new uint8_t[VERIFY_BLOCK_SIZE];
+    uint8_t *pFastData = new uint8_t[VERIFY_BLOCK_SIZE];
+    hoff_t   offset    = 0;
+    uint64_t chunk     = 0;
+    uint32_t marker    = 0xFFFFFFFF;
+    int      psStream  = -1;
+    bool     same      = true;
+
+    while (1)
+    {
+        size_t refLen  = pRef->read(pRefData, VERIFY_BLOCK_SIZE);
+        size_t fastLen = pFast->read(pFastData, VERIFY_BLOCK_SIZE);
+        size_t len     = (refLen < fastLen) ? refLen : fastLen;
+        size_t diff    = 0;
+
+        if ((refLen == fastLen) && !std::memcmp(pRefData, pFastData, len))
+            diff = len;
+        else
+        {
+            while ((diff < len) && (pRefData[diff] == pFastData[diff]))
+                diff++;
+        }
+
+        // the PS stream is the last PES start code before the difference
+        if (TIVO_FORMAT_PS == format)
+        {
+            for (size_t i = 0; i < diff; i++)
+            {
+                marker = (marker << 8) | pRefData[i];
+                if (((marker & 0xFFFFFF00) == 0x100) && (pRefData[i] >= 0xBD))
+                    psStream = pRefData[i];
+            }
+        }
+
+        if ((diff == len) && (refLen == fastLen))
+        {
+            offset += len;
+            chunk++;
+
+            if (0 == len)
+                break;
+            continue;
+        }
+
+        same = false;
+        offset += diff;
+
+        std::fprintf(stderr, "verify: output differs from the reference at "
+                     "byte %lld (compare block %llu)\n", (long long)offset,
+                     (unsigned long long)chunk);
+
+        if (diff == len)
+        {
+            std::fprintf(stderr, "verify: output is %s than the "
+                         "reference\n", (fastLen < refLen) ? "shorter" :
+                         "longer");
+            break;
+        }
+
+        int id = -1;
+
+        if (TIVO_FORMAT_TS == format)
+        {
+            size_t pkt = diff - diff % TS_FRAME_SIZE;
+
+            id = portable_ntohs(&pRefData[pkt + 1]) & 0x1FFF;
+            std::fprintf(stderr, "verify: TS packet %lld, byte %d, "
+                         "PID 0x%04x", (long long)(offset / TS_FRAME_SIZE),
+                         (int)(diff % TS_FRAME_SIZE), id);
+        }
+        else
+        {
+            id = psStream;
+            std::fprintf(stderr, "verify: PS stream 0x%02x", id);
+        }
+
+        int block_no = (id >= 0) ? blockAt(id, offset) : -1;
+
+        if (block_no >= 0)
+            std::fprintf(stderr, ", cipher block %d\n", block_no);
+        else
+            std::fprintf(stderr, ", not in a cipher block\n");
+
+        size_t show = len - diff;
+        if (show > 16)
+            show = 16;
+
+        print_bytes("reference", pRefData + diff, show);
+        print_bytes("output", pFastData + diff, show);
+        break;
+    }
+
+    if (true == same)
+        std::fprintf(stderr, "verify: %lld bytes match the reference\n",
+                     (long long)offset);
+
+    delete [] pRefData;
+    delete [] pFastData;
+
+    return same;
+}
+
+/* vi:set ai ts=4 sw=4 expandtab: */
@@ -0,0 +1,55 @@
+/*
+ * tivodecode-ng
+ * Copyright 2006-2015, Jeremy Drake et al.
+ * See COPYING file for license terms
+ */
+
+#ifndef TIVO_DECODER_VERIFY_HXX_
+#define TIVO_DECODER_VERIFY_HXX_
+
+#ifdef HAVE_CONFIG_H
+#include "tdconfig.h"
+#endif
+
+#include <cstdio>
+#include <vector>
+
+#include "happyfile.hxx"
+#include "tivo_parse.hxx"
+
+// output offset from which a stream used a cipher block
+typedef struct
+{
+    hoff_t   offset;
+    uint16_t id;
+    int      block;
+} TiVoBlockMark;
+
+/*
+ * --verify-against-reference: the reference decoder (one thread, the
+ * plain sequential process()) notes where each stream changes cipher
+ * block, then compare() reads its output beside the selected path's
+ * and reports the first difference with the stream and block it fell in.
+ */
+class TiVoDecoderVerify
+{
+    private:
+        std::vector<TiVoBlockMark> marks;
+        std::vector<int>           blocks;
+        int                        format;
+
+        int  blockAt(uint16_t id, hoff_t offset);
+
+    public:
+        // the reference decoder's output, for the block marks
+        HappyFile *pRefOut;
+
+        void block(uint16_t id, int block_no);
+        bool compare(HappyFile *pRef, HappyFile *pFast);
+
+        TiVoDecoderVerify(int formatType);
+};
+
+#endif /* TIVO_DECODER_VERIFY_HXX_ */
+
+/* vi:set ai ts=4 sw=4 expandtab: */
@@ -14,7 +14,21 @@
 #include "tivo_parse.hxx"
 
 int o_verbose;
-bool o_pkt_dump;
+thread_local int o_log_level;
+
+bool log_limited(std::atomic<uint32_t> *pCount)
+{
+    uint32_t count = ++(*pCount);
+
+    if (count <= LOG_LIMIT_BURST)
+        return true;
+
+    if (count % LOG_LIMIT_EVERY)
+        return false;
+
+    std::fprintf(stderr, "[%u times] ", count);
+    return true;
+}
 
 uint32_t portable_ntohl(uint8_t *pVal)
 {
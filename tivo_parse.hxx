@@ -5,6 +5,8 @@
 #include "tdconfig.h"
 #endif
 
+#include <atomic>
+
 #include "happyfile.hxx"
 #include "Turing.hxx"
 #include "turing_stream.hxx"
@@ -14,17 +16,47 @@ extern uint32_t portable_ntohl(uint8_t *pVal);
 
 #define static_strlen(str) (sizeof(str) - 1)
 
+/*
+ * LOG_LEVEL_MAX is the most verbose level compiled in; checks and
+ * messages above it are removed entirely.  Build with
+ * CPPFLAGS=-DLOG_LEVEL_MAX=0 for a release build without any of them.
+ */
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX  3
+#endif
+
+// the level set with -v, and the level in effect on this thread: a
+// decoder sets it from its own verbose setting, and raises it to
+// LOG_LEVEL_MAX while a packet selected with --pkt-dump is handled
 extern int  o_verbose;
-extern bool o_pkt_dump;
+extern thread_local int o_log_level;
+
+#define LOG_ENABLED(n) ( (LOG_LEVEL_MAX >= (n)) && \
+                         __builtin_expect(o_log_level >= (n), 0) )
 
-#define IS_VERBOSE     ( (o_pkt_dump) || (o_verbose >= 1) )
-#define IS_VVERBOSE    ( (o_pkt_dump) || (o_verbose >= 2) )
-#define IS_VVVERBOSE   ( (o_pkt_dump) || (o_verbose >= 3) )
+#define IS_VERBOSE     LOG_ENABLED(1)
+#define IS_VVERBOSE    LOG_ENABLED(2)
+#define IS_VVVERBOSE   LOG_ENABLED(3)
 
 #define VERBOSE(...)   if (IS_VERBOSE)   { std::fprintf(stderr, __VA_ARGS__); }
 #define VVERBOSE(...)  if (IS_VVERBOSE)  { std::fprintf(stderr, __VA_ARGS__); }
 #define VVVERBOSE(...) if (IS_VVVERBOSE) { std::fprintf(stderr, __VA_ARGS__); }
 
+/*
+ * Errors which can repeat for every packet of a damaged file are rate
+ * limited per call site: the first LOG_LIMIT_BURST are reported, then one
+ * in every LOG_LIMIT_EVERY, with the running count.
+ */
+#define LOG_LIMIT_BURST  10
+#define LOG_LIMIT_EVERY  1000
+
+extern bool log_limited(std::atomic<uint32_t> *pCount);
+
+#define ERROR_LIMITED(...)  { static std::atomic<uint32_t> logCount(0); \
+    if (log_limited(&logCount)) { std::fprintf(stderr, __VA_ARGS__); } }
+#define PERROR_LIMITED(str) { static std::atomic<uint32_t> logCount(0); \
+    if (log_limited(&logCount)) { std::perror(str); } }
+
 /*
  * Initial header formats lifted from ezrec's posting:
  * http://www.dealdatabase.com/forum/showthread.php?t=41132
@@ -0,0 +1,44 @@
+/*
+ * tivodecode-ng
+ * Copyright 2006-2015, Jeremy Drake et al.
+ * See COPYING file for license terms
+ */
+
+#ifndef TIVO_PROBES_HXX_
+#define TIVO_PROBES_HXX_
+
+/*
+ * USDT static probes, provider "tivodecode".  Where <sys/sdt.h> is
+ * available each probe is a single nop plus an ELF note describing its
+ * arguments, which perf, bpftrace or SystemTap patch in when attached,
+ * e.g.
+ *
+ *     bpftrace -e 'usdt:./tivodecode:tivodecode:block { @[arg0] = count(); }'
+ *
+ * Without the header, or with -DNO_PROBES, they compile to nothing and
+ * their arguments are not evaluated.
+ *
+ *   packet  (pid or stream id, file offset)
+ *   pes     (pid or stream id, TS packet number or PS file offset)
+ *   block   (stream id, block number)
+ *   key     (pid, pointer to the 16 byte key)
+ *   flush   (pid, packets flushed)
+ *   write   (bytes, bytes written before this)
+ */
+
+#if !defined(NO_PROBES) && defined(__has_include)
+# if __has_include(<sys/sdt.h>)
+#  include <sys/sdt.h>
+#  define TD_HAVE_PROBES 1
+# endif
+#endif
+
+#ifdef TD_HAVE_PROBES
+# define TD_PROBE(name, a, b)   DTRACE_PROBE2(tivodecode, name, a, b)
+#else
+# define TD_PROBE(name, a, b)   do { } while (0)
+#endif
+
+#endif /* TIVO_PROBES_HXX_ */
+
+/* vi:set ai ts=4 sw=4 expandtab: */
@@ -0,0 +1,192 @@
+/*
+ * tivodecode-ng
+ * Copyright 2006-2015, Jeremy Drake et al.
+ * See COPYING file for license terms
+ */
+#ifdef HAVE_CONFIG_H
+#include "tdconfig.h"
+#endif
+
+#include <cstdio>
+#include <cstring>
+
+#include "tivo_parse.hxx"
+#include "tivo_decoder_ts.hxx"
+#include "tivo_decoder_ps.hxx"
+#include "tivo_stream_decoder.hxx"
+
+TiVoStreamDecoder::TiVoStreamDecoder(const char *pMak,
+                                     TiVoStreamOutput pOutput,
+                                     void *pContext)
+{
+    std::memset(&turing, 0, sizeof(turing));
+    std::memset(mak, 0, sizeof(mak));
+    std::strncpy(mak, pMak, 11);
+
+    pIn = new HappyFile;
+    pIn->attachQueue();
+
+    pOut = new HappyFile;
+    if (pOutput)
+        pOut->attachSink(pOutput, pContext);
+    else
+        pOut->attachQueue();
+
+    pDecoder   = NULL;
+    state      = TIVO_STREAM_HEADER;
+    haveHeader = false;
+    verbose    = 0;
+    noVerify   = false;
+}
+
+TiVoStreamDecoder::~TiVoStreamDecoder()
+{
+    delete pDecoder;
+    turing.destruct();
+
+    delete pIn;
+    delete pOut;
+}
+
+TiVoFormatType TiVoStreamDecoder::getFormatType()
+{
+    return haveHeader ? header.getFormatType() : TIVO_FORMAT_NONE;
+}
+
+/*
+ * Once the header and metadata chunks are all in, key the cipher and set
+ * up the decoder for the format.  False if there is not enough input yet.
+ */
+bool TiVoStreamDecoder::begin()
+{
+    if (false == haveHeader)
+    {
+        if (pIn->starved(header.size()))
+            return false;
+
+        if (false == header.read(pIn))
+        {
+            state = TIVO_STREAM_FAILED;
+            return false;
+        }
+
+        haveHeader = true;
+    }
+
+    if (pIn->starved(header.mpeg_offset - pIn->tell()))
+        return false;
+
+    for (int32_t i = 0; i < header.chunks; i++)
+    {
+        TiVoStreamChunk chunk;
+
+        if (false == chunk.read(pIn))
+        {
+            state = TIVO_STREAM_FAILED;
+            return false;
+        }
+
+        // the encrypted chunks only hold metadata
+        if (TIVO_CHUNK_PLAINTEXT_XML == chunk.type)
+            chunk.setupTuringKey(&turing, (uint8_t *)mak);
+    }
+
+    if ((pIn->tell() > header.mpeg_offset) ||
+        (pIn->seek(header.mpeg_offset) < 0))
+    {
+        std::perror("Error reading header");
+        state = TIVO_STREAM_FAILED;
+        return false;
+    }
+
+    switch (header.getFormatType())
+    {
+        case TIVO_FORMAT_PS:
+            pDecoder = new TiVoDecoderPS(&turing, pIn, pOut);
+            break;
+
+        case TIVO_FORMAT_TS:
+            pDecoder = new TiVoDecoderTS(&turing, pIn, pOut);
+            break;
+
+        default:
+            std::fprintf(stderr, "Unknown TiVo format\n");
+            state = TIVO_STREAM_FAILED;
+            return false;
+    }
+
+    pDecoder->verbose  = verbose;
+    pDecoder->noVerify = noVerify;
+
+    state = TIVO_STREAM_DECODE;
+    return true;
+}
+
+// Decode as far as the input queued allows.
+bool TiVoStreamDecoder::run()
+{
+    if ((TIVO_STREAM_HEADER == state) && (false == begin()))
+        return (TIVO_STREAM_FAILED != state);
+
+    if (TIVO_STREAM_DECODE != state)
+        return (TIVO_STREAM_FAILED != state);
+
+    if (false == pDecoder->process())
+    {
+        state = TIVO_STREAM_FAILED;
+        return false;
+    }
+
+    if (false == pDecoder->running)
+    {
+        state = TIVO_STREAM_DONE;
+        pOut->finish();
+    }
+
+    return true;
+}
+
+/*
+ * Queue size bytes of input and decode what can be.  False once the
+ * decode has failed.
+ */
+bool TiVoStreamDecoder::push(const void *pData, size_t size)
+{
+    if (TIVO_STREAM_FAILED == state)
+        return false;
+
+    if (TIVO_STREAM_DONE == state)
+        return true;
+
+    pIn->feed(pData, size);
+    return run();
+}
+
+// The input is complete; decode the rest of it.
+bool TiVoStreamDecoder::finish()
+{
+    pIn->finish();
+
+    if (false == run())
+        return false;
+
+    if (TIVO_STREAM_DONE != state)
+    {
+        std::fprintf(stderr, "TiVo stream decode incomplete\n");
+        state = TIVO_STREAM_FAILED;
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Without an output callback, take up to size bytes of the output decoded
+ * so far.  Returns the number of bytes copied.
+ */
+size_t TiVoStreamDecoder::pull(void *pData, size_t size)
+{
+    return pOut->read(pData, size);
+}
+
+/* vi:set ai ts=4 sw=4 expandtab: */
@@ -0,0 +1,76 @@
+/*
+ * tivodecode-ng
+ * Copyright 2006-2015, Jeremy Drake et al.
+ * See COPYING file for license terms
+ */
+
+#ifndef TIVO_STREAM_DECODER_HXX_
+#define TIVO_STREAM_DECODER_HXX_
+
+#ifdef HAVE_CONFIG_H
+#include "tdconfig.h"
+#endif
+
+#include <cstdio>
+
+#include "happyfile.hxx"
+#include "tivo_parse.hxx"
+
+class TiVoDecoder;
+
+// receives each span of decoded output, valid only during the call
+typedef HappyFileSink TiVoStreamOutput;
+
+typedef enum
+{
+    TIVO_STREAM_HEADER,         // waiting for the header and metadata
+    TIVO_STREAM_DECODE,         // decoding as input arrives
+    TIVO_STREAM_DONE,           // finished, all output delivered
+    TIVO_STREAM_FAILED
+}
+TiVoStreamState;
+
+/*
+ * Decode a .TiVo stream held in memory, as it arrives: push() hands over
+ * the input in pieces of any size, and the decoded MPEG is passed to the
+ * output callback as soon as it is decoded, or without a callback kept
+ * for pull().  finish() marks the end of the input and decodes the rest.
+ *
+ * Each object is a separate decode with its own state, so any number may
+ * run in one process, each used from one thread at a time.
+ */
+class TiVoStreamDecoder
+{
+    private:
+        HappyFile        *pIn;
+        HappyFile        *pOut;
+        TuringState       turing;
+        TiVoStreamHeader  header;
+        TiVoDecoder      *pDecoder;
+        TiVoStreamState   state;
+        bool              haveHeader;
+        char              mak[12];
+
+        bool begin();
+        bool run();
+
+    public:
+        // set before the first push()
+        int  verbose;
+        bool noVerify;
+
+        bool   push(const void *pData, size_t size);
+        bool   finish();
+        size_t pull(void *pData, size_t size);
+
+        TiVoStreamState getState() { return state; }
+        TiVoFormatType  getFormatType();
+
+        TiVoStreamDecoder(const char *pMak, TiVoStreamOutput pOutput = NULL,
+                          void *pContext = NULL);
+        ~TiVoStreamDecoder();
+};
+
+#endif /* TIVO_STREAM_DECODER_HXX_ */
+
+/* vi:set ai ts=4 sw=4 expandtab: */
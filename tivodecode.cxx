@@ -9,20 +9,72 @@
 #include "tdconfig.h"
 #endif
 
+#include <algorithm>
+#include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
 #include <libgen.h>
+#include <string>
+#include <thread>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "getopt_long.h"
 
 #include "cli_common.hxx"
+#include "profiler.hxx"
+#include "tivo_batch.hxx"
 #include "tivo_parse.hxx"
 #include "tivo_decoder_ts.hxx"
 #include "tivo_decoder_ps.hxx"
+#include "tivo_decoder_frames.hxx"
+#include "tivo_decoder_captions.hxx"
+#include "tivo_decoder_stats.hxx"
+#include "tivo_decoder_verify.hxx"
+#include "tivo_decoder_index.hxx"
+#include "tivo_decoder_demux.hxx"
+#include "tivo_decoder_segments.hxx"
 
-int o_no_verify;
+// settings from the command line which each decoder takes a copy of
+typedef struct
+{
+    int       verbose;
+    bool      noVerify;
+    TsPktDump pktDump;
+    bool      iframesOnly;
+
+    // --pids and --streams, when selecting is set
+    bool              selecting;
+    TiVoDecoderSelect select;
+
+    // --start and --end as input offsets at sync points, -1 for none
+    hoff_t    start;
+    hoff_t    end;
+} TiVoDecodeOptions;
+
+// what the metadata says about the recording, for --output-template
+typedef struct
+{
+    std::string name;           // made from the fields below
+    std::string title;
+    std::string seriesTitle;
+    std::string episodeTitle;
+    int         seasonNumber;
+    int         episodeNumber;
+    int         movieYear;
+} TiVoShowInfo;
+
+// --batch settings every worker shares
+typedef struct
+{
+    char                    *mak;
+    const TiVoDecodeOptions *pOptions;
+    const char              *tmpl;
+    const char              *outdir;
+    int                      threads;
+} TiVoBatchArgs;
 
 static struct option long_options[] = {
     {"mak", 1, 0, 'm'},
@@ -32,6 +84,31 @@ static struct option long_options[] = {
     {"metadata", 0, 0, 'D'},
     {"no-verify", 0, 0, 'n'},
     {"no-video", 0, 0, 'x'},
+    {"threads", 1, 0, 't'},
+    {"shard", 1, 0, 's'},
+    {"profile", 2, 0, 'P'},
+    {"profile-counters", 0, 0, 'C'},
+    {"stats", 2, 0, 'S'},
+    {"stats-fd", 1, 0, 'F'},
+    {"verify-against-reference", 0, 0, 'R'},
+    {"batch", 0, 0, 'B'},
+    {"jobs", 1, 0, 'j'},
+    {"output-template", 1, 0, 'O'},
+    {"write-index", 0, 0, 'W'},
+    {"range", 1, 0, 'r'},
+    {"index", 1, 0, 'i'},
+    {"keyframes", 1, 0, 'K'},
+    {"captions", 1, 0, 'Y'},
+    {"iframes", 0, 0, 'I'},
+    {"checkpoint", 2, 0, 'c'},
+    {"resume", 0, 0, 'u'},
+    {"follow", 2, 0, 'f'},
+    {"pids", 1, 0, 'L'},
+    {"streams", 1, 0, 'T'},
+    {"demux", 2, 0, 'X'},
+    {"segment-duration", 1, 0, 'G'},
+    {"start", 1, 0, 'a'},
+    {"end", 1, 0, 'e'},
     {"version", 0, 0, 'V'},
     {"help", 0, 0, 'h'},
     {0, 0, 0, 0}
@@ -40,15 +117,91 @@ static struct option long_options[] = {
 static void do_help(const char *arg0, int exitval)
 {
     std::cerr << "Usage: " << arg0 << " [--help] [--verbose|-v] "
-        "[--no-verify|-n] [--pkt-dump|-p] pkt_num {--mak|-m} mak "
-        "[--metadata|-D] [{--out|-o} outfile] <tivofile>\n\n"
+        "[--no-verify|-n] [--pkt-dump|-p] pkt_num[-pkt_num] [--threads|-t] num "
+        "[--shard|-s] i/N [--profile[=jsonfile]] [--profile-counters] "
+        "[--stats[=seconds]] [--stats-fd fd] [--verify-against-reference] "
+        "[--batch] [--jobs|-j num] [--output-template|-O template] "
+        "[--write-index] [--range start:end] [--index indexfile] "
+        "[--keyframes file] [--captions file] [--iframes] [--start pos] "
+        "[--end pos] "
+        "[--checkpoint[=seconds]] [--resume] [--follow[=seconds]] "
+        "[--pids list] [--streams list] [--demux[=pes]] "
+        "[--segment-duration seconds] "
+        "{--mak|-m} mak [--metadata|-D] [{--out|-o} outfile] "
+        "<tivofile>...\n\n"
         " -m, --mak         media access key (required)\n"
         " -o, --out,        output file (see notes for default)\n"
         " -v, --verbose,    verbose\n"
-        " -p, --pkt-dump,   verbose logging for specific TS packet number\n"
+        " -p, --pkt-dump,   verbose logging for specific TS packet number, or\n"
+        "                   an inclusive range of them; may be repeated\n"
         " -D, --metadata,   dump TiVo recording metadata\n"
         " -n, --no-verify,  do not verify MAK while decoding\n"
         " -x, --no-video,   don't decode video, exit after metadata\n"
+        " -t, --threads,    decrypt transport streams on num threads\n"
+        "                   (0 for one per core, default 1)\n"
+        " -s, --shard,      decode only part i of N (1 <= i <= N); the parts\n"
+        "                   concatenate to the full output\n"
+        "     --profile,    time each decode stage and print a table at exit,\n"
+        "                   with JSON to stderr or to jsonfile\n"
+        "     --profile-counters\n"
+        "                   add CPU cycles and cache misses per stage\n"
+        "     --stats,      report throughput and per stream counters to\n"
+        "                   stderr every few seconds (default 1)\n"
+        "     --stats-fd,   write the reports to fd instead, as JSON lines\n"
+        "     --verify-against-reference\n"
+        "                   decode again on one thread and compare the output,\n"
+        "                   reporting the first difference\n"
+        "     --batch,      decode every tivofile named, every .TiVo file in a\n"
+        "                   directory named, and every file listed one per\n"
+        "                   line in @listfile (@- for stdin); -o names the\n"
+        "                   output directory\n"
+        " -j, --jobs,       files to decode at once with --batch (default one\n"
+        "                   per core, or per --threads cores, and one per\n"
+        "                   spinning disk)\n"
+        " -O, --output-template\n"
+        "                   name the output from the metadata: %N the default\n"
+        "                   name, %t title, %s series, %e episode title,\n"
+        "                   %S season, %E episode, %y year, %b the tivofile\n"
+        "                   name, %x the extension, %% a % (default %N.%x)\n"
+        "     --write-index\n"
+        "                   save seek points to the index file as the output\n"
+        "                   is decoded (on one thread)\n"
+        "     --range,      decode only output bytes start up to end (or to\n"
+        "                   the end of file, if left out), from the nearest\n"
+        "                   seek point of the index file\n"
+        "     --index,      the index file (default <tivofile>.tdidx)\n"
+        "     --keyframes,  write the output offset, PTS and DTS of each I\n"
+        "                   frame and GOP start to file, as CSV if it ends\n"
+        "                   in .csv (on one thread)\n"
+        "     --captions,   write the ATSC closed caption data of the video\n"
+        "                   to file, as SCC if it ends in .scc, otherwise\n"
+        "                   raw cc_data with each picture's PTS (on one\n"
+        "                   thread)\n"
+        "     --iframes,    write only the I frames of the video, leaving out\n"
+        "                   audio and other pictures, for trick play\n"
+        "     --start,      decode from input offset pos, or from pos seconds\n"
+        "                   into the recording if it ends in s or is h:mm:ss\n"
+        "     --end,        stop decoding at input offset or time pos\n"
+        "     --checkpoint, save the decode state beside the output, as\n"
+        "                   outfile.tdckpt, every few seconds (default 10;\n"
+        "                   on one thread)\n"
+        "     --resume,     go on from the outfile.tdckpt of a decode that\n"
+        "                   was stopped, or of an input that has grown\n"
+        "     --follow,     decode a recording still being written, waiting\n"
+        "                   at the end for more until it has not grown for\n"
+        "                   seconds (default 30; on one thread)\n"
+        "     --pids,       write only the TS PIDs listed (with the PAT and\n"
+        "                   PMT), as in 0x1011,0x1100\n"
+        "     --streams,    write only these kinds of stream: video, audio,\n"
+        "                   data (TiVo private data and the rest), or PS\n"
+        "                   stream ids such as e0,c0\n"
+        "     --demux,      write each stream's elementary stream to its own\n"
+        "                   file, outfile.<PID or stream id>.m2v/.264/.ac3/\n"
+        "                   .mp2, or with =pes its PES packets to .pes\n"
+        "     --segment-duration\n"
+        "                   cut the output into files outfile-00000.ts ...\n"
+        "                   of about seconds each, at I pictures, listed\n"
+        "                   in the HLS playlist outfile.m3u8 (on one thread)\n"
         " -V, --version,    print the version information and exit\n"
         " -h, --help,       print this help and exit\n"
         "\n"
@@ -59,6 +212,539 @@ static void do_help(const char *arg0, int exitval)
         "\n";
     std::exit(exitval);
 }
+
+/*
+ * Point pDecoder at the input from start up to end (-1 for the end of
+ * file), both sync points in the stream starting at mpeg_offset, replaying
+ * lookback bytes ahead of start to recover the decoder state.  Returns
+ * true if a larger lookback is still possible.
+ */
+static bool select_range(TiVoDecoder *pDecoder, HappyFile *hfh,
+                         hoff_t mpeg_offset, hoff_t start, hoff_t end,
+                         hoff_t lookback)
+{
+    hoff_t begin = mpeg_offset;
+
+    if (start - lookback > mpeg_offset)
+    {
+        begin = pDecoder->findSync(start - lookback);
+        if ((begin < 0) || (begin > start))
+            begin = start;
+    }
+
+    VERBOSE("Range : %lld - %lld, replay from %lld\n", (long long)start,
+            (long long)end, (long long)begin);
+
+    hfh->seek(begin);
+    pDecoder->setRange(start, end, begin == mpeg_offset);
+
+    return (begin > mpeg_offset) ? true : false;
+}
+
+/*
+ * Point pDecoder at part index of count of the stream starting at
+ * mpeg_offset, replaying lookback bytes ahead of it to recover the decoder
+ * state.  Returns true if a larger lookback is still possible.
+ */
+static bool select_shard(TiVoDecoder *pDecoder, HappyFile *hfh,
+                         hoff_t mpeg_offset, int index, int count,
+                         hoff_t lookback)
+{
+    hoff_t length = hfh->size() - mpeg_offset;
+    hoff_t start  = mpeg_offset;
+    hoff_t end    = -1;
+
+    if (index > 1)
+    {
+        start = pDecoder->findSync(mpeg_offset +
+                                   length * (index - 1) / count);
+        if (start < 0)
+            start = mpeg_offset + length;
+    }
+
+    if (index < count)
+        end = pDecoder->findSync(mpeg_offset + length * index / count);
+
+    VERBOSE("Shard %d/%d\n", index, count);
+
+    return select_range(pDecoder, hfh, mpeg_offset, start, end, lookback);
+}
+
+// time_offset() found no video PTS to go by
+#define NO_PTS          (-2)
+
+// seconds between two PTS, across a wrap, negative if b comes first
+static double pts_seconds(int64_t a, int64_t b)
+{
+    const int64_t wrap = 1LL << 33;
+    int64_t diff = (((b - a) % wrap) + wrap) % wrap;
+
+    if (diff > wrap / 2)
+        diff -= wrap;
+
+    return diff / 90000.0;
+}
+
+/*
+ * The input offset of the first video PES at least seconds into the
+ * stream starting at mpeg_offset, by its PTS: a bisection over the input
+ * down to RANGE_LOOKBACK, then a walk forward.  -1 if there is none, or
+ * NO_PTS if the video has no PTS.
+ */
+static hoff_t time_offset(TiVoDecoder *pDecoder, HappyFile *hfh,
+                          hoff_t mpeg_offset, double seconds)
+{
+    hoff_t  at    = -1;
+    int64_t first = pDecoder->findPts(mpeg_offset, &at);
+    hoff_t  lo    = mpeg_offset;
+    hoff_t  hi    = hfh->size();
+
+    if (first < 0)
+        return NO_PTS;
+
+    if (seconds <= 0)
+        return mpeg_offset;
+
+    while (hi - lo > RANGE_LOOKBACK)
+    {
+        hoff_t  mid = lo + (hi - lo) / 2;
+        int64_t pts = pDecoder->findPts(mid, &at);
+
+        if ((pts >= 0) && (pts_seconds(first, pts) < seconds))
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    for (hoff_t pos = lo; ; pos = at + 1)
+    {
+        int64_t pts = pDecoder->findPts(pos, &at);
+
+        if (pts < 0)
+            return -1;
+
+        if (pts_seconds(first, pts) >= seconds)
+            return at;
+    }
+}
+
+/*
+ * Add a --pids or --streams list to *pSelect: TS PIDs, or video, audio,
+ * data and PS stream ids in hex.  Returns false if an item is neither.
+ */
+static bool parse_select(const char *arg, bool pids,
+                         TiVoDecoderSelect *pSelect)
+{
+    std::string list(arg);
+    size_t at = 0;
+
+    while (at <= list.size())
+    {
+        size_t comma = list.find(',', at);
+        if (comma == std::string::npos)
+            comma = list.size();
+
+        std::string item = list.substr(at, comma - at);
+        at = comma + 1;
+
+        if (!pids && (item == "video"))
+            pSelect->kinds |= SELECT_VIDEO;
+        else if (!pids && (item == "audio"))
+            pSelect->kinds |= SELECT_AUDIO;
+        else if (!pids && (item == "data"))
+            pSelect->kinds |= SELECT_DATA;
+        else
+        {
+            char *end = NULL;
+            long val = std::strtol(item.c_str(), &end, pids ? 0 : 16);
+
+            if (item.empty() || *end || (val < 0) ||
+                (val > (pids ? 0x1FFE : 0xFF)))
+                return false;
+
+            if (pids)
+                pSelect->pids.insert((uint16_t)val);
+            else
+                pSelect->codes.insert((uint8_t)val);
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Parse a --start or --end: an input offset, or seconds if it ends in s
+ * (90s, 1.5s) or is written h:mm:ss or m:ss.  Returns false if malformed.
+ */
+static bool parse_position(const char *arg, long long *pBytes,
+                           double *pSeconds)
+{
+    double parts[3];
+    char   unit = 0;
+    int    count;
+
+    *pBytes   = -1;
+    *pSeconds = -1;
+
+    if (std::strchr(arg, ':'))
+    {
+        double seconds = 0;
+        char   extra;
+
+        count = std::sscanf(arg, "%lf:%lf:%lf%c", &parts[0], &parts[1],
+                            &parts[2], &extra);
+        if ((count < 2) || (count > 3))
+            return false;
+
+        for (int i = 0; i < count; i++)
+        {
+            if (parts[i] < 0)
+                return false;
+            seconds = seconds * 60 + parts[i];
+        }
+
+        *pSeconds = seconds;
+        return true;
+    }
+
+    if ((std::sscanf(arg, "%lf%c%c", &parts[0], &unit, &unit) == 2) &&
+        (unit == 's') && (parts[0] >= 0))
+    {
+        *pSeconds = parts[0];
+        return true;
+    }
+
+    return (std::sscanf(arg, "%lld%c", pBytes, &unit) == 1) &&
+           (*pBytes >= 0);
+}
+
+/*
+ * Turn --start or --end into an input offset at a sync point: the first
+ * at or after a byte offset, or where the video reaches a time.  -1 if
+ * that is past the end of the recording.
+ */
+static hoff_t find_position(TiVoDecoder *pDecoder, HappyFile *hfh,
+                            hoff_t mpeg_offset, long long bytes,
+                            double seconds)
+{
+    if (bytes >= 0)
+        return pDecoder->findSync(std::max((hoff_t)bytes, mpeg_offset));
+
+    return time_offset(pDecoder, hfh, mpeg_offset, seconds);
+}
+
+// The decoder gave up; errno says why only if a call failed.
+static void process_failed()
+{
+    if (errno)
+        std::perror("Failed to process file");
+    else
+        std::fprintf(stderr, "Failed to process file\n");
+}
+
+static TiVoDecoder *new_decoder(TiVoStreamHeader *pHeader,
+                                TuringState *pTuring, HappyFile *hfh,
+                                HappyFile *ofh,
+                                const TiVoDecodeOptions *pOptions,
+                                int threads)
+{
+    TiVoDecoder *pDecoder = NULL;
+    TiVoDecoderTS *pTsDecoder = NULL;
+
+    switch (pHeader->getFormatType())
+    {
+        case TIVO_FORMAT_PS:
+            pDecoder = new TiVoDecoderPS(pTuring, hfh, ofh);
+            break;
+
+        case TIVO_FORMAT_TS:
+            pTsDecoder = new TiVoDecoderTS(pTuring, hfh, ofh);
+            pTsDecoder->pktDump = pOptions->pktDump;
+            pDecoder = pTsDecoder;
+            break;
+    }
+
+    if (NULL == pDecoder)
+    {
+        std::perror("Unable to create TiVo Decoder");
+        return NULL;
+    }
+
+    pDecoder->verbose  = pOptions->verbose;
+    pDecoder->noVerify = pOptions->noVerify;
+    pDecoder->iframesOnly = pOptions->iframesOnly;
+    pDecoder->pSelect  = pOptions->selecting ? &pOptions->select : NULL;
+
+    if (pTsDecoder)
+        pTsDecoder->setThreads(threads);
+
+    return pDecoder;
+}
+
+/*
+ * Decode from the current input position to ofh on the given number of
+ * threads, replaying further back as needed for a shard.  An index read
+ * back for --resume goes on from its last point.
+ */
+static bool decode(TiVoStreamHeader *pHeader, TuringState *pTuring,
+                   HappyFile *hfh, HappyFile *ofh,
+                   const TiVoDecodeOptions *pOptions, int threads,
+                   int shard, int shards, TiVoDecoderStats *pStats,
+                   TiVoDecoderVerify *pVerify, TiVoDecoderIndex *pIndex,
+                   TiVoDecoderFrames *pFrames,
+                   TiVoDecoderCaptions *pCaptions,
+                   TiVoDecoderSegments *pSegments)
+{
+    TiVoDecoder *pDecoder = NULL;
+    hoff_t lookback = RANGE_LOOKBACK;
+
+    while (1)
+    {
+        bool retry = false;
+
+        pDecoder = new_decoder(pHeader, pTuring, hfh, ofh, pOptions, threads);
+        if (NULL == pDecoder)
+            return false;
+
+        if (shards > 1)
+            retry = select_shard(pDecoder, hfh, pHeader->mpeg_offset,
+                                 shard, shards, lookback);
+        else if ((pOptions->start > pHeader->mpeg_offset) ||
+                 (pOptions->end >= 0))
+            retry = select_range(pDecoder, hfh, pHeader->mpeg_offset,
+                                 std::max(pOptions->start,
+                                          (hoff_t)pHeader->mpeg_offset),
+                                 pOptions->end, lookback);
+
+        pDecoder->pStats  = pStats;
+        pDecoder->pVerify = pVerify;
+        pDecoder->pIndex  = pIndex;
+        pDecoder->pFrames = pFrames;
+        pDecoder->pCaptions = pCaptions;
+        pDecoder->pSegments = pSegments;
+
+        if (pIndex && !pIndex->points.empty() &&
+            (false == pDecoder->restore(pIndex, &pIndex->points.back())))
+        {
+            delete pDecoder;
+            return false;
+        }
+
+        bool done = false;
+        {
+            PROFILE(PROF_PARSE);
+            done = pDecoder->process();
+        }
+
+        if (true == done)
+            break;
+
+        if ((true == retry) && (true == pDecoder->needLookback))
+        {
+            // start over, replaying twice as much
+            delete pDecoder;
+            pTuring->reset();
+            lookback *= 2;
+            continue;
+        }
+
+        process_failed();
+        delete pDecoder;
+        return false;
+    }
+
+    delete pDecoder;
+    pTuring->reset();
+
+    return true;
+}
+
+/*
+ * Decode tivofile again on the reference path -- one thread, sequential
+ * process() -- and compare that with what was written to destfile.
+ */
+static bool verify_output(TiVoStreamHeader *pHeader, TuringState *pTuring,
+                          const TiVoDecodeOptions *pOptions,
+                          const char *tivofile, const char *destfile,
+                          int shard, int shards)
+{
+    TiVoDecoderVerify verify(pHeader->getFormatType());
+    HappyFile *hfh  = NULL;
+    HappyFile *rfh  = NULL;
+    HappyFile *ofh  = NULL;
+    bool       same = false;
+
+    char *refname = (char *)std::malloc(std::strlen(destfile) + 16);
+    std::sprintf(refname, "%s.ref-XXXXXX", destfile);
+
+    int fd = mkstemp(refname);
+    if (fd < 0)
+    {
+        std::perror("creating reference output");
+        goto done;
+    }
+    ::close(fd);
+
+    hfh = new HappyFile;
+    rfh = new HappyFile;
+    ofh = new HappyFile;
+
+    if (!hfh->open(tivofile, "rb"))
+    {
+        std::perror(tivofile);
+        ::unlink(refname);
+        goto done;
+    }
+
+    if (hfh->seek(pHeader->mpeg_offset) < 0)
+    {
+        std::perror(tivofile);
+        hfh->close();
+        ::unlink(refname);
+        goto done;
+    }
+
+    if (!rfh->open(refname, "wb"))
+    {
+        std::perror(refname);
+        hfh->close();
+        ::unlink(refname);
+        goto done;
+    }
+
+    std::fprintf(stderr, "verify: decoding again on the reference path\n");
+
+    verify.pRefOut = rfh;
+    same = decode(pHeader, pTuring, hfh, rfh, pOptions, 1, shard, shards,
+                  NULL, &verify, NULL, NULL, NULL, NULL);
+
+    hfh->close();
+    rfh->close();
+
+    if (true == same)
+    {
+        if (!rfh->open(refname, "rb"))
+        {
+            std::perror("reopening output for verify");
+            same = false;
+        }
+        else if (!ofh->open(destfile, "rb"))
+        {
+            std::perror("reopening output for verify");
+            rfh->close();
+            same = false;
+        }
+        else
+        {
+            same = verify.compare(rfh, ofh);
+
+            rfh->close();
+            ofh->close();
+        }
+    }
+
+    if (true == same)
+        ::unlink(refname);
+    else
+        std::fprintf(stderr, "verify: reference output kept in %s\n",
+                     refname);
+
+done:
+    delete hfh;
+    delete rfh;
+    delete ofh;
+    std::free(refname);
+
+    return same;
+}
+
+// where --range output goes: skip bytes are dropped, then left are kept
+typedef struct
+{
+    HappyFile *pOut;
+    hoff_t     skip;
+    hoff_t     left;            // -1 for all of the rest
+} TiVoRangeOutput;
+
+static void range_output(void *pContext, const void *ptr, size_t size)
+{
+    TiVoRangeOutput *pRange = (TiVoRangeOutput *)pContext;
+    char *pData = (char *)ptr;
+
+    if (pRange->skip >= (hoff_t)size)
+    {
+        pRange->skip -= size;
+        return;
+    }
+
+    pData += pRange->skip;
+    size  -= pRange->skip;
+    pRange->skip = 0;
+
+    if ((pRange->left >= 0) && ((hoff_t)size > pRange->left))
+        size = pRange->left;
+
+    if (size && (pRange->pOut->write(pData, size) != size))
+        PERROR_LIMITED("Writing range to output file");
+
+    if (pRange->left >= 0)
+        pRange->left -= size;
+}
+
+/*
+ * Decode only output bytes start up to end (-1 for the end of file): from
+ * the last seek point of pIndex at or before start, as far as the first
+ * one at or after end.
+ */
+static bool decode_range(TiVoStreamHeader *pHeader, TuringState *pTuring,
+                         HappyFile *hfh, HappyFile *ofh,
+                         const TiVoDecodeOptions *pOptions,
+                         TiVoDecoderIndex *pIndex, hoff_t start, hoff_t end)
+{
+    const TiVoIndexPoint *pFrom = pIndex->find(start);
+    const TiVoIndexPoint *pTo   = (end >= 0) ? pIndex->after(end) : NULL;
+    hoff_t from = pFrom ? pFrom->in : pHeader->mpeg_offset;
+
+    TiVoRangeOutput range;
+    range.pOut = ofh;
+    range.skip = start - (pFrom ? pFrom->out : 0);
+    range.left = (end >= 0) ? end - start : -1;
+
+    HappyFile *rfh = new HappyFile;
+    rfh->attachSink(range_output, &range);
+
+    TiVoDecoder *pDecoder = new_decoder(pHeader, pTuring, hfh, rfh, pOptions,
+                                        1);
+    if (NULL == pDecoder)
+        return false;
+
+    VERBOSE("Range : input %lld to %lld for output %lld to %lld\n",
+            (long long)from, pTo ? (long long)pTo->in : -1LL,
+            (long long)start, (long long)end);
+
+    bool done = (hfh->seek(from) >= 0);
+
+    if (done && pFrom)
+        done = pDecoder->restore(pIndex, pFrom);
+
+    if (done && pTo)
+        pDecoder->setRange(from, pTo->in, true);
+
+    if (done)
+    {
+        PROFILE(PROF_PARSE);
+        done = pDecoder->process();
+    }
+
+    if (false == done)
+        process_failed();
+
+    delete pDecoder;
+    pTuring->reset();
+    delete rfh;
+
+    return done;
+}
 
 
 const unsigned long hashTitle         = 0x0aebc065;
@@ -68,7 +754,7 @@ const unsigned long hashEpisodeNumber = 0xf1476d67;
 const unsigned long hashShowType      = 0x1eaac51e;
 const unsigned long hashMovieYear     = 0x34189552;
 
-char *parseMetadata(char *data)
+char *parseMetadata(char *data, TiVoShowInfo *pInfo = NULL)
 {
     char *p;
     char *t, tag[32];
@@ -173,30 +859,50 @@ char *parseMetadata(char *data)
         prev = *p++;
     }
 
-    if (isSeries)
+    if (pInfo)
     {
-        if (seriesTitle == NULL || episodeTitle == NULL)
-            return NULL;
+        pInfo->title         = title ? title : "";
+        pInfo->seriesTitle   = seriesTitle ? seriesTitle : "";
+        pInfo->episodeTitle  = episodeTitle ? episodeTitle : "";
+        pInfo->seasonNumber  = seasonNumber;
+        pInfo->episodeNumber = episodeNumber;
+        pInfo->movieYear     = movieYear;
+    }
 
-        if (seasonNumber == -1 && episodeNumber == -1)
-            std::snprintf(val, sizeof(val), "%s - %s", seriesTitle, episodeTitle);
-        else
-            std::snprintf(val, sizeof(val), "%s - S%02dE%02d - %s", seriesTitle, seasonNumber, episodeNumber, episodeTitle);
+    char *result = NULL;
+
+    if (isSeries)
+    {
+        if (seriesTitle != NULL && episodeTitle != NULL)
+        {
+            if (seasonNumber == -1 && episodeNumber == -1)
+                std::snprintf(val, sizeof(val), "%s - %s", seriesTitle, episodeTitle);
+            else
+                std::snprintf(val, sizeof(val), "%s - S%02dE%02d - %s", seriesTitle, seasonNumber, episodeNumber, episodeTitle);
+            result = strdup(val);
+        }
     }
     else
     {
-        if (title == NULL)
-            return NULL;
-
-        if (movieYear != -1)
-            std::snprintf(val, sizeof(val), "%s (%d)", title, movieYear);
-        else
-            std::snprintf(val, sizeof(val), "%s", title);
+        if (title != NULL)
+        {
+            if (movieYear != -1)
+                std::snprintf(val, sizeof(val), "%s (%d)", title, movieYear);
+            else
+                std::snprintf(val, sizeof(val), "%s", title);
+            result = strdup(val);
+        }
     }
-    return strdup(val);
+
+    // a batch parses many of these
+    std::free(title);
+    std::free(seriesTitle);
+    std::free(episodeTitle);
+
+    return result;
 }
 
-char *extract(char *data, int size)
+char *extract(char *data, int size, TiVoShowInfo *pInfo = NULL)
 {
     char *result,*buf,*strB,*strE;
     int   len;
@@ -223,45 +929,369 @@ char *extract(char *data, int size)
 
     std::fprintf(stderr,"metadata: \'%s\'\n",strB);
 
-    result = parseMetadata(strB);
+    result = parseMetadata(strB, pInfo);
 
     std::free(buf);
     return result;
 }
 
-
-int main(int argc, char *argv[])
+static const char *format_extension(TiVoFormatType format)
 {
-    int o_no_video = 0;
-    int o_dump_metadata = 0;
-    int makgiven = 0;
-    uint32_t pktDump = 0;
-
-    const char *tivofile   = NULL;
-          char *destfile   = NULL;
-          char *destpath   = NULL;
-          char *destbase   = NULL;
-
-    char mak[12];
-    std::memset(mak, 0, sizeof(mak));
-
-    TuringState turing;
-    std::memset(&turing, 0, sizeof(turing));
+    switch (format)
+    {
+    case TIVO_FORMAT_PS:
+        return "mpg";
+    case TIVO_FORMAT_TS:
+        return "ts";
+    default:
+        return "bin";
+    }
+}
 
+/*
+ * Read the header and metadata chunks from hfh and key pTuring for the
+ * MPEG stream; what the metadata says goes in pInfo.  With dumpPath, each
+ * chunk is also written to an xml file there, named after the recording,
+ * or dumpBase.  Returns 0, or the exit code for the failure.
+ */
+static int read_metadata(HappyFile *hfh, TiVoStreamHeader *pHeader,
+                         TuringState *pTuring, char *mak,
+                         TiVoShowInfo *pInfo, const char *dumpPath,
+                         const char *dumpBase)
+{
     TuringState metaturing;
     std::memset(&metaturing, 0, sizeof(metaturing));
     hoff_t current_meta_stream_pos = 0;
+    int rc = 0;
 
-    HappyFile *hfh = NULL, *ofh = NULL;
+    pInfo->name.clear();
+    pInfo->seasonNumber  = -1;
+    pInfo->episodeNumber = -1;
+    pInfo->movieYear     = -1;
 
-    TiVoStreamHeader header;
-    pktDumpMap.clear();
+    if (false == pHeader->read(hfh))
+        return 8;
 
-    while (1)
-    {
-        int c = getopt_long(argc, argv, "m:o:hnDxvVp:", long_options, 0);
+    pHeader->dump();
 
-        if (c == -1)
+    TiVoStreamChunk *pChunks = new TiVoStreamChunk[pHeader->chunks];
+    if (NULL == pChunks)
+    {
+        std::perror("allocate TiVoStreamChunks");
+        return 9;
+    }
+
+    for (int32_t i = 0; (0 == rc) && (i < pHeader->chunks); i++)
+    {
+        hoff_t chunk_start = hfh->tell() + pChunks[i].size();
+
+        if (false == pChunks[i].read(hfh))
+        {
+            std::perror("chunk read fail");
+            rc = 8;
+            break;
+        }
+
+        switch (pChunks[i].type)
+        {
+            case TIVO_CHUNK_PLAINTEXT_XML:
+                pChunks[i].setupTuringKey(pTuring, (uint8_t*)mak);
+                pChunks[i].setupMetadataKey(&metaturing, (uint8_t*)mak);
+                break;
+
+            case TIVO_CHUNK_ENCRYPTED_XML:
+                {
+                    uint16_t offsetVal = chunk_start - current_meta_stream_pos;
+                    pChunks[i].decryptMetadata(&metaturing, offsetVal);
+                    current_meta_stream_pos = chunk_start + pChunks[i].dataSize;
+                }
+                break;
+
+            default:
+                std::perror("Unknown chunk type");
+                rc = 8;
+                continue;
+        }
+
+        if (pChunks[i].id == 1)
+        {
+            char *p;
+            p = extract((char *)pChunks[i].pData, pChunks[i].dataSize, pInfo);
+            if (p != NULL)
+            {
+                pInfo->name = p;
+                std::free(p);
+            }
+        }
+
+        if (dumpPath)
+        {
+            char suffix[16];
+            std::sprintf(suffix, "-%02d-%04x.xml", i, pChunks[i].id);
+
+            std::string buf = std::string(dumpPath) + "/" +
+                (pInfo->name.empty() ? dumpBase : pInfo->name.c_str()) +
+                suffix;
+
+            HappyFile *chunkfh = new HappyFile;
+            if (!chunkfh->open(buf.c_str(), "wb"))
+            {
+                std::perror("create metadata file");
+                rc = 8;
+            }
+            else
+            {
+                pChunks[i].dump();
+
+                if (false == pChunks[i].write(chunkfh))
+                {
+                    std::perror("write chunk");
+                    rc = 8;
+                }
+
+                chunkfh->close();
+            }
+            delete chunkfh;
+        }
+    }
+
+    delete [] pChunks;
+    metaturing.destruct();
+
+    return rc;
+}
+
+// a metadata field as part of a file name
+static std::string name_field(const std::string &value)
+{
+    std::string field = value;
+    std::replace(field.begin(), field.end(), '/', '-');
+    return field;
+}
+
+/*
+ * Expand an --output-template for tivofile.  A name without a directory
+ * goes in outdir, or else beside tivofile.
+ */
+static std::string output_name(const char *tmpl, const char *tivofile,
+                               const char *outdir, const TiVoShowInfo *pInfo,
+                               const char *extn)
+{
+    char *p = strdup(tivofile);
+    std::string dir = outdir ? outdir : dirname(p);
+    std::free(p);
+
+    p = strdup(tivofile);
+    std::string base = basename(p);
+    std::free(p);
+
+    /* if there's an extension, lop it off */
+    size_t dot = base.rfind('.');
+    if ((dot != std::string::npos) && (base.size() - dot < 6))
+        base.erase(dot);
+
+    std::string name;
+    char num[16];
+
+    for (const char *t = tmpl; *t; t++)
+    {
+        if ((*t != '%') || !t[1])
+        {
+            name += *t;
+            continue;
+        }
+
+        num[0] = '\0';
+
+        switch (*++t)
+        {
+        case 'N':
+            name += pInfo->name.empty() ? base : name_field(pInfo->name);
+            break;
+        case 'b':
+            name += base;
+            break;
+        case 't':
+            name += name_field(pInfo->title);
+            break;
+        case 's':
+            name += name_field(pInfo->seriesTitle);
+            break;
+        case 'e':
+            name += name_field(pInfo->episodeTitle);
+            break;
+        case 'S':
+            if (pInfo->seasonNumber >= 0)
+                std::snprintf(num, sizeof(num), "%02d", pInfo->seasonNumber);
+            break;
+        case 'E':
+            if (pInfo->episodeNumber >= 0)
+                std::snprintf(num, sizeof(num), "%02d", pInfo->episodeNumber);
+            break;
+        case 'y':
+            if (pInfo->movieYear >= 0)
+                std::snprintf(num, sizeof(num), "%d", pInfo->movieYear);
+            break;
+        case 'x':
+            name += extn;
+            break;
+        default:
+            name += *t;
+            break;
+        }
+
+        name += num;
+    }
+
+    if (name.find('/') == std::string::npos)
+        name = dir + "/" + name;
+
+    return name;
+}
+
+/*
+ * One file of a --batch, decoded on the worker's cipher contexts and
+ * buffers.  Returns 0, or the exit code a single decode would have had.
+ */
+static int decode_batch_file(TiVoBatch *pBatch, TiVoBatchJob *pJob,
+                             TiVoBatchWorker *pWorker, void *pContext)
+{
+    TiVoBatchArgs *pArgs = (TiVoBatchArgs *)pContext;
+    TiVoStreamHeader header;
+    TiVoShowInfo info;
+
+    o_log_level = pArgs->pOptions->verbose;
+
+    if (!pWorker->in.open(pJob->input.c_str(), "rb"))
+    {
+        std::perror(pJob->input.c_str());
+        return 6;
+    }
+
+    int rc = read_metadata(&pWorker->in, &header, &pWorker->turing,
+                           pArgs->mak, &info, NULL, NULL);
+
+    if ((0 == rc) &&
+        ((pWorker->in.tell() > header.mpeg_offset) ||
+         (pWorker->in.seek(header.mpeg_offset) < 0)))
+    {
+        std::perror("Error reading header");
+        rc = 8;
+    }
+
+    if (0 == rc)
+    {
+        pJob->output = pBatch->claim(output_name(pArgs->tmpl,
+                           pJob->input.c_str(), pArgs->outdir, &info,
+                           format_extension(header.getFormatType())));
+
+        if (!pWorker->out.open(pJob->output.c_str(), "wb"))
+        {
+            std::perror(pJob->output.c_str());
+            rc = 7;
+        }
+        else
+        {
+            if (false == decode(&header, &pWorker->turing, &pWorker->in,
+                                &pWorker->out, pArgs->pOptions,
+                                pArgs->threads, 1, 1, NULL, NULL, NULL,
+                                NULL, NULL, NULL))
+                rc = 9;
+
+            pJob->written = pWorker->out.written();
+            pWorker->out.close();
+        }
+    }
+
+    // keyed but not decoded when something failed
+    pWorker->turing.reset();
+    pWorker->in.close();
+
+    return rc;
+}
+
+static void report_profile(const char *jsonfile)
+{
+    FILE *pJson = stderr;
+
+    if (jsonfile && !(pJson = std::fopen(jsonfile, "w")))
+    {
+        std::perror("opening profile output");
+        pJson = stderr;
+    }
+
+    profile_report(stderr, pJson);
+
+    if (pJson != stderr)
+        std::fclose(pJson);
+}
+
+
+int main(int argc, char *argv[])
+{
+    int o_no_video = 0;
+    int o_threads = 1;
+    int o_shard = 1;
+    int o_shards = 1;
+    int o_dump_metadata = 0;
+    int o_profile_counters = 0;
+    const char *o_profile_json = NULL;
+    double o_stats = 0;
+    int o_stats_fd = -1;
+    int o_verify_reference = 0;
+    int o_batch = 0;
+    int o_jobs = 0;
+    const char *o_template = NULL;
+    int o_write_index = 0;
+    long long o_range_start = -1;
+    long long o_range_end = -1;
+    const char *o_index = NULL;
+    const char *o_keyframes = NULL;
+    const char *o_captions = NULL;
+    double o_checkpoint = -1;
+    int o_resume = 0;
+    double o_follow = -1;
+    int o_demux = 0;
+    int o_demux_pes = 0;
+    double o_segment = -1;
+    long long o_start_bytes = -1;
+    long long o_end_bytes = -1;
+    double o_start_time = -1;
+    double o_end_time = -1;
+    int makgiven = 0;
+    uint32_t pktDumpFirst = 0;
+    uint32_t pktDumpLast  = 0;
+
+    const char *tivofile   = NULL;
+          char *destfile   = NULL;
+          char *destpath   = NULL;
+          char *destbase   = NULL;
+
+    char mak[12];
+    std::memset(mak, 0, sizeof(mak));
+
+    TuringState turing;
+    std::memset(&turing, 0, sizeof(turing));
+
+    HappyFile *hfh = NULL, *ofh = NULL;
+
+    TiVoStreamHeader header;
+    TiVoShowInfo info;
+
+    TiVoDecodeOptions options;
+    options.verbose  = 0;
+    options.noVerify = false;
+    options.iframesOnly = false;
+    options.selecting = false;
+    options.select.kinds = 0;
+    options.start    = -1;
+    options.end      = -1;
+
+    while (1)
+    {
+        int c = getopt_long(argc, argv, "m:o:hnDxvVp:t:s:P::j:O:", long_options, 0);
+
+        if (c == -1)
             break;
 
         switch (c)
@@ -272,8 +1302,21 @@ int main(int argc, char *argv[])
                 makgiven = 1;
                 break;
             case 'p':
-                std::sscanf(optarg, "%d", &pktDump);
-                pktDumpMap[pktDump] = true;
+                switch (std::sscanf(optarg, "%u-%u", &pktDumpFirst,
+                                    &pktDumpLast))
+                {
+                    case 1:
+                        pktDumpLast = pktDumpFirst;
+                        break;
+                    case 2:
+                        break;
+                    default:
+                        do_help(argv[0], 2);
+                }
+                if (pktDumpLast < pktDumpFirst)
+                    do_help(argv[0], 2);
+                options.pktDump.push_back(TsPktRange(pktDumpFirst,
+                                                     pktDumpLast));
                 break;
             case 'o':
                 destfile = optarg;
@@ -285,7 +1328,7 @@ int main(int argc, char *argv[])
                 o_verbose++;
                 break;
             case 'n':
-                o_no_verify = 1;
+                options.noVerify = true;
                 break;
             case 'D' :
                 o_dump_metadata = 1;
@@ -293,6 +1336,116 @@ int main(int argc, char *argv[])
             case 'x':
                 o_no_video = 1;
                 break;
+            case 't':
+                o_threads = std::atoi(optarg);
+                if (o_threads <= 0)
+                    o_threads = std::thread::hardware_concurrency();
+                break;
+            case 's':
+                if ((std::sscanf(optarg, "%d/%d", &o_shard, &o_shards) != 2) ||
+                    (o_shards < 1) || (o_shard < 1) || (o_shard > o_shards))
+                    do_help(argv[0], 2);
+                break;
+            case 'P':
+                o_profile = true;
+                o_profile_json = optarg;
+                break;
+            case 'C':
+                o_profile = true;
+                o_profile_counters = 1;
+                break;
+            case 'S':
+                o_stats = optarg ? std::atof(optarg) : 1.0;
+                if (o_stats <= 0)
+                    do_help(argv[0], 2);
+                break;
+            case 'F':
+                o_stats_fd = std::atoi(optarg);
+                if (o_stats_fd < 0)
+                    do_help(argv[0], 2);
+                if (o_stats <= 0)
+                    o_stats = 1.0;
+                break;
+            case 'R':
+                o_verify_reference = 1;
+                break;
+            case 'B':
+                o_batch = 1;
+                break;
+            case 'j':
+                o_jobs = std::atoi(optarg);
+                if (o_jobs < 1)
+                    do_help(argv[0], 2);
+                break;
+            case 'O':
+                o_template = optarg;
+                break;
+            case 'W':
+                o_write_index = 1;
+                break;
+            case 'r':
+                // start:end, or start: for the rest of the file
+                if ((std::sscanf(optarg, "%lld:%lld", &o_range_start,
+                                 &o_range_end) < 1) ||
+                    !std::strchr(optarg, ':') || (o_range_start < 0) ||
+                    ((o_range_end >= 0) && (o_range_end <= o_range_start)))
+                    do_help(argv[0], 2);
+                break;
+            case 'i':
+                o_index = optarg;
+                break;
+            case 'K':
+                o_keyframes = optarg;
+                break;
+            case 'Y':
+                o_captions = optarg;
+                break;
+            case 'I':
+                options.iframesOnly = true;
+                break;
+            case 'c':
+                o_checkpoint = optarg ? std::atof(optarg) : CHECKPOINT_SECONDS;
+                if (o_checkpoint <= 0)
+                    do_help(argv[0], 2);
+                break;
+            case 'f':
+                o_follow = optarg ? std::atof(optarg) : FOLLOW_IDLE_SECONDS;
+                if (o_follow <= 0)
+                    do_help(argv[0], 2);
+                break;
+            case 'L':
+            case 'T':
+                options.selecting = true;
+                if (false == parse_select(optarg, (c == 'L'),
+                                          &options.select))
+                    do_help(argv[0], 2);
+                break;
+            case 'X':
+                o_demux = 1;
+                if (optarg && std::strcmp(optarg, "pes"))
+                    do_help(argv[0], 2);
+                o_demux_pes = (optarg != NULL);
+                break;
+            case 'G':
+                o_segment = std::atof(optarg);
+                if (o_segment <= 0)
+                    do_help(argv[0], 2);
+                break;
+            case 'u':
+                o_resume = 1;
+                if (o_checkpoint <= 0)
+                    o_checkpoint = CHECKPOINT_SECONDS;
+                break;
+            case 'a':
+                if (false == parse_position(optarg, &o_start_bytes,
+                                            &o_start_time))
+                    do_help(argv[0], 2);
+                break;
+            case 'e':
+                if (false == parse_position(optarg, &o_end_bytes,
+                                            &o_end_time))
+                    do_help(argv[0], 2);
+                break;
             case '?':
                 do_help(argv[0], 2);
                 break;
@@ -305,9 +1458,85 @@ int main(int argc, char *argv[])
         }
     }
 
+    std::sort(options.pktDump.begin(), options.pktDump.end());
+    options.verbose = o_verbose;
+
+    if (true == o_profile)
+        profile_start(o_profile_counters ? true : false);
+    o_log_level = o_verbose;
+
     if (!makgiven)
         makgiven = get_mak_from_conf_file(mak);
 
+    bool partial = (o_start_bytes >= 0) || (o_start_time >= 0) ||
+                   (o_end_bytes >= 0) || (o_end_time >= 0);
+
+    if (o_batch)
+    {
+        struct stat st;
+        TiVoBatch batch;
+
+        if (!makgiven || (optind == argc))
+            do_help(argv[0], 5);
+
+        if ((o_shards > 1) || (o_stats > 0) || o_verify_reference ||
+            o_dump_metadata || o_no_video || o_write_index ||
+            (o_range_start >= 0) || o_keyframes || o_captions ||
+            options.iframesOnly || partial || (o_checkpoint > 0) ||
+            (o_follow > 0) || o_demux || (o_segment > 0))
+        {
+            std::fprintf(stderr, "--batch does not take --shard, --stats, "
+                         "--verify-against-reference, --write-index, "
+                         "--range, --keyframes, --captions, --iframes, "
+                         "--start, --end, --checkpoint, --resume, --follow, "
+                         "--demux, --segment-duration, -D or -x\n");
+            return 6;
+        }
+
+        if (destfile && ((stat(destfile, &st) < 0) || !S_ISDIR(st.st_mode)))
+        {
+            std::fprintf(stderr, "--batch: -o must name a directory\n");
+            return 6;
+        }
+
+        for (; optind < argc; optind++)
+        {
+            if (false == batch.add(argv[optind]))
+                return 6;
+        }
+
+        if (batch.jobs.empty())
+        {
+            std::fprintf(stderr, "--batch: no .TiVo files found\n");
+            return 6;
+        }
+
+        print_qualcomm_msg();
+
+        TiVoBatchArgs args;
+        args.mak      = mak;
+        args.pOptions = &options;
+        args.tmpl     = o_template ? o_template : "%N.%x";
+        args.outdir   = destfile;
+        args.threads  = o_threads;
+
+        int jobs = o_jobs ? std::min(o_jobs, (int)batch.jobs.size()) :
+                            batch.workers(o_threads);
+
+        std::fprintf(stderr, "batch: %u files on %d workers\n",
+                     (unsigned)batch.jobs.size(), jobs);
+
+        int failed = batch.run(jobs, decode_batch_file, &args);
+
+        std::fprintf(stderr, "batch: %u decoded, %d failed\n",
+                     (unsigned)batch.jobs.size() - failed, failed);
+
+        if (true == o_profile)
+            report_profile(o_profile_json);
+
+        return failed ? 12 : 0;
+    }
+
     if (optind < argc)
     {
         tivofile = argv[optind++];
@@ -353,84 +1582,135 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (false == header.read(hfh))
+    if ((o_shards > 1) &&
+        (!std::strcmp(tivofile, "-") || (hfh->size() < 0)))
     {
-        return(8);
+        std::fprintf(stderr, "--shard needs a regular input file\n");
+        return 6;
     }
 
-    header.dump();
+    if (o_follow > 0)
+    {
+        if ((o_shards > 1) || (o_range_start >= 0) || partial ||
+            !std::strcmp(tivofile, "-") || (hfh->size() < 0))
+        {
+            std::fprintf(stderr, "--follow needs a regular input file, and "
+                         "does not take --shard, --range, --start or "
+                         "--end\n");
+            return 6;
+        }
 
-    TiVoStreamChunk *pChunks = new TiVoStreamChunk[header.chunks];
-    if (NULL == pChunks)
+        hfh->follow(o_follow, NULL);
+    }
+
+    if ((o_range_start >= 0) &&
+        ((o_shards > 1) || (o_stats > 0) || o_verify_reference ||
+         o_write_index || o_keyframes || options.iframesOnly ||
+         !std::strcmp(tivofile, "-") || (hfh->size() < 0)))
     {
-        std::perror("allocate TiVoStreamChunks");
-        return(9);
+        std::fprintf(stderr, "--range needs a regular input file, and does "
+                     "not take --shard, --stats, --verify-against-reference, "
+                     "--write-index, --keyframes or --iframes\n");
+        return 6;
     }
 
-    for (int32_t i = 0; i < header.chunks; i++)
+    if ((o_write_index || o_keyframes) && (o_shards > 1))
     {
-        hoff_t chunk_start = hfh->tell() + pChunks[i].size();
+        std::fprintf(stderr, "--write-index and --keyframes need the whole "
+                     "file, not a --shard\n");
+        return 6;
+    }
 
-        if (false == pChunks[i].read(hfh))
-        {
-            std::perror("chunk read fail");
-            return(8);
-        }
-
-        switch (pChunks[i].type)
-        {
-            case TIVO_CHUNK_PLAINTEXT_XML:
-                pChunks[i].setupTuringKey(&turing, (uint8_t*)mak);
-                pChunks[i].setupMetadataKey(&metaturing, (uint8_t*)mak);
-                break;
-
-            case TIVO_CHUNK_ENCRYPTED_XML:
-                {
-                    uint16_t offsetVal = chunk_start - current_meta_stream_pos;
-                    pChunks[i].decryptMetadata(&metaturing, offsetVal);
-                    current_meta_stream_pos = chunk_start + pChunks[i].dataSize;
-                }
-                break;
+    if (o_captions &&
+        ((o_shards > 1) || (o_range_start >= 0) || (o_checkpoint > 0)))
+    {
+        std::fprintf(stderr, "--captions needs the whole decode, not a "
+                     "--shard, --range, --checkpoint or --resume\n");
+        return 6;
+    }
 
-            default:
-                std::perror("Unknown chunk type");
-                return(8);
-        }
-
-        if (pChunks[i].id == 1)
-        {
-            char *p;
-            p = extract((char *)pChunks[i].pData,pChunks[i].dataSize);
-            if (p != NULL)
-                destbase = p;
-        }
+    if (partial &&
+        ((o_shards > 1) || (o_range_start >= 0) || o_write_index ||
+         !std::strcmp(tivofile, "-") || (hfh->size() < 0)))
+    {
+        std::fprintf(stderr, "--start and --end need a regular input file, "
+                     "and do not take --shard, --range or --write-index\n");
+        return 6;
+    }
 
-        if (o_dump_metadata)
-        {
-            char *buf = (char *)malloc(strlen(destpath) + 16);
-            std::sprintf(buf, "%s/%s-%02d-%04x.xml", destpath, destbase, i, pChunks[i].id);
+    if ((o_checkpoint > 0) &&
+        ((o_shards > 1) || (o_range_start >= 0) || partial || o_keyframes ||
+         options.iframesOnly || !std::strcmp(tivofile, "-") ||
+         (hfh->size() < 0)))
+    {
+        std::fprintf(stderr, "--checkpoint and --resume need a regular "
+                     "input file, and do not take --shard, --range, --start, "
+                     "--end, --keyframes or --iframes\n");
+        return 6;
+    }
 
-            HappyFile *chunkfh = new HappyFile;
-            if (!chunkfh->open(buf, "wb"))
-            {
-                std::perror("create metadata file");
-                return 8;
-            }
+    if ((o_write_index || (o_checkpoint > 0)) && options.selecting)
+    {
+        std::fprintf(stderr, "--write-index and --checkpoint need every "
+                     "stream, not --pids or --streams\n");
+        return 6;
+    }
 
-            pChunks[i].dump();
+    if (o_demux && (o_write_index || o_keyframes || (o_checkpoint > 0) ||
+                    o_verify_reference))
+    {
+        std::fprintf(stderr, "--demux does not take --write-index, "
+                     "--keyframes, --checkpoint, --resume or "
+                     "--verify-against-reference\n");
+        return 6;
+    }
 
-            if (false == pChunks[i].write(chunkfh))
-            {
-                std::perror("write chunk");
-                return 8;
-            }
+    if ((o_segment > 0) &&
+        ((o_shards > 1) || (o_range_start >= 0) || o_demux || o_write_index ||
+         o_keyframes || (o_checkpoint > 0) || o_verify_reference))
+    {
+        std::fprintf(stderr, "--segment-duration does not take --shard, "
+                     "--range, --demux, --write-index, --keyframes, "
+                     "--checkpoint, --resume or --verify-against-reference\n");
+        return 6;
+    }
 
-            chunkfh->close();
-            delete chunkfh;
-        }
+    if (o_write_index && options.iframesOnly)
+    {
+        std::fprintf(stderr, "--write-index needs the full output, not "
+                     "--iframes\n");
+        return 6;
     }
 
-//    metaturing.destruct();
+    std::string indexfile = o_index ? o_index :
+                            std::string(tivofile) + ".tdidx";
+
+    if ((o_write_index || (o_range_start >= 0)) && !o_index &&
+        !std::strcmp(tivofile, "-"))
+    {
+        std::fprintf(stderr, "reading from stdin, name the index file with "
+                     "--index\n");
+        return 6;
+    }
+
+    if ((o_write_index || o_keyframes || o_captions || options.iframesOnly ||
+         (o_checkpoint > 0) || (o_segment > 0) || (o_follow > 0)) &&
+        (o_threads > 1))
+    {
+        std::fprintf(stderr, "%s decodes on one thread\n",
+                     o_write_index ? "--write-index" :
+                     o_keyframes ? "--keyframes" :
+                     o_captions ? "--captions" :
+                     (o_segment > 0) ? "--segment-duration" :
+                     options.iframesOnly ? "--iframes" :
+                     (o_follow > 0) ? "--follow" : "--checkpoint");
+        o_threads = 1;
+    }
+
+    int rc = read_metadata(hfh, &header, &turing, mak, &info,
+                           o_dump_metadata ? destpath : NULL, destbase);
+    if (rc)
+        return rc;
 
     if (o_no_video)
         std::exit(0);
@@ -442,79 +1722,365 @@ int main(int argc, char *argv[])
         return 8; // I dunno
     }
 
+    if (partial)
+    {
+        // only reads, to find the sync points
+        HappyFile unused;
+        TiVoDecoder *pDecoder = new_decoder(&header, &turing, hfh, &unused,
+                                            &options, 1);
+        if (NULL == pDecoder)
+            return 9;
+
+        if ((o_start_bytes >= 0) || (o_start_time >= 0))
+            options.start = find_position(pDecoder, hfh, header.mpeg_offset,
+                                          o_start_bytes, o_start_time);
+        else
+            options.start = header.mpeg_offset;
+
+        if ((o_end_bytes >= 0) || (o_end_time >= 0))
+            options.end = find_position(pDecoder, hfh, header.mpeg_offset,
+                                        o_end_bytes, o_end_time);
+
+        delete pDecoder;
+
+        if ((options.start == NO_PTS) || (options.end == NO_PTS))
+        {
+            std::fprintf(stderr, "no video PTS to find the time by\n");
+            return 6;
+        }
+
+        if (options.start < 0)
+        {
+            std::fprintf(stderr, "--start is past the end of the "
+                         "recording\n");
+            return 6;
+        }
+
+        if ((options.end >= 0) && (options.end <= options.start))
+        {
+            std::fprintf(stderr, "--end is not after --start\n");
+            return 6;
+        }
+
+        std::fprintf(stderr, "decoding input %lld to %lld\n",
+                     (long long)options.start,
+                     (long long)((options.end >= 0) ? options.end :
+                                                      hfh->size()));
+    }
+
     ofh = new HappyFile;
 
+    bool destgiven = (destfile != NULL);
+
     if (destfile == NULL) /* destfile not given on cmdline, so derive one from tivofile and metadata */
     {
-        const char *extn;
+        std::string name = output_name(o_template ? o_template : "%N.%x",
+                                       tivofile, NULL, &info,
+                                       format_extension(header.getFormatType()));
 
-        switch (header.getFormatType())
+        if (o_shards > 1)
         {
-        case TIVO_FORMAT_PS:
-            extn = "mpg";
-            break;
-        case TIVO_FORMAT_TS:
-            extn = "ts";
-            break;
-        default:
-            extn = "bin";
-            break;
+            char suffix[32];
+            std::sprintf(suffix, "-%d-of-%d", o_shard, o_shards);
+
+            size_t slash = name.rfind('/');
+            size_t dot   = name.rfind('.');
+            if ((dot == std::string::npos) || (dot < slash))
+                dot = name.size();
+
+            name.insert(dot, suffix);
         }
 
-        destfile = (char *)std::malloc(strlen(destpath) + strlen(destbase) + strlen(extn) + 3);
-        sprintf(destfile, "%s/%s.%s", destpath, destbase, extn);
+        destfile = strdup(name.c_str());
     }
 
-    fprintf(stderr, "writing to %s\n", destfile);
+    if (o_verify_reference &&
+        (!std::strcmp(tivofile, "-") || !std::strcmp(destfile, "-") ||
+         (hfh->size() < 0)))
+    {
+        std::fprintf(stderr, "--verify-against-reference needs a regular "
+                     "input and output file\n");
+        return 6;
+    }
 
-    if (!std::strcmp(destfile, "-"))
+    if ((o_checkpoint > 0) && !std::strcmp(destfile, "-"))
+    {
+        std::fprintf(stderr, "--checkpoint and --resume need an output "
+                     "file\n");
+        return 6;
+    }
+
+    if ((o_demux || (o_segment > 0)) && !std::strcmp(destfile, "-"))
+    {
+        std::fprintf(stderr, "%s needs an output file name\n",
+                     o_demux ? "--demux" : "--segment-duration");
+        return 6;
+    }
+
+    TiVoDecoderIndex *pIndex = NULL;
+    std::string checkpointfile = std::string(destfile) + ".tdckpt";
+    bool resuming = false;
+
+    if (o_write_index || (o_checkpoint > 0))
+        pIndex = new TiVoDecoderIndex(header.getFormatType(),
+                                      header.mpeg_offset);
+
+    if (o_checkpoint > 0)
+    {
+        struct stat st;
+
+        pIndex->checkpointFile    = checkpointfile;
+        pIndex->checkpointSeconds = o_checkpoint;
+
+        resuming = o_resume && (stat(checkpointfile.c_str(), &st) == 0) &&
+                   (stat(destfile, &st) == 0);
+
+        if (o_resume && !resuming)
+            std::fprintf(stderr, "resume: no checkpoint, decoding from the "
+                         "start\n");
+    }
+
+    if (resuming)
+    {
+        if (false == pIndex->read(checkpointfile.c_str()))
+            return 6;
+
+        if ((pIndex->format != header.getFormatType()) ||
+            (pIndex->mpegOffset != header.mpeg_offset))
+        {
+            std::fprintf(stderr, "%s: checkpoint is for another recording\n",
+                         checkpointfile.c_str());
+            return 6;
+        }
+    }
+
+    TiVoDecoderDemux *pDemux = NULL;
+    std::string demuxprefix = destfile;
+
+    if (o_demux)
+    {
+        // a derived name loses its extension, a given one is the prefix
+        size_t slash = demuxprefix.rfind('/');
+        size_t dot   = demuxprefix.rfind('.');
+        if (!destgiven && (dot != std::string::npos) &&
+            ((slash == std::string::npos) || (dot > slash)))
+            demuxprefix.erase(dot);
+
+        fprintf(stderr, "demultiplexing to %s.*\n", demuxprefix.c_str());
+
+        pDemux = new TiVoDecoderDemux(demuxprefix.c_str(),
+                                      header.getFormatType(),
+                                      o_demux_pes ? true : false);
+    }
+    else
+        fprintf(stderr, "writing to %s\n", destfile);
+
+    TiVoDecoderSegments *pSegments = NULL;
+
+    if (o_segment > 0)
+    {
+        // show.ts is cut into show-00000.ts ... listed in show.m3u8
+        std::string prefix = destfile;
+        std::string extension =
+            std::string(".") + format_extension(header.getFormatType());
+        size_t slash = prefix.rfind('/');
+        size_t dot   = prefix.rfind('.');
+
+        if ((dot != std::string::npos) &&
+            ((slash == std::string::npos) || (dot > slash)))
+        {
+            extension = prefix.substr(dot);
+            prefix.erase(dot);
+        }
+
+        pSegments = new TiVoDecoderSegments(prefix.c_str(), extension.c_str(),
+                                            header.getFormatType(),
+                                            o_segment);
+        fprintf(stderr, "segmenting to %s-*%s\n", prefix.c_str(),
+                extension.c_str());
+    }
+
+    if (pDemux)
+        ofh->attachSink(TiVoDecoderDemux::sink, pDemux);
+    else if (pSegments)
+        ofh->attachSink(TiVoDecoderSegments::sink, pSegments);
+    else if (!std::strcmp(destfile, "-"))
     {
         if (!ofh->attach(stdout))
             return 10;
     }
     else
     {
-        if (!ofh->open(destfile, "wb"))
+        if (!ofh->open(destfile, resuming ? "r+b" : "wb"))
         {
             std::perror("opening output file");
             return 7;
         }
-    }
-
-    TiVoDecoder *pDecoder = NULL;
-
-    switch (header.getFormatType())
-    {
-        case TIVO_FORMAT_PS:
-            pDecoder = new TiVoDecoderPS(&turing, hfh, ofh);
-            break;
+    }
 
-        case TIVO_FORMAT_TS:
-            pDecoder = new TiVoDecoderTS(&turing, hfh, ofh);
-            break;
+    // what is decoded is flushed whenever the input has to be waited for
+    if (o_follow > 0)
+        hfh->follow(o_follow, ofh);
+
+    if (resuming)
+    {
+        // back to the last point the output on disk reaches
+        const TiVoIndexPoint *pFrom = pIndex->resume(ofh->size());
+
+        if ((ofh->truncate(pFrom ? pFrom->out : 0) < 0) ||
+            (pFrom && (hfh->seek(pFrom->in) < 0)))
+        {
+            std::perror("resume");
+            return 7;
+        }
+
+        std::fprintf(stderr, "resume: from input %lld, output %lld\n",
+                     (long long)hfh->tell(), (long long)ofh->written());
     }
+
+    TiVoDecoderStats *pStats = NULL;
 
-    if (NULL == pDecoder)
+    if (o_stats > 0)
     {
-        std::perror("Unable to create TiVo Decoder");
-        return 9;
+        pStats = new TiVoDecoderStats(o_stats, o_stats_fd);
+        pStats->pFileIn  = hfh;
+        pStats->pFileOut = ofh;
+        pStats->inStart  = hfh->tell();
     }
 
-    if (false == pDecoder->process())
+    TiVoDecoderFrames *pFrames = NULL;
+    TiVoDecoderCaptions *pCaptions = NULL;
+
+    if (o_range_start >= 0)
+    {
+        TiVoDecoderIndex index(header.getFormatType(), header.mpeg_offset);
+
+        if (false == index.read(indexfile.c_str()))
+            return 6;
+
+        if ((index.format != header.getFormatType()) ||
+            (index.mpegOffset != header.mpeg_offset))
+        {
+            std::fprintf(stderr, "%s: index is for another recording\n",
+                         indexfile.c_str());
+            return 6;
+        }
+
+        if (false == decode_range(&header, &turing, hfh, ofh, &options,
+                                  &index, o_range_start, o_range_end))
+            return 9;
+    }
+    else
+    {
+        if (o_keyframes)
+        {
+            pFrames = new TiVoDecoderFrames;
+
+            if (false == pFrames->open(o_keyframes))
+                return 7;
+        }
+
+        if (o_captions)
+        {
+            pCaptions = new TiVoDecoderCaptions;
+
+            if (false == pCaptions->open(o_captions))
+                return 7;
+        }
+
+        bool done = decode(&header, &turing, hfh, ofh, &options, o_threads,
+                           o_shard, o_shards, pStats, NULL, pIndex, pFrames,
+                           pCaptions, pSegments);
+
+        // what was decoded of an input cut short can be resumed too
+        if (pIndex)
+            pIndex->checkpoint(ofh, true);
+
+        if (false == done)
+            return 9;
+    }
+
+    if (pStats)
     {
-        std::perror("Failed to process file");
-        return 9;
+        pStats->finish();
+        delete pStats;
     }
 
-    turing.destruct();
-
     hfh->close();
     delete hfh;
 
     ofh->close();
     delete ofh;
 
-    return 0;
+    if (pSegments)
+    {
+        bool ok = pSegments->close();
+
+        std::fprintf(stderr, "segments: %u written, listed in %s\n",
+                     (unsigned)pSegments->count(),
+                     pSegments->playlistName().c_str());
+        delete pSegments;
+
+        if (false == ok)
+            return 7;
+    }
+
+    if (pDemux)
+    {
+        bool ok = pDemux->close();
+
+        std::fprintf(stderr, "demux: %u streams written to %s.*\n",
+                     (unsigned)pDemux->count, demuxprefix.c_str());
+        delete pDemux;
+
+        if (false == ok)
+            return 7;
+    }
+
+    if (pIndex)
+    {
+        if (o_write_index)
+        {
+            if (false == pIndex->write(indexfile.c_str()))
+                return 7;
+
+            std::fprintf(stderr, "index: %u seek points written to %s\n",
+                         (unsigned)pIndex->points.size(), indexfile.c_str());
+        }
+
+        delete pIndex;
+    }
+
+    if (pFrames)
+    {
+        if (false == pFrames->close())
+            return 7;
+
+        std::fprintf(stderr, "keyframes: %u written to %s\n",
+                     (unsigned)pFrames->count, o_keyframes);
+        delete pFrames;
+    }
+
+    if (pCaptions)
+    {
+        if (false == pCaptions->close())
+            return 7;
+
+        std::fprintf(stderr, "captions: %u pictures written to %s\n",
+                     (unsigned)pCaptions->count, o_captions);
+        delete pCaptions;
+    }
+
+    bool verified = true;
+
+    if (o_verify_reference)
+        verified = verify_output(&header, &turing, &options, tivofile,
+                                 destfile, o_shard, o_shards);
+
+    if (true == o_profile)
+        report_profile(o_profile_json);
+
+    return verified ? 0 : 11;
 }
 
 /* vi:set ai ts=4 sw=4 expandtab: */
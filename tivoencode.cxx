@@ -0,0 +1,1578 @@
+/*
+ * tivodecode-ng
+ * Copyright 2006-2015, Jeremy Drake et al.
+ * See COPYING file for license terms
+ *
+ * Wraps a plain MPEG-2 transport or program stream, or a synthetic one,
+ * into an encrypted .TiVo file that tivodecode turns back into the stream.
+ * Meant for building test and benchmark inputs, not for real recordings.
+ */
+#ifdef HAVE_CONFIG_H
+#include "tdconfig.h"
+#endif
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+
+#include "getopt_long.h"
+
+#include "cli_common.hxx"
+#include "happyfile.hxx"
+#include "Turing.hxx"
+#include "turing_stream.hxx"
+#include "tivo_parse.hxx"
+#include "tivo_decoder_ts.hxx"
+#include "tivo_decoder_ts_section.hxx"
+
+#define TIVO_KEY_PID        0x1FF0
+#define TIVO_KEY_STREAMS    8       // entries that fit in one key packet
+#define PS_EXT_SIZE         17      // PES extension flags plus the key
+#define PS_HEADER_MAX       32      // longest PES header the decoder takes
+#define WINDOW_SIZE         (256 * 1024)
+
+static struct option long_options[] = {
+    {"mak", 1, 0, 'm'},
+    {"out", 1, 0, 'o'},
+    {"synthetic", 1, 0, 'S'},
+    {"format", 1, 0, 'F'},
+    {"block-size", 1, 0, 'b'},
+    {"key-every", 1, 0, 'k'},
+    {"seed", 1, 0, 's'},
+    {"title", 1, 0, 'T'},
+    {"pes-size", 1, 0, 'P'},
+    {"verbose", 0, 0, 'v'},
+    {"version", 0, 0, 'V'},
+    {"help", 0, 0, 'h'},
+    {0, 0, 0, 0}
+};
+
+static void do_help(const char *arg0, int exitval)
+{
+    std::cerr << "Usage: " << arg0 << " [--help] [--verbose|-v] "
+        "{--mak|-m} mak [{--out|-o} outfile] [--format|-F ts|ps] "
+        "[--block-size|-b bytes] [--key-every|-k n] [--seed|-s n] "
+        "[--title|-T title] [--pes-size|-P bytes] "
+        "{--synthetic|-S size | <mpegfile>}\n\n"
+        " -m, --mak         media access key (required)\n"
+        " -o, --out,        output .TiVo file (default stdout)\n"
+        " -S, --synthetic,  generate size bytes of MPEG instead of reading "
+        "a file;\n"
+        "                   size may end in K, M or G\n"
+        " -F, --format,     ts or ps; for --synthetic, default ts\n"
+        " -b, --block-size, payload bytes per cipher block before moving to\n"
+        "                   the next block number (default 1M)\n"
+        " -k, --key-every,  repeat TS key packets every n PES packets per\n"
+        "                   stream (default 32)\n"
+        " -s, --seed,       seed for keys and synthetic content (default 1)\n"
+        " -T, --title,      program title for the metadata\n"
+        " -P, --pes-size,   for a synthetic program stream, carry the video\n"
+        "                   in PES packets of this many bytes, which start\n"
+        "                   pictures anywhere in them (default one picture\n"
+        "                   to a run of packets)\n"
+        " -v, --verbose,    describe the output\n"
+        " -V, --version,    print the version information and exit\n"
+        " -h, --help,       print this help and exit\n\n"
+        "The MPEG file may be -, which means stdin\n\n";
+    std::exit(exitval);
+}
+
+static inline void put16(uint8_t *p, uint16_t val)
+{
+    p[0] = val >> 8;
+    p[1] = val & 0xff;
+}
+
+static inline void put32(uint8_t *p, uint32_t val)
+{
+    p[0] = val >> 24;
+    p[1] = (val >> 16) & 0xff;
+    p[2] = (val >> 8) & 0xff;
+    p[3] = val & 0xff;
+}
+
+static inline void put_pts(uint8_t *p, uint8_t marker, uint64_t pts)
+{
+    p[0] = (marker << 4) | (((pts >> 30) & 7) << 1) | 1;
+    p[1] = (pts >> 22) & 0xff;
+    p[2] = (((pts >> 15) & 0x7f) << 1) | 1;
+    p[3] = (pts >> 7) & 0xff;
+    p[4] = ((pts & 0x7f) << 1) | 1;
+}
+
+// xorshift64*, so a seed gives the same file on every host
+class Random
+{
+    private:
+        uint64_t state;
+
+    public:
+        inline uint32_t next()
+        {
+            state ^= state >> 12;
+            state ^= state << 25;
+            state ^= state >> 27;
+            return (uint32_t)((state * 0x2545F4914F6CDD1DULL) >> 32);
+        }
+
+        inline uint32_t range(uint32_t lo, uint32_t hi)
+            { return lo + next() % (hi - lo); }
+
+        // random bytes with no two zeros in a row, so no start codes
+        void fill(uint8_t *p, size_t len)
+        {
+            for (size_t i = 0; i < len; i++)
+            {
+                p[i] = (uint8_t)next();
+                if ((0 == p[i]) && (i > 0) && (0 == p[i - 1]))
+                    p[i] = 0x80;
+            }
+        }
+
+        Random(uint64_t seed) : state(seed * 0x9E3779B97F4A7C15ULL + 1) {}
+};
+
+/*
+ * A TiVo key: the block number and the crypted word, with the marker
+ * bits TiVoDecoder::do_header() checks.  The rest is noise.
+ */
+static void make_key(uint8_t key[16], int block_no, Random *pRandom)
+{
+    uint32_t crypted = pRandom->next();
+
+    for (int i = 0; i < 16; i++)
+        key[i] = (uint8_t)pRandom->next();
+
+    key[0x0] |= 0x80;
+    key[0x1]  = (key[0x1] & 0x80) | 0x40 | ((block_no >> 18) & 0x3f);
+    key[0x2]  = (block_no >> 10) & 0xff;
+    key[0x3]  = (((block_no >> 8) & 0x03) << 6) | 0x20 |
+                ((block_no >> 3) & 0x1f);
+    key[0x4]  = ((block_no & 0x07) << 5) | 0x10 | (key[0x4] & 0x0f);
+    key[0x6] |= 0x08;
+    key[0xb]  = (key[0xb] & 0xfc) | ((crypted >> 30) & 0x03);
+    key[0xc]  = (crypted >> 22) & 0xff;
+    key[0xd]  = (((crypted >> 16) & 0x3f) << 2) | 0x02 |
+                ((crypted >> 15) & 0x01);
+    key[0xe]  = (crypted >> 7) & 0xff;
+    key[0xf]  = ((crypted & 0x7f) << 1) | 0x01;
+}
+
+typedef struct
+{
+    uint32_t blockSize;
+    uint32_t keyEvery;
+    Random  *pRandom;
+    uint64_t scrambled;     // payload bytes
+    uint64_t clear;
+    uint32_t blocks;
+} EncodeState;
+
+// ===================================================================
+
+typedef struct
+{
+    uint8_t  streamId;      // from the first PES header; keys the cipher
+    bool     keyed;         // sent in a key packet yet
+    bool     scrambling;    // the current PES is being scrambled
+    int      block;
+    uint64_t blockBytes;
+    uint32_t pesCount;
+    uint8_t  key[16];
+} TsEncodeStream;
+
+typedef std::map<uint16_t, TsEncodeStream> TsEncodeStreams;
+
+/*
+ * Scrambles a transport stream packet by packet.  The PMT gains a private
+ * data PID for the TiVo key packets, and a PES is only scrambled when the
+ * decoder is sure to find the same clear header length in the scrambled
+ * packet; anything else goes out in the clear, which the decoder passes
+ * through unchanged.
+ */
+class TsEncoder
+{
+    private:
+        TuringState         *pTuring;
+        HappyFile           *pOut;
+        EncodeState         *pState;
+
+        uint16_t             pmtPid;
+        uint16_t             keyPid;
+        uint8_t              keyCC;
+        TsEncodeStreams      streams;
+
+        // only used for its PES header parser
+        TiVoDecoderTsStream *pParser;
+        uint8_t              parseBuffer[TS_FRAME_SIZE * 10];
+
+        bool  write(const uint8_t *pPkt);
+        bool  sendKeys();
+        void  newBlock(TsEncodeStream *pStream);
+        void  handlePAT(uint8_t *pPayload, int len);
+        void  handlePMT(uint8_t *pPkt, int offset);
+        int   headerLength(const uint8_t *pPayload, int len);
+        bool  encodePES(uint8_t *pPkt, int offset, TsEncodeStream *pStream);
+
+    public:
+        uint32_t keyPackets;
+
+        bool  packet(uint8_t *pPkt);
+
+        TsEncoder(TuringState *pTuringState, HappyFile *pOutfile,
+                  EncodeState *pEncodeState);
+        ~TsEncoder();
+};
+
+TsEncoder::TsEncoder(TuringState *pTuringState, HappyFile *pOutfile,
+                     EncodeState *pEncodeState)
+{
+    pTuring    = pTuringState;
+    pOut       = pOutfile;
+    pState     = pEncodeState;
+    pmtPid     = 0;
+    keyPid     = 0;
+    keyCC      = 0;
+    keyPackets = 0;
+
+    pParser = new TiVoDecoderTsStream(0);
+}
+
+TsEncoder::~TsEncoder()
+{
+    delete pParser;
+}
+
+bool TsEncoder::write(const uint8_t *pPkt)
+{
+    if (pOut->write((void *)pPkt, TS_FRAME_SIZE) != TS_FRAME_SIZE)
+    {
+        std::perror("writing output");
+        return false;
+    }
+
+    return true;
+}
+
+// One key packet listing every stream seen so far.
+bool TsEncoder::sendKeys()
+{
+    uint8_t pkt[TS_FRAME_SIZE];
+    uint8_t *pPtr = &pkt[4];
+    int count = 0;
+
+    std::memset(pkt, 0xff, sizeof(pkt));
+    pkt[0] = 0x47;
+    pkt[1] = 0x40 | (keyPid >> 8);
+    pkt[2] = keyPid & 0xff;
+    pkt[3] = 0x10 | keyCC;
+    keyCC = (keyCC + 1) & 0x0f;
+
+    std::memcpy(pPtr, "TiVo\x81\x03\x7d\x00\x00", 9);
+    pPtr += 10;
+
+    for (TsEncodeStreams::iterator it = streams.begin();
+         (it != streams.end()) && (count < TIVO_KEY_STREAMS); it++)
+    {
+        if (0 == it->second.streamId)
+            continue;
+
+        put16(pPtr, it->first);
+        pPtr[2] = it->second.streamId;
+        pPtr[3] = 0x10;
+        std::memcpy(pPtr + 4, it->second.key, 16);
+        it->second.keyed = true;
+
+        pPtr += 20;
+        count++;
+    }
+
+    pkt[13] = count * 20;
+    keyPackets++;
+
+    return write(pkt);
+}
+
+void TsEncoder::newBlock(TsEncodeStream *pStream)
+{
+    pStream->block = (pStream->block + 1) & 0xffffff;
+    pStream->blockBytes = 0;
+    pStream->keyed = false;
+    make_key(pStream->key, pStream->block, pState->pRandom);
+    pState->blocks++;
+}
+
+void TsEncoder::handlePAT(uint8_t *pPayload, int len)
+{
+    int pointer = pPayload[0];
+    uint8_t *pSection = pPayload + 1 + pointer;
+
+    if ((1 + pointer + 8 > len) || (0x00 != pSection[0]))
+        return;
+
+    int total = 3 + (((pSection[1] & 0x0f) << 8) | pSection[2]);
+
+    if (1 + pointer + total > len)
+        return;
+
+    for (int i = 8; i + 4 <= total - 4; i += 4)
+    {
+        uint16_t program = (pSection[i] << 8) | pSection[i + 1];
+
+        if (0 != program)
+        {
+            pmtPid = ((pSection[i + 2] & 0x1f) << 8) | pSection[i + 3];
+            break;
+        }
+    }
+}
+
+/*
+ * Add the key PID to the PMT, as a stream type the decoder does not
+ * recognise, and learn which PIDs carry audio and video.  Only PMTs that
+ * fit in one packet are handled.
+ */
+void TsEncoder::handlePMT(uint8_t *pPkt, int offset)
+{
+    static std::atomic<uint32_t> logCount(0);
+    uint8_t section[TS_FRAME_SIZE];
+    uint8_t *pPayload = pPkt + offset;
+    int len = TS_FRAME_SIZE - offset;
+    int pointer = pPayload[0];
+    uint8_t *pSection = pPayload + 1 + pointer;
+    std::set<uint16_t> pids;
+    bool listed = false;
+
+    if ((1 + pointer + 12 > len) || (0x02 != pSection[0]))
+        return;
+
+    int total = 3 + (((pSection[1] & 0x0f) << 8) | pSection[2]);
+    int infoLen = ((pSection[10] & 0x0f) << 8) | pSection[11];
+
+    if (1 + pointer + total > len)
+    {
+        if (log_limited(&logCount))
+            std::fprintf(stderr, "PMT spans packets, left as is\n");
+        return;
+    }
+
+    for (int i = 12 + infoLen; i + 5 <= total - 4;)
+    {
+        uint8_t  type = pSection[i];
+        uint16_t pid  = ((pSection[i + 1] & 0x1f) << 8) | pSection[i + 2];
+
+        switch (type)
+        {
+            case 0x01: case 0x02: case 0x10: case 0x1b: case 0x80:
+            case 0xea: case 0x03: case 0x04: case 0x11: case 0x0f:
+            case 0x81: case 0x8a:
+                if (streams.find(pid) == streams.end())
+                {
+                    TsEncodeStream stream;
+
+                    std::memset(&stream, 0, sizeof(stream));
+                    stream.block = pState->pRandom->range(1, 0x1000);
+                    make_key(stream.key, stream.block, pState->pRandom);
+                    streams[pid] = stream;
+                    pState->blocks++;
+                }
+                break;
+
+            case 0x97:
+                // already a TiVo stream: its key packets are replaced
+                if ((0 == keyPid) || (pid == keyPid))
+                {
+                    keyPid = pid;
+                    listed = true;
+                }
+                break;
+        }
+
+        pids.insert(pid);
+
+        i += 5 + (((pSection[i + 3] & 0x0f) << 8) | pSection[i + 4]);
+    }
+
+    if (0 == keyPid)
+    {
+        keyPid = TIVO_KEY_PID;
+        while (pids.find(keyPid) != pids.end())
+            keyPid--;
+    }
+
+    if (true == listed)
+        return;
+
+    if (1 + pointer + total + 5 > len)
+    {
+        if (log_limited(&logCount))
+            std::fprintf(stderr, "no room for the key PID in the PMT\n");
+        return;
+    }
+
+    std::memcpy(section, pSection, total - 4);
+    section[total - 4] = 0x97;
+    put16(&section[total - 3], 0xe000 | keyPid);
+    put16(&section[total - 1], 0xf000);
+    total += 5;
+    put16(&section[1], (pSection[1] & 0xf0) << 8 | (total - 3));
+    put32(&section[total - 4], ts_crc32(section, total - 4));
+
+    std::memcpy(pSection, section, total);
+    std::memset(pSection + total, 0xff, len - 1 - pointer - total);
+}
+
+/*
+ * The clear length of a PES start, as TiVoDecoderTsStream::addPkt() works
+ * it out, or -1 when the headers run to the end of the packet.
+ */
+int TsEncoder::headerLength(const uint8_t *pPayload, int len)
+{
+    uint16_t bits = 0;
+
+    std::memset(parseBuffer, 0, sizeof(parseBuffer));
+    std::memcpy(parseBuffer, pPayload, len);
+
+    pParser->pesHdrLengths.clear();
+    if (false == pParser->getPesHdrLength(parseBuffer, len))
+        return -1;
+
+    for (TsLengths_it it = pParser->pesHdrLengths.begin();
+         it != pParser->pesHdrLengths.end(); it++)
+        bits += *it;
+
+    return (bits / 8 < len) ? bits / 8 : -1;
+}
+
+bool TsEncoder::encodePES(uint8_t *pPkt, int offset, TsEncodeStream *pStream)
+{
+    uint8_t *pPayload = pPkt + offset;
+    int len = TS_FRAME_SIZE - offset;
+    int clear = headerLength(pPayload, len);
+
+    if ((len >= 4) && (0x00 == pPayload[0]) && (0x00 == pPayload[1]) &&
+        (0x01 == pPayload[2]) && (0 == pStream->streamId))
+        pStream->streamId = pPayload[3];
+
+    if (pStream->blockBytes >= pState->blockSize)
+        newBlock(pStream);
+
+    uint8_t plain[TS_FRAME_SIZE];
+    std::memcpy(plain, pPayload, len);
+
+    // The decoder finds the end of the headers by parsing on into the
+    // scrambled bytes, which may read as stuffing or header bits.  Try a
+    // few blocks for one whose keystream leaves the same clear length.
+    // The keystream runs on from packet to packet within a block, so a
+    // block used for a failed try is dropped.
+    pStream->scrambling = false;
+
+    for (int tries = 0; (clear >= 0) && (0 != pStream->streamId) &&
+         (tries < 8); tries++)
+    {
+        if (tries > 0)
+            std::memcpy(pPayload, plain, len);
+
+        pTuring->prepare_frame(pStream->streamId, pStream->block);
+        pTuring->decrypt_buffer(pPayload + clear, len - clear);
+
+        if (headerLength(pPayload, len) == clear)
+        {
+            pStream->scrambling = true;
+            break;
+        }
+
+        newBlock(pStream);
+    }
+
+    if (false == pStream->scrambling)
+    {
+        std::memcpy(pPayload, plain, len);
+        pState->clear += len;
+        return write(pPkt);
+    }
+
+    bool rekey = !pStream->keyed ||
+                 ((pState->keyEvery > 0) &&
+                  (0 == pStream->pesCount % pState->keyEvery));
+
+    if ((true == rekey) && (false == sendKeys()))
+        return false;
+
+    pPkt[3] |= 0xC0;
+    pStream->pesCount++;
+    pStream->blockBytes += len - clear;
+    pState->scrambled += len - clear;
+    pState->clear += clear;
+
+    return write(pPkt);
+}
+
+bool TsEncoder::packet(uint8_t *pPkt)
+{
+    uint16_t pid = ((pPkt[1] & 0x1f) << 8) | pPkt[2];
+    bool pusi = (pPkt[1] & 0x40) ? true : false;
+    int offset = 4 + ((pPkt[3] & 0x20) ? 1 + pPkt[4] : 0);
+
+    if (!(pPkt[3] & 0x10) || (offset >= TS_FRAME_SIZE) || (pPkt[3] & 0xC0))
+        return write(pPkt);
+
+    if (0x0000 == pid)
+    {
+        if (true == pusi)
+            handlePAT(pPkt + offset, TS_FRAME_SIZE - offset);
+        return write(pPkt);
+    }
+
+    if ((pid == keyPid) && (0 != keyPid))
+        return true;
+
+    if ((pid == pmtPid) && (0 != pmtPid))
+    {
+        if (true == pusi)
+            handlePMT(pPkt, offset);
+        return write(pPkt);
+    }
+
+    TsEncodeStreams::iterator it = streams.find(pid);
+    if (it == streams.end())
+        return write(pPkt);
+
+    TsEncodeStream *pStream = &it->second;
+
+    if (true == pusi)
+        return encodePES(pPkt, offset, pStream);
+
+    if (false == pStream->scrambling)
+    {
+        pState->clear += TS_FRAME_SIZE - offset;
+        return write(pPkt);
+    }
+
+    pTuring->prepare_frame(pStream->streamId, pStream->block);
+    pTuring->decrypt_buffer(pPkt + offset, TS_FRAME_SIZE - offset);
+    pPkt[3] |= 0xC0;
+
+    pStream->blockBytes += TS_FRAME_SIZE - offset;
+    pState->scrambled += TS_FRAME_SIZE - offset;
+
+    return write(pPkt);
+}
+
+// ===================================================================
+
+typedef struct
+{
+    int      block;
+    uint64_t blockBytes;
+} PsEncodeStream;
+
+/*
+ * Scrambles program stream PES packets.  Each one gets a PES extension
+ * carrying its key.  TiVoDecoderPS expects the extension to be the first
+ * optional header field, so only packets with no other fields (no PTS)
+ * or with just that extension can be scrambled; the rest go out in the
+ * clear.
+ */
+class PsEncoder
+{
+    private:
+        TuringState    *pTuring;
+        HappyFile      *pOut;
+        EncodeState    *pState;
+        PsEncodeStream  streams[256];
+        uint8_t         packet[6 + 65535 + PS_EXT_SIZE];
+
+    public:
+        bool raw(const uint8_t *pData, size_t len);
+        bool pes(const uint8_t *pPes, size_t len);
+
+        PsEncoder(TuringState *pTuringState, HappyFile *pOutfile,
+                  EncodeState *pEncodeState);
+};
+
+PsEncoder::PsEncoder(TuringState *pTuringState, HappyFile *pOutfile,
+                     EncodeState *pEncodeState)
+{
+    pTuring = pTuringState;
+    pOut    = pOutfile;
+    pState  = pEncodeState;
+
+    for (int i = 0; i < 256; i++)
+    {
+        streams[i].block      = -1;
+        streams[i].blockBytes = 0;
+    }
+}
+
+bool PsEncoder::raw(const uint8_t *pData, size_t len)
+{
+    if (pOut->write((void *)pData, len) != len)
+    {
+        std::perror("writing output");
+        return false;
+    }
+
+    return true;
+}
+
+bool PsEncoder::pes(const uint8_t *pPes, size_t len)
+{
+    uint8_t code = pPes[3];
+    bool av = (0xbd == code) || ((code >= 0xc0) && (code <= 0xef));
+
+    if (!av || (len < 9) || ((pPes[6] & 0xc0) != 0x80) || (pPes[6] & 0x30))
+        return raw(pPes, len);
+
+    int dataLen = pPes[8];
+    size_t payload = 9 + dataLen;
+
+    // a decoded TiVo packet already has the extension: reuse it
+    bool keyed = (0x01 == pPes[7]) && (dataLen >= PS_EXT_SIZE) &&
+                 (payload <= len) && (0x80 == pPes[9]);
+    size_t grow = keyed ? 0 : PS_EXT_SIZE;
+
+    if ((payload > len) || (!keyed && (0 != pPes[7])) ||
+        (5 + dataLen + grow > PS_HEADER_MAX) || (len - 6 + grow > 0xffff))
+    {
+        pState->clear += len - 9;
+        return raw(pPes, len);
+    }
+
+    PsEncodeStream *pStream = &streams[code];
+
+    if ((pStream->block < 0) || (pStream->blockBytes >= pState->blockSize))
+    {
+        pStream->block = (pStream->block < 0) ?
+            (int)pState->pRandom->range(1, 0x1000) :
+            ((pStream->block + 1) & 0xffffff);
+        pStream->blockBytes = 0;
+        pState->blocks++;
+    }
+
+    if (true == keyed)
+        std::memcpy(packet, pPes, len);
+    else
+    {
+        std::memcpy(packet, pPes, 6);
+        put16(&packet[4], (uint16_t)(len - 6 + PS_EXT_SIZE));
+        packet[7] = 0x01;
+        packet[8] = dataLen + PS_EXT_SIZE;
+        packet[9] = 0x80;
+        std::memcpy(&packet[9 + PS_EXT_SIZE], &pPes[9], len - 9);
+    }
+
+    packet[6] = pPes[6] | 0x30;
+    make_key(&packet[10], pStream->block, pState->pRandom);
+
+    uint8_t crypted[4];
+    pTuring->prepare_frame(code, pStream->block);
+    pTuring->decrypt_buffer(crypted, 4);
+    pTuring->decrypt_buffer(&packet[payload + grow], len - payload);
+
+    pStream->blockBytes += len - payload;
+    pState->scrambled += len - payload;
+
+    return raw(packet, len + grow);
+}
+
+// ===================================================================
+
+/*
+ * Synthetic MPEG-2: sequence, GOP and picture headers, CEA-608 captions
+ * in picture user data, and slices of noise, with AC-3 shaped audio.
+ */
+class Synthetic
+{
+    private:
+        Random  *pRandom;
+        uint8_t *pBuffer;
+        size_t   bufferLen;
+        const char *caption;
+        size_t   captionPos;
+
+        void  append(const uint8_t *pData, size_t len);
+        void  captions();
+
+    public:
+        uint64_t pts;
+        uint32_t frame;
+
+        const uint8_t *video(size_t *pLen);
+        const uint8_t *audio(size_t *pLen);
+        bool           keyframe() { return 0 == frame % 12; }
+
+        Synthetic(Random *pRand);
+        ~Synthetic();
+};
+
+Synthetic::Synthetic(Random *pRand)
+{
+    pRandom    = pRand;
+    pBuffer    = new uint8_t[128 * 1024];
+    bufferLen  = 0;
+    caption    = "TIVOENCODE SYNTHETIC CAPTION TEXT ";
+    captionPos = 0;
+    pts        = 90000;
+    frame      = 0;
+}
+
+Synthetic::~Synthetic()
+{
+    delete [] pBuffer;
+}
+
+void Synthetic::append(const uint8_t *pData, size_t len)
+{
+    std::memcpy(pBuffer + bufferLen, pData, len);
+    bufferLen += len;
+}
+
+static inline uint8_t odd_parity(uint8_t c)
+{
+    uint8_t bits = c & 0x7f;
+    int ones = 0;
+
+    for (int i = 0; i < 7; i++)
+        ones += (bits >> i) & 1;
+
+    return (ones & 1) ? bits : (bits | 0x80);
+}
+
+// ATSC A/53 user data: one field 1 pair of caption text, one empty pair
+void Synthetic::captions()
+{
+    uint8_t cc[] = {
+        0x00, 0x00, 0x01, 0xb2, 'G', 'A', '9', '4', 0x03, 0x40 | 2, 0xff,
+        0xfc, 0x80, 0x80,
+        0xfd, 0x80, 0x80,
+        0xff
+    };
+    size_t captionLen = std::strlen(caption);
+
+    cc[12] = odd_parity(caption[captionPos++ % captionLen]);
+    cc[13] = odd_parity(caption[captionPos++ % captionLen]);
+    append(cc, sizeof(cc));
+}
+
+const uint8_t *Synthetic::video(size_t *pLen)
+{
+    static const uint8_t sequence[] = {
+        0x00, 0x00, 0x01, 0xb3, 0x2d, 0x01, 0xe0, 0x24, 0xff, 0xff, 0xe0, 0x18,
+        0x00, 0x00, 0x01, 0xb5, 0x14, 0x8a, 0x00, 0x01, 0x00, 0x00,
+        0x00, 0x00, 0x01, 0xb8, 0x00, 0x08, 0x00, 0x00
+    };
+    static const uint8_t coding_ext[] = {
+        0x00, 0x00, 0x01, 0xb5, 0x8f, 0xff, 0xf3, 0x41, 0x80
+    };
+
+    int type = keyframe() ? 1 : ((0 == frame % 3) ? 2 : 3);
+    uint32_t v = ((frame % 1024) << 19) | (type << 16) | 0xffff;
+    uint8_t picture[] = {
+        0x00, 0x00, 0x01, 0x00, (uint8_t)(v >> 21), (uint8_t)(v >> 13),
+        (uint8_t)(v >> 5), (uint8_t)(v << 3), (uint8_t)(2 == type ? 0x80 : 0x88)
+    };
+
+    bufferLen = 0;
+
+    if (1 == type)
+        append(sequence, sizeof(sequence));
+    append(picture, (1 == type) ? 8 : 9);
+    append(coding_ext, sizeof(coding_ext));
+    captions();
+
+    size_t target = (1 == type) ? pRandom->range(20000, 60000) :
+                                  pRandom->range(3000, 20000);
+    uint8_t slice = 1;
+
+    while (bufferLen < target)
+    {
+        size_t n = pRandom->range(40, 400);
+        uint8_t start[] = { 0x00, 0x00, 0x01, slice };
+
+        append(start, sizeof(start));
+        pRandom->fill(pBuffer + bufferLen, n);
+        pBuffer[bufferLen] |= 0x01;     // no zero run across the start
+        bufferLen += n;
+        slice = (slice % 0xaf) + 1;
+    }
+
+    *pLen = bufferLen;
+    return pBuffer;
+}
+
+const uint8_t *Synthetic::audio(size_t *pLen)
+{
+    bufferLen = pRandom->range(600, 1600);
+    pRandom->fill(pBuffer, bufferLen);
+    pBuffer[0] = 0x0b;
+    pBuffer[1] = 0x77;
+
+    *pLen = bufferLen;
+    return pBuffer;
+}
+
+#define SYNTH_PMT_PID   0x0020
+#define SYNTH_VIDEO_PID 0x1011
+#define SYNTH_AUDIO_PID 0x1100
+
+class SyntheticTs
+{
+    private:
+        TsEncoder *pEncoder;
+        Random    *pRandom;
+        Synthetic  synth;
+        uint8_t    cc[0x2000];
+        uint64_t   written;
+
+        bool  packet(uint16_t pid, bool pusi, const uint8_t *pData,
+                     size_t len, const uint8_t *pAdapt, size_t adaptLen);
+        bool  section(uint16_t pid, uint8_t *pSection, size_t len);
+        bool  pes(uint16_t pid, uint8_t streamId, const uint8_t *pData,
+                  size_t len, bool pcr);
+
+    public:
+        bool  run(uint64_t size);
+
+        SyntheticTs(TsEncoder *pTsEncoder, Random *pRand)
+            : pEncoder(pTsEncoder), pRandom(pRand), synth(pRand), written(0)
+            { std::memset(cc, 0, sizeof(cc)); }
+};
+
+// One packet with up to 184 bytes of data, stuffing with the adaptation
+// field as needed.
+bool SyntheticTs::packet(uint16_t pid, bool pusi, const uint8_t *pData,
+                         size_t len, const uint8_t *pAdapt, size_t adaptLen)
+{
+    uint8_t pkt[TS_FRAME_SIZE];
+    size_t room = TS_FRAME_SIZE - 4;
+
+    pkt[0] = 0x47;
+    pkt[1] = (pusi ? 0x40 : 0x00) | (pid >> 8);
+    pkt[2] = pid & 0xff;
+    pkt[3] = 0x10 | cc[pid];
+    cc[pid] = (cc[pid] + 1) & 0x0f;
+
+    if (adaptLen || (len < room))
+    {
+        size_t afLen = room - 1 - len;     // adaptation_field_length
+
+        pkt[3] |= 0x20;
+        pkt[4] = afLen;
+        if (afLen > 0)
+        {
+            std::memset(&pkt[5], 0xff, afLen);
+            pkt[5] = 0x00;
+            if (adaptLen)
+                std::memcpy(&pkt[5], pAdapt, adaptLen);
+        }
+        room -= 1 + afLen;
+    }
+
+    std::memcpy(&pkt[TS_FRAME_SIZE - room], pData, len);
+    written += TS_FRAME_SIZE;
+
+    return pEncoder->packet(pkt);
+}
+
+bool SyntheticTs::section(uint16_t pid, uint8_t *pSection, size_t len)
+{
+    uint8_t payload[TS_FRAME_SIZE - 4];
+
+    put32(&pSection[len - 4], ts_crc32(pSection, len - 4));
+    std::memset(payload, 0xff, sizeof(payload));
+    payload[0] = 0;
+    std::memcpy(&payload[1], pSection, len);
+
+    return packet(pid, true, payload, sizeof(payload), NULL, 0);
+}
+
+bool SyntheticTs::pes(uint16_t pid, uint8_t streamId, const uint8_t *pData,
+                      size_t len, bool pcr)
+{
+    uint8_t header[14] = {
+        0x00, 0x00, 0x01, streamId, 0x00, 0x00, 0x80, 0x80, 0x05
+    };
+    uint8_t chunk[TS_FRAME_SIZE];
+    uint8_t adapt[7];
+    size_t adaptLen = 0;
+
+    if (0xe0 != streamId)
+        put16(&header[4], len + 8);
+    put_pts(&header[9], 0x2, synth.pts);
+
+    if (true == pcr)
+    {
+        uint64_t base = synth.pts - 9000;
+
+        adapt[0] = 0x10;
+        adapt[1] = base >> 25;
+        adapt[2] = base >> 17;
+        adapt[3] = base >> 9;
+        adapt[4] = base >> 1;
+        adapt[5] = ((base & 1) << 7) | 0x7e;
+        adapt[6] = 0x00;
+        adaptLen = sizeof(adapt);
+    }
+
+    // first packet: the PES header and as much data as fits
+    size_t room = TS_FRAME_SIZE - 4 - (adaptLen ? 1 + adaptLen : 0);
+    size_t n = room - sizeof(header);
+
+    if (n > len)
+        n = len;
+
+    std::memcpy(chunk, header, sizeof(header));
+    std::memcpy(chunk + sizeof(header), pData, n);
+    if (false == packet(pid, true, chunk, sizeof(header) + n, adapt, adaptLen))
+        return false;
+
+    for (size_t pos = n; pos < len; pos += n)
+    {
+        n = len - pos;
+        if (n > TS_FRAME_SIZE - 4)
+            n = TS_FRAME_SIZE - 4;
+
+        if (false == packet(pid, false, pData + pos, n, NULL, 0))
+            return false;
+    }
+
+    return true;
+}
+
+bool SyntheticTs::run(uint64_t size)
+{
+    uint8_t pat[] = {
+        0x00, 0xb0, 0x0d, 0x00, 0x01, 0xc1, 0x00, 0x00,
+        0x00, 0x01, 0xe0 | (SYNTH_PMT_PID >> 8), SYNTH_PMT_PID & 0xff,
+        0, 0, 0, 0
+    };
+    uint8_t pmt[] = {
+        0x02, 0xb0, 0x17, 0x00, 0x01, 0xc1, 0x00, 0x00,
+        0xe0 | (SYNTH_VIDEO_PID >> 8), SYNTH_VIDEO_PID & 0xff, 0xf0, 0x00,
+        0x02, 0xe0 | (SYNTH_VIDEO_PID >> 8), SYNTH_VIDEO_PID & 0xff,
+        0xf0, 0x00,
+        0x81, 0xe0 | (SYNTH_AUDIO_PID >> 8), SYNTH_AUDIO_PID & 0xff,
+        0xf0, 0x00,
+        0, 0, 0, 0
+    };
+
+    while (written < size)
+    {
+        const uint8_t *pData;
+        size_t len;
+
+        if (0 == synth.frame % 6)
+        {
+            if (!section(0x0000, pat, sizeof(pat)) ||
+                !section(SYNTH_PMT_PID, pmt, sizeof(pmt)))
+                return false;
+        }
+
+        pData = synth.video(&len);
+        if (false == pes(SYNTH_VIDEO_PID, 0xe0, pData, len, true))
+            return false;
+
+        for (int i = 0; i < 2; i++)
+        {
+            pData = synth.audio(&len);
+            if (false == pes(SYNTH_AUDIO_PID, 0xbd, pData, len, false))
+                return false;
+        }
+
+        synth.pts += 3003;
+        synth.frame++;
+    }
+
+    return true;
+}
+
+class SyntheticPs
+{
+    private:
+        PsEncoder *pEncoder;
+        Random    *pRandom;
+        Synthetic  synth;
+        uint8_t    packet[6 + 65535];
+        uint64_t   written;
+
+        // --pes-size: the video not yet sent, and where in it the first
+        // picture without a PTS starts and its PTS
+        size_t     pesSize;
+        uint8_t   *pVideo;
+        size_t     videoLen;
+        size_t     ptsAt;
+        int64_t    videoPts;
+
+        bool  pack();
+        bool  pes(uint8_t streamId, const uint8_t *pData, size_t len,
+                  int64_t pts);
+        bool  video(const uint8_t *pData, size_t len, bool all);
+
+    public:
+        bool  run(uint64_t size);
+
+        SyntheticPs(PsEncoder *pPsEncoder, Random *pRand, size_t pes)
+            : pEncoder(pPsEncoder), pRandom(pRand), synth(pRand), written(0),
+              pesSize(pes), videoLen(0), ptsAt(0), videoPts(-1)
+            { pVideo = pes ? new uint8_t[pes + 128 * 1024] : NULL; }
+        ~SyntheticPs()
+            { delete [] pVideo; }
+};
+
+bool SyntheticPs::pack()
+{
+    static const uint8_t header[] = {
+        0x00, 0x00, 0x01, 0xba, 0x44, 0x00, 0x04, 0x00, 0x04, 0x01,
+        0x01, 0x89, 0xc3, 0xf8
+    };
+
+    written += sizeof(header);
+    return pEncoder->raw(header, sizeof(header));
+}
+
+bool SyntheticPs::pes(uint8_t streamId, const uint8_t *pData, size_t len,
+                      int64_t pts)
+{
+    size_t header = (pts >= 0) ? 14 : 9;
+
+    packet[0] = 0x00;
+    packet[1] = 0x00;
+    packet[2] = 0x01;
+    packet[3] = streamId;
+    put16(&packet[4], header - 6 + len);
+    packet[6] = 0x80;
+    packet[7] = (pts >= 0) ? 0x80 : 0x00;
+    packet[8] = (pts >= 0) ? 5 : 0;
+    if (pts >= 0)
+        put_pts(&packet[9], 0x2, pts);
+    std::memcpy(&packet[header], pData, len);
+
+    written += header + len;
+    return pEncoder->pes(packet, header + len);
+}
+
+/*
+ * --pes-size: add a picture to the video and send what makes up whole
+ * packets, or all of it.  A packet carries the PTS of the first picture
+ * that starts in it; any other starting there goes without.
+ */
+bool SyntheticPs::video(const uint8_t *pData, size_t len, bool all)
+{
+    if (len)
+    {
+        if (videoPts < 0)
+        {
+            ptsAt    = videoLen;
+            videoPts = synth.pts;
+        }
+
+        std::memcpy(pVideo + videoLen, pData, len);
+        videoLen += len;
+    }
+
+    size_t pos = 0;
+
+    while ((videoLen - pos >= pesSize) || (all && (pos < videoLen)))
+    {
+        size_t n = std::min(pesSize, videoLen - pos);
+        bool pts = (videoPts >= 0) && (ptsAt < pos + n);
+
+        if (((pos > 0) && (false == pack())) ||
+            (false == pes(0xe0, pVideo + pos, n, pts ? videoPts : -1)))
+            return false;
+
+        if (pts)
+            videoPts = -1;
+        pos += n;
+    }
+
+    std::memmove(pVideo, pVideo + pos, videoLen - pos);
+    videoLen -= pos;
+    ptsAt    -= std::min(ptsAt, pos);
+
+    return true;
+}
+
+bool SyntheticPs::run(uint64_t size)
+{
+    static const uint8_t system[] = {
+        0x00, 0x00, 0x01, 0xbb, 0x00, 0x0c, 0x80, 0x01, 0x01, 0x04,
+        0xe1, 0xff, 0xe0, 0xe0, 0xe8, 0xc0, 0xc0, 0x20
+    };
+    static const uint8_t end[] = { 0x00, 0x00, 0x01, 0xb9 };
+
+    while (written < size)
+    {
+        const uint8_t *pData;
+        size_t len;
+
+        if (false == pack())
+            return false;
+
+        if ((0 == synth.frame % 40) &&
+            (false == pEncoder->raw(system, sizeof(system))))
+            return false;
+
+        // a frame over several PES packets, only the first with a PTS
+        pData = synth.video(&len);
+        if (pesSize)
+        {
+            if (false == video(pData, len, false))
+                return false;
+        }
+        else for (size_t pos = 0; pos < len;)
+        {
+            size_t n = pRandom->range(1000, 2028);
+
+            if (n > len - pos)
+                n = len - pos;
+
+            if (((pos > 0) && (false == pack())) ||
+                (false == pes(0xe0, pData + pos, n,
+                              (0 == pos) ? (int64_t)synth.pts : -1)))
+                return false;
+            pos += n;
+        }
+
+        pData = synth.audio(&len);
+        if ((false == pack()) ||
+            (false == pes(0xc0, pData, len,
+                          (0 == synth.frame % 4) ? (int64_t)synth.pts : -1)))
+            return false;
+
+        synth.pts += 3003;
+        synth.frame++;
+    }
+
+    if (videoLen && ((false == pack()) || (false == video(NULL, 0, true))))
+        return false;
+
+    return pEncoder->raw(end, sizeof(end));
+}
+
+// ===================================================================
+
+// A read window over the input, for a parser that needs to look ahead.
+class InputWindow
+{
+    private:
+        HappyFile *pIn;
+        uint8_t   *pBuffer;
+        size_t     start;
+        size_t     end;
+
+    public:
+        // make len bytes available if the input has them; returns the count
+        size_t fill(size_t len)
+        {
+            if (end - start >= len)
+                return end - start;
+
+            std::memmove(pBuffer, pBuffer + start, end - start);
+            end  -= start;
+            start = 0;
+            end  += pIn->read(pBuffer + end, WINDOW_SIZE - end);
+
+            return end - start;
+        }
+
+        inline const uint8_t *data()      { return pBuffer + start; }
+        inline void consume(size_t len)   { start += len; }
+
+        InputWindow(HappyFile *pInfile) : pIn(pInfile), start(0), end(0)
+            { pBuffer = new uint8_t[WINDOW_SIZE]; }
+        ~InputWindow()
+            { delete [] pBuffer; }
+};
+
+static bool encode_ts_file(InputWindow *pWindow, TsEncoder *pEncoder)
+{
+    uint8_t pkt[TS_FRAME_SIZE];
+
+    while (pWindow->fill(TS_FRAME_SIZE) >= TS_FRAME_SIZE)
+    {
+        const uint8_t *pData = pWindow->data();
+
+        if (0x47 != pData[0])
+        {
+            // out of sync: drop bytes up to the next sync byte
+            pWindow->consume(1);
+            continue;
+        }
+
+        std::memcpy(pkt, pData, TS_FRAME_SIZE);
+        pWindow->consume(TS_FRAME_SIZE);
+
+        if (false == pEncoder->packet(pkt))
+            return false;
+    }
+
+    return true;
+}
+
+static bool encode_ps_file(InputWindow *pWindow, PsEncoder *pEncoder)
+{
+    size_t avail;
+
+    while ((avail = pWindow->fill(6)) >= 4)
+    {
+        const uint8_t *pData = pWindow->data();
+        size_t len;
+
+        if ((0x00 != pData[0]) || (0x00 != pData[1]) || (0x01 != pData[2]))
+        {
+            // copy through to the next start code
+            for (len = 1; len + 3 <= avail; len++)
+                if ((0x00 == pData[len]) && (0x00 == pData[len + 1]) &&
+                    (0x01 == pData[len + 2]))
+                    break;
+            if (len + 3 > avail)
+                len = avail - 2;
+
+            if (false == pEncoder->raw(pData, len))
+                return false;
+            pWindow->consume(len);
+            continue;
+        }
+
+        uint8_t code = pData[3];
+
+        if (0xba == code)
+        {
+            avail = pWindow->fill(14);
+            pData = pWindow->data();
+            len = ((avail >= 14) && (0x40 == (pData[4] & 0xc0))) ?
+                  14 + (pData[13] & 0x07) : 12;
+        }
+        else if ((code >= 0xbb) && (avail >= 6))
+            len = 6 + ((pData[4] << 8) | pData[5]);
+        else
+            len = 4;
+
+        avail = pWindow->fill(len);
+        pData = pWindow->data();
+
+        if (avail < len)
+            len = avail;
+
+        if (((code >= 0xbb) && (false == pEncoder->pes(pData, len))) ||
+            ((code < 0xbb) && (false == pEncoder->raw(pData, len))))
+            return false;
+
+        pWindow->consume(len);
+    }
+
+    // trailing bytes too short to hold a start code
+    return pEncoder->raw(pWindow->data(), avail);
+}
+
+// ===================================================================
+
+static uint64_t parse_size(const char *str)
+{
+    char *end = NULL;
+    double size = std::strtod(str, &end);
+
+    switch (end ? *end : 0)
+    {
+        case 'k': case 'K': size *= 1024.0;                   break;
+        case 'm': case 'M': size *= 1024.0 * 1024.0;          break;
+        case 'g': case 'G': size *= 1024.0 * 1024.0 * 1024.0; break;
+    }
+
+    return (size > 0) ? (uint64_t)size : 0;
+}
+
+static void chunk_fill(TiVoStreamChunk *pChunk, uint16_t id, uint16_t type,
+                       const std::string &data)
+{
+    pChunk->id        = id;
+    pChunk->type      = type;
+    pChunk->dataSize  = data.size();
+    pChunk->chunkSize = pChunk->size() + data.size();
+    pChunk->pData     = new uint8_t[data.size()];
+    std::memcpy(pChunk->pData, data.data(), data.size());
+}
+
+static bool chunk_write(HappyFile *pOut, TiVoStreamChunk *pChunk)
+{
+    uint8_t hdr[12];
+
+    put32(&hdr[0], pChunk->chunkSize);
+    put32(&hdr[4], pChunk->dataSize);
+    put16(&hdr[8], pChunk->id);
+    put16(&hdr[10], pChunk->type);
+
+    return (pOut->write(hdr, sizeof(hdr)) == sizeof(hdr)) &&
+           pChunk->write(pOut);
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t o_synthetic = 0;
+    int o_format = TIVO_FORMAT_NONE;
+    uint32_t o_block_size = 1 << 20;
+    uint32_t o_key_every = 32;
+    uint64_t o_seed = 1;
+    const char *o_title = "Synthetic";
+    size_t o_pes_size = 0;
+    int makgiven = 0;
+
+    const char *mpegfile = NULL;
+    const char *outfile  = NULL;
+
+    char mak[12];
+    std::memset(mak, 0, sizeof(mak));
+
+    TuringState turing;
+    std::memset(&turing, 0, sizeof(turing));
+
+    TuringState metaturing;
+    std::memset(&metaturing, 0, sizeof(metaturing));
+
+    HappyFile *hfh = NULL, *ofh = NULL;
+
+    while (1)
+    {
+        int c = getopt_long(argc, argv, "m:o:S:F:b:k:s:T:P:vVh",
+                            long_options, 0);
+
+        if (c == -1)
+            break;
+
+        switch (c)
+        {
+            case 'm':
+                std::strncpy(mak, optarg, 11);
+                mak[11] = '\0';
+                makgiven = 1;
+                break;
+            case 'o':
+                outfile = optarg;
+                break;
+            case 'S':
+                if (0 == (o_synthetic = parse_size(optarg)))
+                    do_help(argv[0], 4);
+                break;
+            case 'F':
+                if (!std::strcmp(optarg, "ts"))
+                    o_format = TIVO_FORMAT_TS;
+                else if (!std::strcmp(optarg, "ps"))
+                    o_format = TIVO_FORMAT_PS;
+                else
+                    do_help(argv[0], 4);
+                break;
+            case 'b':
+                if (0 == (o_block_size = (uint32_t)parse_size(optarg)))
+                    do_help(argv[0], 4);
+                break;
+            case 'k':
+                o_key_every = std::atoi(optarg);
+                break;
+            case 's':
+                o_seed = std::strtoull(optarg, NULL, 0);
+                break;
+            case 'T':
+                o_title = optarg;
+                break;
+            case 'P':
+                o_pes_size = (size_t)parse_size(optarg);
+                if ((0 == o_pes_size) || (o_pes_size > 65000))
+                    do_help(argv[0], 4);
+                break;
+            case 'v':
+                o_verbose++;
+                break;
+            case 'h':
+                do_help(argv[0], 1);
+                break;
+            case '?':
+                do_help(argv[0], 2);
+                break;
+            case 'V':
+                do_version(10);
+                break;
+            default:
+                do_help(argv[0], 3);
+                break;
+        }
+    }
+
+    o_log_level = o_verbose;
+
+    if (!makgiven)
+        makgiven = get_mak_from_conf_file(mak);
+
+    if (optind < argc)
+    {
+        mpegfile = argv[optind++];
+        if (optind < argc)
+            do_help(argv[0], 4);
+    }
+
+    if (!makgiven || (!mpegfile == !o_synthetic))
+        do_help(argv[0], 5);
+
+    print_qualcomm_msg();
+
+    InputWindow *pWindow = NULL;
+
+    if (mpegfile)
+    {
+        hfh = new HappyFile;
+
+        if (!std::strcmp(mpegfile, "-"))
+        {
+            if (!hfh->attach(stdin))
+                return 10;
+        }
+        else if (!hfh->open(mpegfile, "rb"))
+        {
+            std::perror(mpegfile);
+            return 6;
+        }
+
+        pWindow = new InputWindow(hfh);
+
+        if (TIVO_FORMAT_NONE == o_format)
+        {
+            const uint8_t *pData = pWindow->data();
+            size_t avail = pWindow->fill(TS_FRAME_SIZE + 1);
+
+            if ((avail > TS_FRAME_SIZE) && (0x47 == pData[0]) &&
+                (0x47 == pData[TS_FRAME_SIZE]))
+                o_format = TIVO_FORMAT_TS;
+            else if ((avail >= 4) && (0x00 == pData[0]) &&
+                     (0x00 == pData[1]) && (0x01 == pData[2]) &&
+                     (0xba == pData[3]))
+                o_format = TIVO_FORMAT_PS;
+            else
+            {
+                std::fprintf(stderr, "%s: not a transport or program "
+                             "stream, use --format\n", mpegfile);
+                return 8;
+            }
+        }
+    }
+    else if (TIVO_FORMAT_NONE == o_format)
+        o_format = TIVO_FORMAT_TS;
+
+    if (o_pes_size && (!o_synthetic || (TIVO_FORMAT_PS != o_format)))
+        do_help(argv[0], 5);
+
+    ofh = new HappyFile;
+
+    if (!outfile || !std::strcmp(outfile, "-"))
+    {
+        if (!ofh->attach(stdout))
+            return 10;
+    }
+    else if (!ofh->open(outfile, "wb"))
+    {
+        std::perror("opening output file");
+        return 7;
+    }
+
+    // the same metadata chunks tivodecode reads the keys from
+    std::string program = std::string("<program><title>") + o_title +
+        "</title><episodeTitle>tivoencode</episodeTitle>"
+        "<seriesTitle>" + o_title + "</seriesTitle>"
+        "<showType>SERIES</showType><episodeNumber>101</episodeNumber>"
+        "</program>";
+    std::string xml = "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+        "<TvBusMarshalledStruct><showing>" + program +
+        "</showing></TvBusMarshalledStruct>";
+
+    TiVoStreamChunk chunks[2];
+    chunk_fill(&chunks[0], 1, TIVO_CHUNK_PLAINTEXT_XML, xml);
+    chunk_fill(&chunks[1], 2, TIVO_CHUNK_ENCRYPTED_XML, xml);
+
+    uint32_t chunk2 = 16 + chunks[0].chunkSize + chunks[1].size();
+    uint32_t mpeg_offset = (chunk2 + chunks[1].dataSize + 1023) & ~1023;
+
+    chunks[0].setupTuringKey(&turing, (uint8_t *)mak);
+    chunks[0].setupMetadataKey(&metaturing, (uint8_t *)mak);
+    chunks[1].decryptMetadata(&metaturing, (uint16_t)chunk2);
+    metaturing.destruct();
+
+    uint8_t header[16];
+    std::memcpy(header, "TiVo", 4);
+    put16(&header[4], 4);
+    put16(&header[6], (TIVO_FORMAT_TS == o_format) ? 0x2d : 0x0d);
+    put16(&header[8], 0);
+    put32(&header[10], mpeg_offset);
+    put16(&header[14], 2);
+
+    if ((ofh->write(header, sizeof(header)) != sizeof(header)) ||
+        !chunk_write(ofh, &chunks[0]) || !chunk_write(ofh, &chunks[1]))
+    {
+        std::perror("writing header");
+        return 7;
+    }
+
+    uint8_t pad[1024];
+    std::memset(pad, 0, sizeof(pad));
+    ofh->write(pad, mpeg_offset - chunk2 - chunks[1].dataSize);
+
+    Random random(o_seed);
+    EncodeState state;
+    bool ok;
+
+    std::memset(&state, 0, sizeof(state));
+    state.blockSize = o_block_size;
+    state.keyEvery  = o_key_every;
+    state.pRandom   = &random;
+
+    if (TIVO_FORMAT_TS == o_format)
+    {
+        TsEncoder encoder(&turing, ofh, &state);
+
+        if (pWindow)
+            ok = encode_ts_file(pWindow, &encoder);
+        else
+        {
+            SyntheticTs synthetic(&encoder, &random);
+            ok = synthetic.run(o_synthetic);
+        }
+
+        VERBOSE("%u key packets\n", encoder.keyPackets);
+    }
+    else
+    {
+        PsEncoder encoder(&turing, ofh, &state);
+
+        if (pWindow)
+            ok = encode_ps_file(pWindow, &encoder);
+        else
+        {
+            SyntheticPs synthetic(&encoder, &random, o_pes_size);
+            ok = synthetic.run(o_synthetic);
+        }
+    }
+
+    VERBOSE("%llu bytes scrambled, %llu clear, %u cipher blocks\n",
+            (unsigned long long)state.scrambled,
+            (unsigned long long)state.clear, state.blocks);
+
+    turing.destruct();
+
+    if (pWindow)
+    {
+        delete pWindow;
+        hfh->close();
+        delete hfh;
+    }
+
+    ofh->close();
+    delete ofh;
+
+    return ok ? 0 : 9;
+}
+
+/* vi:set ai ts=4 sw=4 expandtab: */
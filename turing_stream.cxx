@@ -77,6 +77,8 @@ product or in the associated documentation.
 #include "md5.hxx"
 #include "sha1.hxx"
 #include "Turing.hxx"		/* interface definitions */
+#include "profiler.hxx"
+#include "tivo_probes.hxx"
 #include "turing_stream.hxx"
 
 void TuringState::setup_key(uint8_t *buffer, size_t buffer_length,
@@ -84,6 +86,8 @@ void TuringState::setup_key(uint8_t *buffer, size_t buffer_length,
 {
     SHA1 context;
 
+    PROFILE(PROF_KEY);
+
     context.init();
     context.update((uint8_t *)mak, strlen(mak));
     context.update(buffer, buffer_length);
@@ -122,6 +126,17 @@ void TuringState::setup_metadata_key(uint8_t *buffer,
     setup_key(buffer, buffer_length, metakey);
 }
 
+/*
+ * Start an empty set of cipher contexts sharing pParent's file key, so
+ * that blocks can be decrypted independently of the parent's contexts.
+ */
+void TuringState::inherit_key(const TuringState *pParent)
+{
+    std::memcpy(turingkey, pParent->turingkey, sizeof(turingkey));
+    active = NULL;
+    spare  = NULL;
+}
+
 void TuringState::prepare_frame_helper(uint8_t stream_id, int block_id)
 {
     SHA1 context;
@@ -130,6 +145,17 @@ void TuringState::prepare_frame_helper(uint8_t stream_id, int block_id)
 
     active->stream_id = stream_id;
     active->block_id = block_id;
+    active->consumed = 0;
+    active->skipped = 0;
+    active->synced = true;
+    active->deferred = dry;
+
+    if (dry)
+        return;
+
+    TD_PROBE(block, stream_id, block_id);
+
+    PROFILE(PROF_KEY);
 
     turingkey[16] = stream_id;
     turingkey[17] = (block_id & 0xFF0000) >> 16;
@@ -158,11 +184,20 @@ void TuringState::prepare_frame_helper(uint8_t stream_id, int block_id)
 
 #define CREATE_TURING_LISTITM(nxt, stream_id, block_id) \
     do { \
-        active = new turing_state_stream; \
+        if (spare) \
+        { \
+            active = spare; \
+            spare  = spare->next; \
+        } \
+        else \
+        { \
+            active = new turing_state_stream; \
+            active->internal = new Turing; \
+        } \
         active->next = (nxt); \
         (nxt) = active; \
-        active->internal = new Turing; \
         prepare_frame_helper((stream_id), (block_id)); \
+        active->synced = !dry; \
     } while(0)
 
 void TuringState::prepare_frame(uint8_t stream_id, int block_id)
@@ -201,10 +236,27 @@ void TuringState::decrypt_buffer(uint8_t *buffer, size_t buffer_length)
 {
     unsigned int i;
 
+    active->consumed += buffer_length;
+
+    if (dry)
+        return;
+
+    if (active->skipped)
+    {
+        size_t skipped = active->skipped;
+
+        active->skipped = 0;
+        skip_data(skipped);
+    }
+
+    PROFILE(PROF_XOR);
+
     for (i = 0; i < buffer_length; ++i)
     {
         if (active->cipher_pos >= active->cipher_len)
         {
+            PROFILE(PROF_KEYSTREAM);
+
             active->cipher_len = active->internal->gen(active->cipher_data);
             active->cipher_pos = 0;
             //hexbulk(active->cipher_data, active->cipher_len);
@@ -214,8 +266,23 @@ void TuringState::decrypt_buffer(uint8_t *buffer, size_t buffer_length)
     }
 }
 
+/*
+ * Use up buffer_length bytes of the active stream's keystream for data that
+ * is left encrypted.  The keystream is only generated if a later
+ * decrypt_buffer() in the same block needs what comes after it.
+ */
+void TuringState::pass_buffer(size_t buffer_length)
+{
+    active->consumed += buffer_length;
+
+    if (!dry)
+        active->skipped += buffer_length;
+}
+
 void TuringState::skip_data(size_t bytes_to_skip)
 {
+    PROFILE(PROF_KEYSTREAM);
+
     if (active->cipher_pos + bytes_to_skip < (size_t)active->cipher_len)
         active->cipher_pos += (int)bytes_to_skip;
     else
@@ -231,23 +298,179 @@ void TuringState::skip_data(size_t bytes_to_skip)
     }
 }
 
-void TuringState::destruct()
+/*
+ * In a dry run the cipher contexts only keep track of the block and of how
+ * many bytes each stream has used, without generating keystream.  This is
+ * used to recover the cipher state at an arbitrary point of a recording by
+ * replaying the headers ahead of it.  A context created during a dry run
+ * counts as synced only once its stream moves to a new block, as the bytes
+ * used before that are unknown.
+ *
+ * Ending the dry run keys every context and advances it to the recorded
+ * position.
+ */
+void TuringState::dry_run(bool enable)
 {
+    if (enable || !dry)
+    {
+        dry = enable;
+        return;
+    }
+
+    dry = false;
+
     if (active)
     {
         turing_state_stream *start = active;
         do
         {
-            turing_state_stream *prev = active;
-            delete active->internal;
+            if (active->deferred)
+            {
+                size_t consumed = active->consumed;
+                bool synced = active->synced;
+
+                prepare_frame_helper(active->stream_id, active->block_id);
+                if (consumed)
+                    skip_data(consumed);
+
+                active->consumed = consumed;
+                active->synced = synced;
+            }
             active = active->next;
-            if (prev)
-                delete prev;
+        }
+        while (active != start);
+    }
+}
+
+bool TuringState::synced()
+{
+    if (!active)
+        return false;
+
+    turing_state_stream *cur = active;
+    do
+    {
+        if (!cur->synced)
+            return false;
+        cur = cur->next;
+    }
+    while (cur != active);
+
+    return true;
+}
+
+bool TuringState::synced(uint8_t stream_id)
+{
+    if (!active)
+        return false;
+
+    turing_state_stream *cur = active;
+    do
+    {
+        if (cur->stream_id == stream_id)
+            return cur->synced;
+        cur = cur->next;
+    }
+    while (cur != active);
+
+    return false;
+}
+
+/*
+ * Bytes stream_id has used of block block_id so far, or 0 if the stream is
+ * on another block.
+ */
+size_t TuringState::position(uint8_t stream_id, int block_id)
+{
+    if (!active)
+        return 0;
+
+    turing_state_stream *cur = active;
+    do
+    {
+        if (cur->stream_id == stream_id)
+        {
+            if (cur->block_id != (unsigned int)block_id)
+                return 0;
+            return cur->consumed;
+        }
+        cur = cur->next;
+    }
+    while (cur != active);
+
+    return 0;
+}
+
+// Every stream's block and the bytes it has used of it.
+void TuringState::positions(std::vector<turing_position> *pList)
+{
+    pList->clear();
+
+    if (!active)
+        return;
+
+    turing_state_stream *cur = active;
+    do
+    {
+        turing_position pos;
+        pos.stream_id = cur->stream_id;
+        pos.block_id  = cur->block_id;
+        pos.consumed  = cur->consumed;
+        pList->push_back(pos);
+
+        cur = cur->next;
+    }
+    while (cur != active);
+}
+
+/*
+ * Key the stream's context for a saved block and advance it to the saved
+ * position, as if the block had been decrypted up to there.
+ */
+void TuringState::restore(const turing_position *pPosition)
+{
+    prepare_frame(pPosition->stream_id, pPosition->block_id);
+
+    if (pPosition->consumed)
+        skip_data(pPosition->consumed);
+
+    active->consumed = pPosition->consumed;
+}
+
+/*
+ * Drop every stream's keys, as for a new file, but keep the contexts
+ * allocated for the streams which come next.
+ */
+void TuringState::reset()
+{
+    if (active)
+    {
+        turing_state_stream *start = active;
+        do
+        {
+            turing_state_stream *next = active->next;
+            active->next = spare;
+            spare  = active;
+            active = next;
         }
         while (active != start);
     }
 
     active = NULL;
+    dry    = false;
+}
+
+void TuringState::destruct()
+{
+    reset();
+
+    while (spare)
+    {
+        turing_state_stream *next = spare->next;
+        delete spare->internal;
+        delete spare;
+        spare = next;
+    }
 }
 
 void TuringState::dump()
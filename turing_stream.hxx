@@ -6,6 +6,8 @@
 #ifndef TURING_STREAM_H_
 #define TURING_STREAM_H_
 
+#include <vector>
+
 /*following copied from Turing.h, so we can avoid including it here */
 #define MAXSTREAM   340 /* bytes, maximum stream generated by one call */
 
@@ -17,26 +19,53 @@ typedef struct turing_state_stream
     unsigned int block_id;
     uint8_t stream_id;
 
+    size_t consumed;    /* bytes used since the block started */
+    size_t skipped;     /* of those, passed over by pass_buffer() and not
+                           yet skipped in the keystream */
+    bool deferred;      /* keying postponed by dry_run() */
+    bool synced;        /* the start of the current block was seen */
+
     struct turing_state_stream *next;
 
     Turing *internal;
     uint8_t cipher_data[MAXSTREAM + sizeof(uint64_t)];
 } turing_state_stream;
 
+/* a stream's place in its keystream, as saved in a seek index */
+typedef struct
+{
+    uint8_t stream_id;
+    unsigned int block_id;
+    size_t consumed;
+} turing_position;
+
 class TuringState
 {
     private:
         uint8_t turingkey[20];
         turing_state_stream *active;
+        bool dry;
+
+        // contexts put aside by reset(), keyed again when next needed
+        turing_state_stream *spare;
 
     public:
         void setup_key(uint8_t *buffer, size_t buffer_length, char *mak);
         void setup_metadata_key(uint8_t *buffer, size_t buffer_length,
                                 char *mak);
+        void inherit_key(const TuringState *pParent);
         void prepare_frame_helper(uint8_t stream_id, int block_id);
         void prepare_frame(uint8_t stream_id, int block_id);
         void decrypt_buffer(uint8_t *buffer, size_t buffer_length);
+        void pass_buffer(size_t buffer_length);
         void skip_data(size_t bytes_to_skip);
+        void dry_run(bool enable);
+        bool synced();
+        bool synced(uint8_t stream_id);
+        size_t position(uint8_t stream_id, int block_id);
+        void positions(std::vector<turing_position> *pList);
+        void restore(const turing_position *pPosition);
+        void reset();
         void destruct();
         void dump();
 };